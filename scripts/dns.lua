@@ -9,6 +9,9 @@ local std = require("pktizr.std")
 local local_addr = std.get_addr()
 local local_port = 64434
 
+-- only receive replies sent to our port
+filter = string.format("udp and dst port %u", local_port)
+
 local pkt_ip4 = pkt.IP()
 pkt_ip4.src = local_addr
 
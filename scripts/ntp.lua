@@ -12,6 +12,9 @@ local ntp_query = '\x17\x00\x03\x2a\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\
 local local_addr = std.get_addr()
 local local_port = 64434
 
+-- only receive replies sent to our port
+filter = string.format("udp and dst port %u", local_port)
+
 local pkt_ip4 = pkt.IP()
 pkt_ip4.src = local_addr
 
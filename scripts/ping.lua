@@ -9,6 +9,12 @@ local std = require("pktizr.std")
 local local_addr = std.get_addr()
 local local_port = 64434
 
+-- only receive ICMP replies
+filter = "icmp"
+
+-- only receive echo replies carrying one of our cookies
+validate = { proto = "icmp", port = local_port }
+
 local pkt_ip4  = pkt.IP()
 pkt_ip4.src = local_addr
 
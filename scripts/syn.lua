@@ -8,6 +8,15 @@ local std = require("pktizr.std")
 local local_addr = std.get_addr()
 local local_port = 64434
 
+-- only receive replies sent to our port
+filter = string.format("tcp and dst port %u", local_port)
+
+-- only receive replies acknowledging one of our SYN cookies
+validate = { proto = "tcp" }
+
+-- most replies are dropped after reading a few fields, so don't unpack them
+lazy = true
+
 local pkt_ip4 = pkt.IP()
 pkt_ip4.src = local_addr
 
@@ -15,20 +24,16 @@ local pkt_tcp = pkt.TCP()
 pkt_tcp.sport = local_port
 pkt_tcp.syn   = true
 
-function loop(addr, port)
-    pkt_ip4.dst = addr
-
-    pkt_tcp.dport = port
-    pkt_tcp.seq   = pkt.cookie32(local_addr, addr, local_port, port)
+-- the destination address, port and sequence number are filled in for each
+-- probe, so no loop() function is needed
+pkt.template({ pkt_ip4, pkt_tcp },
+             { dst = true, dport = true, cookie = "tcp.seq" })
 
-    return pkt_ip4, pkt_tcp
-end
-
-function recv(pkts)
-    local pkt_ip4 = pkts[1]
-    local pkt_tcp = pkts[2]
+function recv(frame)
+    local pkt_ip4 = frame[1]
+    local pkt_tcp = frame[2]
 
-    if #pkts < 2 or pkt_tcp._type ~= 'tcp' then
+    if #frame < 2 or pkt_tcp._type ~= 'tcp' then
         return
     end
 
@@ -57,6 +62,12 @@ function recv(pkts)
         return -- don't print closed ports
     end
 
+    -- the frame layers are read-only, unpack them to build the reply
+    local pkts = frame:unpack()
+
+    pkt_ip4 = pkts[1]
+    pkt_tcp = pkts[2]
+
     pkt_ip4.src = dst
     pkt_ip4.dst = src
 
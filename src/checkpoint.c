@@ -0,0 +1,205 @@
+/*
+ * Scriptable, asynchronous network packet generator/analyzer.
+ *
+ * Copyright (c) 2015, Alessandro Ghedini
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Checkpoints are small text files, one "key value" pair per line, that are
+ * written to a temporary file first and then renamed over the old one, so that
+ * a crash never leaves a truncated checkpoint behind.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "checkpoint.h"
+#include "printf.h"
+#include "util.h"
+
+#define CHECKPOINT_VERSION 1
+
+int checkpoint_save(const char *path, const struct checkpoint *ck) {
+    char tmp[4096];
+
+    int rc = snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    if ((rc < 0) || (rc >= sizeof(tmp)))
+        return -1;
+
+    FILE *f = fopen(tmp, "w");
+    if (f == NULL)
+        return -1;
+
+    fprintf(f, "version %d\n", CHECKPOINT_VERSION);
+
+    fprintf(f, "seed %zu\n",    ck->seed);
+    fprintf(f, "count %zu\n",   ck->count);
+    fprintf(f, "total %zu\n",   ck->total);
+    fprintf(f, "targets %zu\n", ck->targets);
+    fprintf(f, "ports %zu\n",   ck->ports);
+
+    fprintf(f, "shuffle %s\n", !ck->shuffle ? "none" :
+                               ck->shuffle_cyclic ? "cyclic" : "feistel");
+
+    fprintf(f, "shard %u %u\n", ck->shard, ck->shards);
+
+    fprintf(f, "sent %zu\n",    ck->pkt_sent);
+    fprintf(f, "probes %zu\n",  ck->pkt_probe);
+    fprintf(f, "replies %zu\n", ck->pkt_recv);
+
+    for (size_t i = 0; i < ck->slice_cnt; i++) {
+        const struct checkpoint_slice *s = &ck->slices[i];
+
+        fprintf(f, "slice %zu %zu\n", s->next, s->end);
+    }
+
+    if (fflush(f) || fsync(fileno(f)) || ferror(f)) {
+        fclose(f);
+        unlink(tmp);
+        return -1;
+    }
+
+    if (fclose(f)) {
+        unlink(tmp);
+        return -1;
+    }
+
+    return rename(tmp, path);
+}
+
+static uint64_t parse_u64(const char *path, char *key, char *val) {
+    char *end;
+
+    uint64_t v = strtoull(val, &end, 10);
+    if ((end == val) || (*end != '\0'))
+        fail_printf("Invalid %s value in '%s'", key, path);
+
+    return v;
+}
+
+void checkpoint_load(const char *path, struct checkpoint *ck) {
+    _free_ char *line = NULL;
+    size_t len = 0;
+
+    bool version = false;
+
+    memset(ck, 0, sizeof(*ck));
+
+    ck->shards = 1;
+
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+        sysf_printf("Error opening '%s'", path);
+
+    while (getline(&line, &len, f) >= 0) {
+        char *key = line, *val;
+
+        line[strcspn(line, "\r\n")] = '\0';
+
+        val = strchr(line, ' ');
+        if (val == NULL)
+            fail_printf("Invalid line '%s' in '%s'", line, path);
+
+        *val++ = '\0';
+
+        if (!strcmp(key, "version")) {
+            if (parse_u64(path, key, val) != CHECKPOINT_VERSION)
+                fail_printf("Unsupported checkpoint version in '%s'", path);
+
+            version = true;
+        } else if (!strcmp(key, "seed")) {
+            ck->seed = parse_u64(path, key, val);
+        } else if (!strcmp(key, "count")) {
+            ck->count = parse_u64(path, key, val);
+        } else if (!strcmp(key, "total")) {
+            ck->total = parse_u64(path, key, val);
+        } else if (!strcmp(key, "targets")) {
+            ck->targets = parse_u64(path, key, val);
+        } else if (!strcmp(key, "ports")) {
+            ck->ports = parse_u64(path, key, val);
+        } else if (!strcmp(key, "shuffle")) {
+            ck->shuffle        = strcmp(val, "none") != 0;
+            ck->shuffle_cyclic = strcmp(val, "cyclic") == 0;
+
+            if (ck->shuffle && !ck->shuffle_cyclic && strcmp(val, "feistel"))
+                fail_printf("Invalid shuffle value in '%s'", path);
+        } else if (!strcmp(key, "shard")) {
+            if ((sscanf(val, "%u %u", &ck->shard, &ck->shards) != 2) ||
+                (ck->shards == 0) || (ck->shard >= ck->shards))
+                fail_printf("Invalid shard value in '%s'", path);
+        } else if (!strcmp(key, "sent")) {
+            ck->pkt_sent = parse_u64(path, key, val);
+        } else if (!strcmp(key, "probes")) {
+            ck->pkt_probe = parse_u64(path, key, val);
+        } else if (!strcmp(key, "replies")) {
+            ck->pkt_recv = parse_u64(path, key, val);
+        } else if (!strcmp(key, "slice")) {
+            struct checkpoint_slice *slices, *s;
+
+            slices = realloc(ck->slices, (ck->slice_cnt + 1) * sizeof(*s));
+            if (slices == NULL)
+                fail_printf("OOM");
+
+            ck->slices = slices;
+
+            s = &ck->slices[ck->slice_cnt++];
+
+            char *end = strchr(val, ' ');
+            if (end == NULL)
+                fail_printf("Invalid slice value in '%s'", path);
+
+            *end++ = '\0';
+
+            s->next = parse_u64(path, key, val);
+            s->end  = parse_u64(path, key, end);
+
+            if (s->next > s->end)
+                fail_printf("Invalid slice value in '%s'", path);
+        } else {
+            fail_printf("Unknown key '%s' in '%s'", key, path);
+        }
+    }
+
+    if (ferror(f))
+        sysf_printf("Error reading '%s'", path);
+
+    fclose(f);
+
+    if (!version || (ck->slice_cnt == 0))
+        fail_printf("Invalid checkpoint '%s'", path);
+}
+
+void checkpoint_free(struct checkpoint *ck) {
+    free(ck->slices);
+
+    ck->slices    = NULL;
+    ck->slice_cnt = 0;
+}
@@ -0,0 +1,63 @@
+/*
+ * Scriptable, asynchronous network packet generator/analyzer.
+ *
+ * Copyright (c) 2015, Alessandro Ghedini
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* indexes left in a loop slice, see loop_init() */
+struct checkpoint_slice {
+    uint64_t next;
+    uint64_t end;
+};
+
+struct checkpoint {
+    /* what defines the order of the probes, which must match to resume */
+    uint64_t seed;
+    uint64_t count;
+    uint64_t total;
+
+    uint64_t targets;
+    uint64_t ports;
+
+    bool shuffle;
+    bool shuffle_cyclic;
+
+    unsigned shard;
+    unsigned shards;
+
+    /* counters so far */
+    uint64_t pkt_sent;
+    uint64_t pkt_probe;
+    uint64_t pkt_recv;
+
+    size_t slice_cnt;
+    struct checkpoint_slice *slices;
+};
+
+int checkpoint_save(const char *path, const struct checkpoint *ck);
+void checkpoint_load(const char *path, struct checkpoint *ck);
+void checkpoint_free(struct checkpoint *ck);
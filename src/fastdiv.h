@@ -0,0 +1,74 @@
+/*
+ * Scriptable, asynchronous network packet generator/analyzer.
+ *
+ * Copyright (c) 2015, Alessandro Ghedini
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+
+/*
+ * Division and modulo of 64-bit integers by a runtime invariant divisor, using
+ * multiplications and shifts only, as described in the paper "Faster Remainder
+ * by Direct Computation" by Daniel Lemire, Owen Kaser and Nathan Kurz
+ * https://arxiv.org/abs/1902.01961
+ *
+ * With a 128-bit magic number the results are exact for all the 64-bit
+ * dividends and all the non-zero divisors.
+ */
+
+__extension__ typedef unsigned __int128 fastdiv_u128;
+
+struct fastdiv {
+    fastdiv_u128 magic;
+    uint64_t d;
+};
+
+static inline void fastdiv_init(struct fastdiv *f, uint64_t d) {
+    /* ceil(2^128 / d), which wraps to 0 for d = 1 */
+    f->magic = ((fastdiv_u128) -1) / d + 1;
+    f->d     = d;
+}
+
+/* upper 64 bits of the 192-bit product of x and y */
+static inline uint64_t fastdiv_mulhi(fastdiv_u128 x, uint64_t y) {
+    fastdiv_u128 lo = ((x & UINT64_MAX) * y) >> 64;
+    fastdiv_u128 hi = (x >> 64) * y;
+
+    return (uint64_t) ((lo + hi) >> 64);
+}
+
+static inline uint64_t fastdiv_mod(const struct fastdiv *f, uint64_t n) {
+    return fastdiv_mulhi(f->magic * n, f->d);
+}
+
+static inline uint64_t fastdiv_div(const struct fastdiv *f, uint64_t n) {
+    /* for d = 1 the magic number is 0, and the quotient is n itself */
+    if (f->d == 1)
+        return n;
+
+    return fastdiv_mulhi(f->magic, n);
+}
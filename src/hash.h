@@ -65,3 +65,48 @@ static inline uint64_t pyrhash(const uint8_t *k, const uint8_t *m,
 
     return x;
 }
+
+__extension__ typedef unsigned __int128 hash_u128;
+
+#define WY_SECRET0 0xa0761d6478bd642fULL
+#define WY_SECRET1 0xe7037ed1a0b428dbULL
+
+static inline uint64_t wymix(uint64_t a, uint64_t b) {
+    hash_u128 r = (hash_u128) a * b;
+
+    return (uint64_t) r ^ (uint64_t) (r >> 64);
+}
+
+/*
+ * wyhash (final version 4, see https://github.com/wangyi-fudan/wyhash) of a
+ * 16 bytes message, given as two 64-bit words.
+ *
+ * The words are mixed with two 64x64->128 bit multiplications instead of one
+ * multiplication per byte like pyrhash(), which makes it several times faster
+ * for the short fixed size tuples hashed by pktizr. Like pyrhash() it is *not*
+ * a cryptographic hash function.
+ *
+ * The key derived from the seed by wyhash16_key() can be computed once and
+ * reused with wyhash16_keyed() when hashing many messages with the same seed.
+ */
+static inline uint64_t wyhash16_key(uint64_t seed) {
+    return seed ^ wymix(seed ^ WY_SECRET0, WY_SECRET1);
+}
+
+static inline uint64_t wyhash16_keyed(uint64_t key, uint64_t a, uint64_t b) {
+    hash_u128 r;
+
+    a ^= WY_SECRET1;
+    b ^= key;
+
+    r = (hash_u128) a * b;
+
+    a = (uint64_t) r;
+    b = (uint64_t) (r >> 64);
+
+    return wymix(a ^ WY_SECRET0 ^ 16, b ^ WY_SECRET1);
+}
+
+static inline uint64_t wyhash16(uint64_t seed, uint64_t a, uint64_t b) {
+    return wyhash16_keyed(wyhash16_key(seed), a, b);
+}
@@ -28,10 +28,20 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef HAVE_PCAP_H
+#include <pcap.h>
+#endif
+
+#ifdef HAVE_LINUX_IF_PACKET_H
+#include <sys/socket.h>
+#include <linux/filter.h>
+#endif
+
 #include "netdev.h"
 #include "printf.h"
 #include "util.h"
@@ -39,6 +49,8 @@
 extern const struct netdev_driver netdev_pfring;
 extern const struct netdev_driver netdev_pcap;
 extern const struct netdev_driver netdev_sock;
+extern const struct netdev_driver netdev_mmsg;
+extern const struct netdev_driver netdev_xdp;
 
 static const struct netdev_driver * const netdev_drivers[] = {
 #ifdef HAVE_PFRING_H
@@ -51,23 +63,59 @@ static const struct netdev_driver * const netdev_drivers[] = {
 
 #ifdef HAVE_LINUX_IF_PACKET_H
     &netdev_sock,
+    &netdev_mmsg,
+#endif
+
+#ifdef HAVE_LINUX_IF_XDP_H
+    &netdev_xdp,
 #endif
     NULL,
 };
 
-struct netdev *netdev_open(const char *name, const char *dev_name) {
+static bool open_driver(struct netdev *dev, const struct netdev_driver *drv,
+                        const char *dev_name, const struct netdev_opts *opts) {
+    dev->driver = drv;
+    dev->priv   = calloc(1, drv->priv_size);
+
+    if (drv->open(dev->priv, dev_name, opts) == 0)
+        return true;
+
+    freep(&dev->priv);
+    return false;
+}
+
+/*
+ * Open the netdev driver with the given name, or the first one available if
+ * name is NULL. If the requested driver is not supported by the system, the
+ * default one is used instead.
+ */
+struct netdev *netdev_open(const char *name, const char *dev_name,
+                           const struct netdev_opts *opts) {
     struct netdev *dev = malloc(sizeof(*dev));
 
     for (size_t i = 0; netdev_drivers[i] != NULL; i++) {
         const struct netdev_driver *cur = netdev_drivers[i];
 
-        if (!name || !strcmp(cur->name, name)) {
-            dev->driver = cur;
-            dev->priv   = calloc(1, cur->priv_size);
+        if (name && strcmp(cur->name, name))
+            continue;
 
-            dev->driver->open(dev->priv, dev_name);
+        if (open_driver(dev, cur, dev_name, opts))
             return dev;
+
+        if (!name)
+            continue;
+
+        err_printf("Netdev '%s' not supported, using default", name);
+
+        for (i = 0; netdev_drivers[i] != NULL; i++) {
+            if (netdev_drivers[i] == cur)
+                continue;
+
+            if (open_driver(dev, netdev_drivers[i], dev_name, opts))
+                return dev;
         }
+
+        break;
     }
 
     fail_printf("No netdev implementation supported");
@@ -82,17 +130,103 @@ void netdev_inject(struct netdev *dev, uint8_t *buf, size_t len) {
     dev->driver->inject(dev->priv, buf, len);
 }
 
+/*
+ * Reserve up to cnt transmit buffers, blocking until at least one is
+ * available. The buffers and their sizes are stored in bufs and lens, and the
+ * number of reserved buffers is returned.
+ */
+size_t netdev_reserve(struct netdev *dev, uint8_t **bufs, size_t *lens,
+                      size_t cnt) {
+    return dev->driver->reserve(dev->priv, bufs, lens, cnt);
+}
+
+/*
+ * Transmit the first cnt buffers previously returned by netdev_reserve(),
+ * with lens holding the actual packet lengths. Reserved buffers that are not
+ * committed are given back to the driver.
+ */
+void netdev_commit(struct netdev *dev, uint8_t **bufs, size_t *lens,
+                   size_t cnt) {
+    dev->driver->commit(dev->priv, bufs, lens, cnt);
+}
+
 const uint8_t *netdev_capture(struct netdev *dev, int *len) {
     return dev->driver->capture(dev->priv, len);
 }
 
+/*
+ * Capture up to cnt packets at once. All the returned buffers stay valid until
+ * the next call to netdev_release(). Drivers that don't support batching
+ * return a single packet.
+ */
+size_t netdev_capture_batch(struct netdev *dev, const uint8_t **bufs, int *lens,
+                            size_t cnt) {
+    if (dev->driver->capture_batch)
+        return dev->driver->capture_batch(dev->priv, bufs, lens, cnt);
+
+    bufs[0] = dev->driver->capture(dev->priv, &lens[0]);
+
+    return (bufs[0] != NULL) ? 1 : 0;
+}
+
 void netdev_release(struct netdev *dev) {
     dev->driver->release(dev->priv);
 }
 
+/*
+ * Only deliver the received packets matching the given pcap filter expression.
+ * Drivers that don't support filtering keep receiving all packets.
+ */
+int netdev_set_filter(struct netdev *dev, const char *filter) {
+    if (!dev->driver->set_filter) {
+        err_printf("Capture filter not supported by %s netdev",
+                   dev->driver->name);
+        return -1;
+    }
+
+    return dev->driver->set_filter(dev->priv, filter);
+}
+
 void netdev_close(struct netdev *dev) {
     dev->driver->close(dev->priv);
 
     freep(&dev->priv);
     freep(&dev);
 }
+
+/*
+ * Compile the given pcap filter expression to classic BPF and attach it to the
+ * given AF_PACKET socket.
+ */
+int netdev_sock_filter(int fd, const char *filter) {
+#if defined(HAVE_PCAP_H) && defined(HAVE_LINUX_IF_PACKET_H)
+    int rc;
+
+    struct bpf_program bpf;
+    struct sock_fprog  prog;
+
+    pcap_t *p = pcap_open_dead(DLT_EN10MB, 65535);
+    if (p == NULL)
+        fail_printf("Error opening pcap");
+
+    rc = pcap_compile(p, &bpf, filter, 1, PCAP_NETMASK_UNKNOWN);
+    if (rc < 0)
+        fail_printf("Error compiling filter: %s", pcap_geterr(p));
+
+    /* struct bpf_insn and struct sock_filter share the same layout */
+    prog.len    = bpf.bf_len;
+    prog.filter = (struct sock_filter *) bpf.bf_insns;
+
+    rc = setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog));
+    if (rc < 0)
+        sysf_printf("setsockopt(SO_ATTACH_FILTER)");
+
+    pcap_freecode(&bpf);
+    pcap_close(p);
+
+    return 0;
+#else
+    err_printf("Capture filter requires pcap support");
+    return -1;
+#endif
+}
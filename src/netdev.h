@@ -28,6 +28,31 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+/* maximum number of frames that can be reserved at once */
+#define NETDEV_BATCH 64
+
+enum netdev_flags {
+    NETDEV_RX = 1 << 0,
+    NETDEV_TX = 1 << 1,
+
+    /* spread received packets between all the netdevs opened with this set */
+    NETDEV_FANOUT = 1 << 2,
+};
+
+struct netdev_opts {
+    int flags;
+
+    /* receive ring block size and block retire timeout (in ms) */
+    size_t   block_size;
+    unsigned block_tmo;
+
+    /* device queue to bind to, for drivers that support it */
+    unsigned queue;
+
+    /* local IPv4 address (host byte order), for drivers filtering on it */
+    uint32_t local_addr;
+};
+
 struct netdev {
     const struct netdev_driver *driver;
     void *priv;
@@ -37,23 +62,43 @@ struct netdev_driver {
     const char *name;
     size_t priv_size;
 
-    void (*open)(void *priv, const char *dev_name);
+    /* returns a negative value if the driver is not supported */
+    int (*open)(void *priv, const char *dev_name,
+                const struct netdev_opts *opts);
 
     uint8_t *(*get_buf)(void *, size_t *);
     void (*inject)(void *, uint8_t *, size_t);
 
+    size_t (*reserve)(void *, uint8_t **, size_t *, size_t);
+    void (*commit)(void *, uint8_t **, size_t *, size_t);
+
     const uint8_t *(*capture)(void *, int *);
+    size_t (*capture_batch)(void *, const uint8_t **, int *, size_t);
     void (*release)(void *);
 
+    int (*set_filter)(void *, const char *);
+
     void (*close)(void *);
 };
 
-struct netdev *netdev_open(const char *name, const char *dev_name);
+struct netdev *netdev_open(const char *name, const char *dev_name,
+                           const struct netdev_opts *opts);
 
 uint8_t *netdev_get_buf(struct netdev *n, size_t *len);
 void netdev_inject(struct netdev *n, uint8_t *buf, size_t len);
 
+size_t netdev_reserve(struct netdev *n, uint8_t **bufs, size_t *lens,
+                      size_t cnt);
+void netdev_commit(struct netdev *n, uint8_t **bufs, size_t *lens, size_t cnt);
+
 const uint8_t *netdev_capture(struct netdev *n, int *len);
+size_t netdev_capture_batch(struct netdev *n, const uint8_t **bufs, int *lens,
+                            size_t cnt);
 void netdev_release(struct netdev *n);
 
+int netdev_set_filter(struct netdev *n, const char *filter);
+
 void netdev_close(struct netdev *n);
+
+/* for use by netdev drivers only */
+int netdev_sock_filter(int fd, const char *filter);
@@ -0,0 +1,343 @@
+/*
+ * Scriptable, asynchronous network packet generator/analyzer.
+ *
+ * Copyright (c) 2015, Alessandro Ghedini
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <sys/poll.h>
+#include <sys/socket.h>
+
+#include <net/if.h>
+#include <arpa/inet.h>
+#include <linux/if_packet.h>
+#include <netinet/if_ether.h>
+
+#include "netdev.h"
+#include "printf.h"
+#include "util.h"
+
+#define FRAME_SIZE    (1 << 11)
+
+#define SOCK_BUF_SIZE (1 << 22)
+
+struct priv {
+    int rx_fd;
+    int tx_fd;
+
+    uint8_t *rx_bufs;
+    uint8_t *tx_bufs;
+
+    struct mmsghdr     rx_msgs[NETDEV_BATCH];
+    struct iovec       rx_iovs[NETDEV_BATCH];
+    struct sockaddr_ll rx_addrs[NETDEV_BATCH];
+
+    struct mmsghdr     tx_msgs[NETDEV_BATCH];
+    struct iovec       tx_iovs[NETDEV_BATCH];
+};
+
+static int open_socket(const char *dev_name, int proto, int buf_opt) {
+    int rc, fd;
+
+    struct sockaddr_ll dev_addr;
+
+    fd = socket(PF_PACKET, SOCK_RAW, proto);
+    if (fd < 0) {
+        err_printf("Error opening packet socket: %s", strerror(errno));
+        return -1;
+    }
+
+    memset(&dev_addr, 0, sizeof(dev_addr));
+    dev_addr.sll_family   = AF_PACKET;
+    dev_addr.sll_protocol = proto;
+    dev_addr.sll_ifindex  = if_nametoindex(dev_name);
+
+    rc = bind(fd, (struct sockaddr *) &dev_addr, sizeof(dev_addr));
+    if (rc < 0) {
+        err_printf("Error binding packet socket: %s", strerror(errno));
+        closep(&fd);
+        return -1;
+    }
+
+    /* not fatal, the default buffer size just means more drops */
+    int buf_size = SOCK_BUF_SIZE;
+    setsockopt(fd, SOL_SOCKET, buf_opt, &buf_size, sizeof(buf_size));
+
+    return fd;
+}
+
+static int open_rx(struct priv *priv, const char *dev_name,
+                   const struct netdev_opts *opts) {
+    int rc, fd;
+
+    fd = open_socket(dev_name, htons(ETH_P_ALL), SO_RCVBUF);
+    if (fd < 0)
+        return -1;
+
+#ifdef PACKET_IGNORE_OUTGOING
+    /* not supported by older kernels, see also netdev_capture_batch_mmsg() */
+    int ignore = 1;
+    setsockopt(fd, SOL_PACKET, PACKET_IGNORE_OUTGOING,
+               &ignore, sizeof(ignore));
+#endif
+
+    if (opts->flags & NETDEV_FANOUT) {
+        /* all the sockets of this process join the same fanout group */
+        int fanout = (getpid() & 0xffff) |
+                     ((PACKET_FANOUT_HASH | PACKET_FANOUT_FLAG_DEFRAG) << 16);
+
+        rc = setsockopt(fd, SOL_PACKET, PACKET_FANOUT,
+                        &fanout, sizeof(fanout));
+        if (rc < 0) {
+            err_printf("Error joining fanout group: %s", strerror(errno));
+            closep(&fd);
+            return -1;
+        }
+    }
+
+    priv->rx_fd = fd;
+
+    priv->rx_bufs = malloc(NETDEV_BATCH * FRAME_SIZE);
+    if (priv->rx_bufs == NULL)
+        fail_printf("OOM");
+
+    memset(priv->rx_msgs, 0, sizeof(priv->rx_msgs));
+
+    for (size_t i = 0; i < NETDEV_BATCH; i++) {
+        priv->rx_iovs[i].iov_base = priv->rx_bufs + (i * FRAME_SIZE);
+        priv->rx_iovs[i].iov_len  = FRAME_SIZE;
+
+        priv->rx_msgs[i].msg_hdr.msg_iov    = &priv->rx_iovs[i];
+        priv->rx_msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    return 0;
+}
+
+static int open_tx(struct priv *priv, const char *dev_name) {
+    /* the transmit socket doesn't need to see any incoming traffic */
+    priv->tx_fd = open_socket(dev_name, 0, SO_SNDBUF);
+    if (priv->tx_fd < 0)
+        return -1;
+
+    priv->tx_bufs = malloc(NETDEV_BATCH * FRAME_SIZE);
+    if (priv->tx_bufs == NULL)
+        fail_printf("OOM");
+
+    memset(priv->tx_msgs, 0, sizeof(priv->tx_msgs));
+
+    for (size_t i = 0; i < NETDEV_BATCH; i++) {
+        priv->tx_iovs[i].iov_base = priv->tx_bufs + (i * FRAME_SIZE);
+
+        priv->tx_msgs[i].msg_hdr.msg_iov    = &priv->tx_iovs[i];
+        priv->tx_msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    return 0;
+}
+
+static int netdev_open_mmsg(void *p, const char *dev_name,
+                            const struct netdev_opts *opts) {
+    struct priv *priv = p;
+
+    priv->rx_fd = -1;
+    priv->tx_fd = -1;
+
+    if ((opts->flags & NETDEV_RX) && (open_rx(priv, dev_name, opts) < 0))
+        return -1;
+
+    if ((opts->flags & NETDEV_TX) && (open_tx(priv, dev_name) < 0)) {
+        closep(&priv->rx_fd);
+        freep(&priv->rx_bufs);
+        return -1;
+    }
+
+    return 0;
+}
+
+static size_t netdev_reserve_mmsg(void *p, uint8_t **bufs, size_t *lens,
+                                  size_t cnt) {
+    struct priv *priv = p;
+
+    if (cnt > NETDEV_BATCH)
+        cnt = NETDEV_BATCH;
+
+    for (size_t i = 0; i < cnt; i++) {
+        bufs[i] = priv->tx_bufs + (i * FRAME_SIZE);
+        lens[i] = FRAME_SIZE;
+    }
+
+    return cnt;
+}
+
+/*
+ * The buffers are always the ones returned by netdev_reserve_mmsg(), so only
+ * the lengths need to be filled in before sending the whole batch at once.
+ */
+static void netdev_commit_mmsg(void *p, uint8_t **bufs, size_t *lens,
+                               size_t cnt) {
+    int rc;
+
+    struct priv *priv = p;
+
+    size_t sent = 0;
+
+    for (size_t i = 0; i < cnt; i++)
+        priv->tx_iovs[i].iov_len = lens[i];
+
+    while (sent < cnt) {
+        rc = sendmmsg(priv->tx_fd, priv->tx_msgs + sent, cnt - sent, 0);
+        if (rc < 0) {
+            if ((errno == EINTR) || (errno == ENOBUFS) || (errno == EAGAIN))
+                continue;
+
+            sysf_printf("sendmmsg()");
+        }
+
+        sent += rc;
+    }
+}
+
+static uint8_t *netdev_get_buf_mmsg(void *p, size_t *len) {
+    uint8_t *buf;
+
+    netdev_reserve_mmsg(p, &buf, len, 1);
+
+    return buf;
+}
+
+static void netdev_inject_mmsg(void *p, uint8_t *buf, size_t len) {
+    netdev_commit_mmsg(p, &buf, &len, 1);
+}
+
+static size_t netdev_capture_batch_mmsg(void *p, const uint8_t **bufs,
+                                        int *lens, size_t cnt) {
+    int rc;
+
+    struct priv *priv = p;
+
+    struct pollfd pfd;
+
+    size_t n = 0;
+
+    memset(&pfd, 0, sizeof(pfd));
+    pfd.fd      = priv->rx_fd;
+    pfd.events  = POLLIN | POLLERR;
+    pfd.revents = 0;
+
+    rc = poll(&pfd, 1, 10);
+    if ((rc < 0) && (errno != EINTR))
+        sysf_printf("poll()");
+
+    if (rc <= 0)
+        return 0;
+
+    if (cnt > NETDEV_BATCH)
+        cnt = NETDEV_BATCH;
+
+    /* the address length is overwritten by each call */
+    for (size_t i = 0; i < cnt; i++) {
+        priv->rx_msgs[i].msg_hdr.msg_name    = &priv->rx_addrs[i];
+        priv->rx_msgs[i].msg_hdr.msg_namelen = sizeof(priv->rx_addrs[i]);
+    }
+
+    rc = recvmmsg(priv->rx_fd, priv->rx_msgs, cnt, MSG_DONTWAIT, NULL);
+    if (rc < 0) {
+        if ((errno == EINTR) || (errno == EAGAIN))
+            return 0;
+
+        sysf_printf("recvmmsg()");
+    }
+
+    for (int i = 0; i < rc; i++) {
+        /* skip our own packets, in case PACKET_IGNORE_OUTGOING is missing */
+        if (priv->rx_addrs[i].sll_pkttype == PACKET_OUTGOING)
+            continue;
+
+        bufs[n] = priv->rx_iovs[i].iov_base;
+        lens[n] = priv->rx_msgs[i].msg_len;
+
+        n++;
+    }
+
+    return n;
+}
+
+static const uint8_t *netdev_capture_mmsg(void *p, int *len) {
+    const uint8_t *buf;
+
+    if (netdev_capture_batch_mmsg(p, &buf, len, 1) == 0)
+        return NULL;
+
+    return buf;
+}
+
+static void netdev_release_mmsg(void *p) {
+}
+
+static int netdev_set_filter_mmsg(void *p, const char *filter) {
+    struct priv *priv = p;
+
+    return netdev_sock_filter(priv->rx_fd, filter);
+}
+
+static void netdev_close_mmsg(void *p) {
+    struct priv *priv = p;
+
+    closep(&priv->rx_fd);
+    closep(&priv->tx_fd);
+
+    freep(&priv->rx_bufs);
+    freep(&priv->tx_bufs);
+}
+
+const struct netdev_driver netdev_mmsg = {
+    .name    = "mmsg",
+
+    .priv_size = sizeof(struct priv),
+
+    .open    = netdev_open_mmsg,
+
+    .get_buf = netdev_get_buf_mmsg,
+    .inject  = netdev_inject_mmsg,
+
+    .reserve = netdev_reserve_mmsg,
+    .commit  = netdev_commit_mmsg,
+
+    .capture = netdev_capture_mmsg,
+    .capture_batch = netdev_capture_batch_mmsg,
+    .release = netdev_release_mmsg,
+
+    .set_filter = netdev_set_filter_mmsg,
+
+    .close   = netdev_close_mmsg,
+};
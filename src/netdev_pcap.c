@@ -39,23 +39,37 @@
 #include "printf.h"
 #include "util.h"
 
+#define BATCH_FRAME_SIZE (1 << 11)
+
 struct priv {
     pcap_t  *p;
     uint8_t *buf;
     size_t   buf_len;
+
+    uint8_t *batch;
 };
 
-static void netdev_open_pcap(void *p, const char *dev_name) {
+static int netdev_open_pcap(void *p, const char *dev_name,
+                            const struct netdev_opts *opts) {
     struct priv *priv = p;
 
     char err[PCAP_ERRBUF_SIZE];
 
+    if (opts->flags & NETDEV_FANOUT) {
+        err_printf("Multiple receive threads not supported by pcap netdev");
+        return -1;
+    }
+
     priv->p = pcap_open_live(dev_name, 1500, 0, 10, err);
     if (priv->p == NULL)
         fail_printf("Error opening pcap: %s", err);
 
     priv->buf_len = 65535;
     priv->buf     = malloc(priv->buf_len);
+
+    priv->batch   = malloc(NETDEV_BATCH * BATCH_FRAME_SIZE);
+
+    return 0;
 }
 
 static uint8_t *netdev_get_buf_pcap(void *p, size_t *len) {
@@ -72,6 +86,33 @@ static void netdev_inject_pcap(void *p, uint8_t *buf, size_t len) {
         fail_printf("Error sending packet: %s", pcap_geterr(priv->p));
 }
 
+static size_t netdev_reserve_pcap(void *p, uint8_t **bufs, size_t *lens,
+                                  size_t cnt) {
+    struct priv *priv = p;
+
+    if (cnt > NETDEV_BATCH)
+        cnt = NETDEV_BATCH;
+
+    for (size_t i = 0; i < cnt; i++) {
+        bufs[i] = priv->batch + (i * BATCH_FRAME_SIZE);
+        lens[i] = BATCH_FRAME_SIZE;
+    }
+
+    return cnt;
+}
+
+static void netdev_commit_pcap(void *p, uint8_t **bufs, size_t *lens,
+                               size_t cnt) {
+    struct priv *priv = p;
+
+    /* no batch transmission support, send packets one by one */
+    for (size_t i = 0; i < cnt; i++) {
+        int rc = pcap_sendpacket(priv->p, bufs[i], lens[i]);
+        if (rc < 0)
+            fail_printf("Error sending packet: %s", pcap_geterr(priv->p));
+    }
+}
+
 static const uint8_t *netdev_capture_pcap(void *p, int *len) {
     const uint8_t *buf;
     struct pcap_pkthdr *pkt_hdr;
@@ -102,6 +143,26 @@ static const uint8_t *netdev_capture_pcap(void *p, int *len) {
 static void netdev_release_pcap(void *p) {
 }
 
+static int netdev_set_filter_pcap(void *p, const char *filter) {
+    int rc;
+
+    struct priv *priv = p;
+
+    struct bpf_program bpf;
+
+    rc = pcap_compile(priv->p, &bpf, filter, 1, PCAP_NETMASK_UNKNOWN);
+    if (rc < 0)
+        fail_printf("Error compiling filter: %s", pcap_geterr(priv->p));
+
+    rc = pcap_setfilter(priv->p, &bpf);
+    if (rc < 0)
+        fail_printf("Error setting filter: %s", pcap_geterr(priv->p));
+
+    pcap_freecode(&bpf);
+
+    return 0;
+}
+
 static void netdev_close_pcap(void *p) {
     struct priv *priv = p;
 
@@ -109,6 +170,8 @@ static void netdev_close_pcap(void *p) {
 
     freep(&priv->buf);
     priv->buf_len = 0;
+
+    freep(&priv->batch);
 }
 
 const struct netdev_driver netdev_pcap = {
@@ -121,8 +184,13 @@ const struct netdev_driver netdev_pcap = {
     .get_buf = netdev_get_buf_pcap,
     .inject  = netdev_inject_pcap,
 
+    .reserve = netdev_reserve_pcap,
+    .commit  = netdev_commit_pcap,
+
     .capture = netdev_capture_pcap,
     .release = netdev_release_pcap,
 
+    .set_filter = netdev_set_filter_pcap,
+
     .close   = netdev_close_pcap,
 };
@@ -41,15 +41,25 @@
 #include "printf.h"
 #include "util.h"
 
+#define BATCH_FRAME_SIZE (1 << 11)
+
 struct priv {
     pfring  *p;
     uint8_t *buf;
     size_t   buf_len;
+
+    uint8_t *batch;
 };
 
-static void netdev_open_pfring(void *p, const char *dev_name) {
+static int netdev_open_pfring(void *p, const char *dev_name,
+                              const struct netdev_opts *opts) {
     struct priv *priv = p;
 
+    if (opts->flags & NETDEV_FANOUT) {
+        err_printf("Multiple receive threads not supported by pfring netdev");
+        return -1;
+    }
+
     priv->p = pfring_open(dev_name, 1500, 0);
     if (priv->p == NULL)
         fail_printf("Error opening pfring");
@@ -59,6 +69,10 @@ static void netdev_open_pfring(void *p, const char *dev_name) {
 
     priv->buf_len = 65535;
     priv->buf     = malloc(priv->buf_len);
+
+    priv->batch   = malloc(NETDEV_BATCH * BATCH_FRAME_SIZE);
+
+    return 0;
 }
 
 static uint8_t *netdev_get_buf_pfring(void *p, size_t *len) {
@@ -73,6 +87,32 @@ static void netdev_inject_pfring(void *p, uint8_t *buf, size_t len) {
         caa_cpu_relax();
 }
 
+static size_t netdev_reserve_pfring(void *p, uint8_t **bufs, size_t *lens,
+                                    size_t cnt) {
+    struct priv *priv = p;
+
+    if (cnt > NETDEV_BATCH)
+        cnt = NETDEV_BATCH;
+
+    for (size_t i = 0; i < cnt; i++) {
+        bufs[i] = priv->batch + (i * BATCH_FRAME_SIZE);
+        lens[i] = BATCH_FRAME_SIZE;
+    }
+
+    return cnt;
+}
+
+static void netdev_commit_pfring(void *p, uint8_t **bufs, size_t *lens,
+                                 size_t cnt) {
+    struct priv *priv = p;
+
+    /* no batch transmission support, send packets one by one */
+    for (size_t i = 0; i < cnt; i++) {
+        while (pfring_send(priv->p, (char *) bufs[i], lens[i], 1) < 0)
+            caa_cpu_relax();
+    }
+}
+
 static const uint8_t *netdev_capture_pfring(void *p, int *len) {
     const uint8_t *buf;
     struct pfring_pkthdr pkt_hdr;
@@ -99,6 +139,16 @@ static const uint8_t *netdev_capture_pfring(void *p, int *len) {
 static void netdev_release_pfring(void *p) {
 }
 
+static int netdev_set_filter_pfring(void *p, const char *filter) {
+    struct priv *priv = p;
+
+    int rc = pfring_set_bpf_filter(priv->p, (char *) filter);
+    if (rc < 0)
+        fail_printf("Error setting filter");
+
+    return 0;
+}
+
 static void netdev_close_pfring(void *p) {
     struct priv *priv = p;
 
@@ -106,6 +156,8 @@ static void netdev_close_pfring(void *p) {
 
     freep(&priv->buf);
     priv->buf_len = 0;
+
+    freep(&priv->batch);
 }
 
 const struct netdev_driver netdev_pfring = {
@@ -118,8 +170,13 @@ const struct netdev_driver netdev_pfring = {
     .get_buf = netdev_get_buf_pfring,
     .inject  = netdev_inject_pfring,
 
+    .reserve = netdev_reserve_pfring,
+    .commit  = netdev_commit_pfring,
+
     .capture = netdev_capture_pfring,
     .release = netdev_release_pfring,
 
+    .set_filter = netdev_set_filter_pfring,
+
     .close   = netdev_close_pfring,
 };
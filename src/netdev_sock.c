@@ -28,6 +28,7 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <stdbool.h>
 #include <string.h>
 #include <errno.h>
 
@@ -48,41 +49,154 @@
 
 #define RING_BLOCK_SIZE (1 << 12)
 
+/* total size of the receive ring, split in blocks of the configured size */
+#define RX_RING_SIZE    (1 << 24)
+#define RX_BLOCK_MIN_NR 4
+
 struct priv {
-    int fd;
+    int rx_fd;
+    int tx_fd;
 
     uint8_t *rx_ring;
     uint8_t *tx_ring;
 
-    int rx_ring_off;
+    size_t rx_block_size;
+    int    rx_block_nr;
+    int    rx_block_off;
+
+    struct tpacket_block_desc *rx_block;
+    struct tpacket3_hdr       *rx_frame;
+    unsigned int               rx_frame_left;
+
     int tx_ring_off;
 
     int ring_hdrlen;
 };
 
-static void netdev_open_sock(void *p, const char *dev_name) {
+static int open_socket(const char *dev_name, int proto) {
     int rc, fd;
 
-    struct priv *priv = p;
-
-    struct tpacket_req tp;
     struct sockaddr_ll dev_addr;
 
-    priv->ring_hdrlen = sizeof(struct tpacket2_hdr);
-
-    fd = socket(PF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+    fd = socket(PF_PACKET, SOCK_RAW, proto);
     if (fd < 0)
         sysf_printf("socket()");
 
     memset(&dev_addr, 0, sizeof(dev_addr));
     dev_addr.sll_family   = AF_PACKET;
-    dev_addr.sll_protocol = htons(ETH_P_ALL);
+    dev_addr.sll_protocol = proto;
     dev_addr.sll_ifindex  = if_nametoindex(dev_name);
 
     rc = bind(fd, (struct sockaddr *) &dev_addr, sizeof(dev_addr));
     if (rc < 0)
         sysf_printf("bind()");
 
+    return fd;
+}
+
+/*
+ * The ring setup may be refused by the kernel, e.g. inside some containers, in
+ * which case an error is returned so that a different driver can be used.
+ */
+static int open_rx(struct priv *priv, const char *dev_name,
+                   const struct netdev_opts *opts) {
+    int rc, fd;
+
+    const char *what;
+
+    struct tpacket_req3 tp;
+
+    size_t block_size = opts->block_size;
+
+    if ((block_size < RING_FRAME_SIZE) ||
+        (block_size % sysconf(_SC_PAGESIZE)))
+        fail_printf("Invalid RX block size: %zu", block_size);
+
+    fd = open_socket(dev_name, htons(ETH_P_ALL));
+
+    int vers = TPACKET_V3;
+    rc = setsockopt(fd, SOL_PACKET, PACKET_VERSION, &vers, sizeof(vers));
+    if (rc < 0) {
+        what = "setsockopt(PACKET_VERSION)";
+        goto error;
+    }
+
+#ifdef PACKET_IGNORE_OUTGOING
+    /* not supported by older kernels, see also netdev_capture_sock() */
+    int ignore = 1;
+    setsockopt(fd, SOL_PACKET, PACKET_IGNORE_OUTGOING,
+               &ignore, sizeof(ignore));
+#endif
+
+    memset(&tp, 0, sizeof(tp));
+    tp.tp_block_size       = block_size;
+    tp.tp_block_nr         = RX_RING_SIZE / block_size;
+    tp.tp_frame_size       = RING_FRAME_SIZE;
+    tp.tp_retire_blk_tov   = opts->block_tmo;
+    tp.tp_feature_req_word = 0;
+
+    if (tp.tp_block_nr < RX_BLOCK_MIN_NR)
+        tp.tp_block_nr = RX_BLOCK_MIN_NR;
+
+    tp.tp_frame_nr = (tp.tp_block_size / tp.tp_frame_size) * tp.tp_block_nr;
+
+    rc = setsockopt(fd, SOL_PACKET, PACKET_RX_RING, (void *) &tp, sizeof(tp));
+    if (rc < 0) {
+        what = "setsockopt(PACKET_RX_RING)";
+        goto error;
+    }
+
+    priv->rx_ring = mmap(0, tp.tp_block_size * tp.tp_block_nr,
+                         PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (priv->rx_ring == MAP_FAILED) {
+        priv->rx_ring = NULL;
+
+        what = "mmap()";
+        goto error;
+    }
+
+    priv->rx_block_size = tp.tp_block_size;
+    priv->rx_block_nr   = tp.tp_block_nr;
+
+    if (opts->flags & NETDEV_FANOUT) {
+        /* all the sockets of this process join the same fanout group */
+        int fanout = (getpid() & 0xffff) |
+                     ((PACKET_FANOUT_HASH | PACKET_FANOUT_FLAG_DEFRAG) << 16);
+
+        rc = setsockopt(fd, SOL_PACKET, PACKET_FANOUT,
+                        &fanout, sizeof(fanout));
+        if (rc < 0) {
+            what = "setsockopt(PACKET_FANOUT)";
+            goto error;
+        }
+    }
+
+    priv->rx_fd = fd;
+
+    return 0;
+
+error:
+    err_printf("Error setting up RX ring: %s: %s", what, strerror(errno));
+
+    if (priv->rx_ring != NULL) {
+        munmap(priv->rx_ring, priv->rx_block_size * priv->rx_block_nr);
+        priv->rx_ring = NULL;
+    }
+
+    closep(&fd);
+    return -1;
+}
+
+static int open_tx(struct priv *priv, const char *dev_name) {
+    int rc, fd;
+
+    const char *what;
+
+    struct tpacket_req tp;
+
+    /* the transmit socket doesn't need to see any incoming traffic */
+    fd = open_socket(dev_name, 0);
+
     memset(&tp, 0, sizeof(tp));
     tp.tp_frame_size = RING_FRAME_SIZE;
     tp.tp_frame_nr   = RING_FRAME_NR;
@@ -92,50 +206,80 @@ static void netdev_open_sock(void *p, const char *dev_name) {
 
     int vers = TPACKET_V2;
     rc = setsockopt(fd, SOL_PACKET, PACKET_VERSION, &vers, sizeof(vers));
-    if (rc < 0)
-        sysf_printf("setsockopt(PACKET_VERSION)");
-
-    rc = setsockopt(fd, SOL_PACKET, PACKET_RX_RING,
-                    (void *) &tp, sizeof(tp));
-    if (rc < 0)
-        sysf_printf("setsockopt(PACKET_RX_RING)");
+    if (rc < 0) {
+        what = "setsockopt(PACKET_VERSION)";
+        goto error;
+    }
 
-    rc = setsockopt(fd, SOL_PACKET, PACKET_TX_RING,
-                    (void *) &tp, sizeof(tp));
-    if (rc < 0)
-        sysf_printf("setsockopt(PACKET_TX_RING)");
+    rc = setsockopt(fd, SOL_PACKET, PACKET_TX_RING, (void *) &tp, sizeof(tp));
+    if (rc < 0) {
+        what = "setsockopt(PACKET_TX_RING)";
+        goto error;
+    }
 
     int hdr_len;
     unsigned int len = sizeof(hdr_len);
     rc = getsockopt(fd, SOL_PACKET, PACKET_HDRLEN, &hdr_len, &len);
-    if (rc < 0)
-        sysf_printf("getsockopt(PACKET_HDRLEN)");
+    if (rc < 0) {
+        what = "getsockopt(PACKET_HDRLEN)";
+        goto error;
+    }
 
     priv->ring_hdrlen = hdr_len;
 
-    priv->rx_ring = mmap(0, tp.tp_block_size * tp.tp_block_nr * 2,
-                             PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    priv->tx_ring = mmap(0, tp.tp_block_size * tp.tp_block_nr,
+                         PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (priv->tx_ring == MAP_FAILED) {
+        priv->tx_ring = NULL;
 
-    if (!priv->rx_ring)
-        fail_printf("EOF");
+        what = "mmap()";
+        goto error;
+    }
 
-    priv->tx_ring = priv->rx_ring + tp.tp_block_size * tp.tp_block_nr;
+    priv->tx_fd = fd;
 
-    priv->fd = fd;
-}
+    return 0;
 
-static uint8_t *netdev_get_buf_sock(void *p, size_t *len) {
-    int rc;
+error:
+    err_printf("Error setting up TX ring: %s: %s", what, strerror(errno));
 
-    struct pollfd pfd;
+    closep(&fd);
+    return -1;
+}
 
+static int netdev_open_sock(void *p, const char *dev_name,
+                            const struct netdev_opts *opts) {
     struct priv *priv = p;
 
-    uint8_t *base = priv->tx_ring + (priv->tx_ring_off * RING_FRAME_SIZE);
-    struct tpacket2_hdr *hdr = (struct tpacket2_hdr *) base;
+    priv->rx_fd = -1;
+    priv->tx_fd = -1;
+
+    if ((opts->flags & NETDEV_RX) && (open_rx(priv, dev_name, opts) < 0))
+        return -1;
+
+    if ((opts->flags & NETDEV_TX) && (open_tx(priv, dev_name) < 0)) {
+        if (priv->rx_ring != NULL)
+            munmap(priv->rx_ring, priv->rx_block_size * priv->rx_block_nr);
+
+        closep(&priv->rx_fd);
+        return -1;
+    }
+
+    return 0;
+}
+
+static struct tpacket2_hdr *tx_frame(struct priv *priv, int off) {
+    uint8_t *base = priv->tx_ring + ((off % RING_FRAME_NR) * RING_FRAME_SIZE);
+    return (struct tpacket2_hdr *) base;
+}
+
+static void tx_wait(struct priv *priv, struct tpacket2_hdr *hdr) {
+    int rc;
+
+    struct pollfd pfd;
 
     memset(&pfd, 0, sizeof(pfd));
-    pfd.fd      = priv->fd;
+    pfd.fd      = priv->tx_fd;
     pfd.events  = POLLIN | POLLERR;
     pfd.revents = 0;
 
@@ -144,12 +288,20 @@ static uint8_t *netdev_get_buf_sock(void *p, size_t *len) {
         if ((rc < 0) && (errno != EINTR))
             sysf_printf("poll()");
     }
+}
+
+static uint8_t *netdev_get_buf_sock(void *p, size_t *len) {
+    struct priv *priv = p;
+
+    struct tpacket2_hdr *hdr = tx_frame(priv, priv->tx_ring_off);
+
+    tx_wait(priv, hdr);
 
     priv->tx_ring_off = (priv->tx_ring_off + 1) % RING_FRAME_NR;
 
     *len = RING_FRAME_SIZE;
 
-    return base + TPACKET_ALIGN(priv->ring_hdrlen);
+    return (uint8_t *) hdr + TPACKET_ALIGN(priv->ring_hdrlen);
 }
 
 static void netdev_inject_sock(void *p, uint8_t *buf, size_t len) {
@@ -163,60 +315,176 @@ static void netdev_inject_sock(void *p, uint8_t *buf, size_t len) {
     hdr->tp_len    = len;
     hdr->tp_status = TP_STATUS_SEND_REQUEST;
 
-    rc = sendto(priv->fd, NULL, 0, MSG_DONTWAIT, NULL, 0);
+    rc = sendto(priv->tx_fd, NULL, 0, MSG_DONTWAIT, NULL, 0);
     if ((rc < 0) && (errno != EAGAIN))
         sysf_printf("sendto()");
 }
 
-static const uint8_t *netdev_capture_sock(void *p, int *len) {
-    int rc;
+static size_t netdev_reserve_sock(void *p, uint8_t **bufs, size_t *lens,
+                                  size_t cnt) {
+    size_t i;
 
-    struct pollfd pfd;
+    struct priv *priv = p;
+
+    size_t hdr_len = TPACKET_ALIGN(priv->ring_hdrlen);
+
+    if (cnt > RING_FRAME_NR)
+        cnt = RING_FRAME_NR;
+
+    for (i = 0; i < cnt; i++) {
+        struct tpacket2_hdr *hdr = tx_frame(priv, priv->tx_ring_off + i);
+
+        if (hdr->tp_status != TP_STATUS_AVAILABLE) {
+            if (i > 0)
+                break;
+
+            tx_wait(priv, hdr);
+        }
+
+        bufs[i] = (uint8_t *) hdr + hdr_len;
+        lens[i] = RING_FRAME_SIZE - hdr_len;
+    }
+
+    return i;
+}
+
+static void netdev_commit_sock(void *p, uint8_t **bufs, size_t *lens,
+                               size_t cnt) {
+    int rc;
 
     struct priv *priv = p;
 
-    uint8_t *base = priv->rx_ring + (priv->rx_ring_off * RING_FRAME_SIZE);
-    struct tpacket2_hdr *hdr = (struct tpacket2_hdr *) base;
+    size_t hdr_len = TPACKET_ALIGN(priv->ring_hdrlen);
+
+    if (cnt == 0)
+        return;
+
+    for (size_t i = 0; i < cnt; i++) {
+        struct tpacket2_hdr *hdr = (struct tpacket2_hdr *) (bufs[i] - hdr_len);
+
+        hdr->tp_len    = lens[i];
+        hdr->tp_status = TP_STATUS_SEND_REQUEST;
+    }
+
+    priv->tx_ring_off = (priv->tx_ring_off + cnt) % RING_FRAME_NR;
+
+    /* kick the TX ring only once for the whole batch */
+    rc = sendto(priv->tx_fd, NULL, 0, MSG_DONTWAIT, NULL, 0);
+    if ((rc < 0) && (errno != EAGAIN))
+        sysf_printf("sendto()");
+}
+
+static struct tpacket_block_desc *rx_block(struct priv *priv) {
+    uint8_t *base = priv->rx_ring + (priv->rx_block_off * priv->rx_block_size);
+    return (struct tpacket_block_desc *) base;
+}
+
+static void rx_block_release(struct priv *priv) {
+    priv->rx_block->hdr.bh1.block_status = TP_STATUS_KERNEL;
+
+    priv->rx_block      = NULL;
+    priv->rx_frame      = NULL;
+    priv->rx_frame_left = 0;
+
+    priv->rx_block_off = (priv->rx_block_off + 1) % priv->rx_block_nr;
+}
+
+static bool rx_block_wait(struct priv *priv) {
+    int rc;
+
+    struct pollfd pfd;
+
+    struct tpacket_block_desc *bd = rx_block(priv);
 
     memset(&pfd, 0, sizeof(pfd));
-    pfd.fd      = priv->fd;
+    pfd.fd      = priv->rx_fd;
     pfd.events  = POLLIN | POLLERR;
     pfd.revents = 0;
 
-    while (!(hdr->tp_status & TP_STATUS_USER)) {
+    while (!(bd->hdr.bh1.block_status & TP_STATUS_USER)) {
         rc = poll(&pfd, 1, 10);
         if ((rc < 0) && (errno != EINTR))
             sysf_printf("poll()");
 
         if (rc == 0)
-            return NULL;
+            return false;
     }
 
-    if (hdr->tp_status & TP_STATUS_COPY)
-        return NULL;
+    priv->rx_block      = bd;
+    priv->rx_frame      = (struct tpacket3_hdr *)
+                          ((uint8_t *) bd + bd->hdr.bh1.offset_to_first_pkt);
+    priv->rx_frame_left = bd->hdr.bh1.num_pkts;
 
-    if (hdr->tp_status & TP_STATUS_LOSING)
-        return NULL;
+    return true;
+}
+
+/*
+ * Frames are returned one by one from the current retired block, which is only
+ * handed back to the kernel once all of its frames have been released.
+ */
+static size_t netdev_capture_batch_sock(void *p, const uint8_t **bufs,
+                                        int *lens, size_t cnt) {
+    size_t i = 0;
+
+    struct priv *priv = p;
+
+    if (!priv->rx_block && !rx_block_wait(priv))
+        return 0;
 
-    *len = hdr->tp_len;
+    while ((i < cnt) && (priv->rx_frame_left > 0)) {
+        struct tpacket3_hdr *hdr = priv->rx_frame;
+        struct sockaddr_ll  *sll = (struct sockaddr_ll *)
+                                   ((uint8_t *) hdr +
+                                    TPACKET_ALIGN(sizeof(*hdr)));
 
-    return base + hdr->tp_mac;
+        priv->rx_frame = (struct tpacket3_hdr *)
+                         ((uint8_t *) hdr + hdr->tp_next_offset);
+        priv->rx_frame_left--;
+
+        /* skip our own packets, in case PACKET_IGNORE_OUTGOING is missing */
+        if (sll->sll_pkttype == PACKET_OUTGOING)
+            continue;
+
+        bufs[i] = (uint8_t *) hdr + hdr->tp_mac;
+        lens[i] = hdr->tp_snaplen;
+
+        i++;
+    }
+
+    /* the block only contained outgoing packets */
+    if ((i == 0) && (priv->rx_frame_left == 0))
+        rx_block_release(priv);
+
+    return i;
+}
+
+static const uint8_t *netdev_capture_sock(void *p, int *len) {
+    const uint8_t *buf;
+
+    if (netdev_capture_batch_sock(p, &buf, len, 1) == 0)
+        return NULL;
+
+    return buf;
 }
 
 static void netdev_release_sock(void *p) {
     struct priv *priv = p;
 
-    uint8_t *base = priv->rx_ring + (priv->rx_ring_off * RING_FRAME_SIZE);
-    struct tpacket2_hdr *hdr = (struct tpacket2_hdr *) base;
+    if (priv->rx_block && (priv->rx_frame_left == 0))
+        rx_block_release(priv);
+}
 
-    hdr->tp_status = TP_STATUS_KERNEL;
+static int netdev_set_filter_sock(void *p, const char *filter) {
+    struct priv *priv = p;
 
-    priv->rx_ring_off = (priv->rx_ring_off + 1) & (RING_FRAME_NR - 1);
+    return netdev_sock_filter(priv->rx_fd, filter);
 }
 
 static void netdev_close_sock(void *p) {
     struct priv *priv = p;
-    closep(&priv->fd);
+
+    closep(&priv->rx_fd);
+    closep(&priv->tx_fd);
 }
 
 const struct netdev_driver netdev_sock = {
@@ -229,8 +497,14 @@ const struct netdev_driver netdev_sock = {
     .get_buf = netdev_get_buf_sock,
     .inject  = netdev_inject_sock,
 
+    .reserve = netdev_reserve_sock,
+    .commit  = netdev_commit_sock,
+
     .capture = netdev_capture_sock,
+    .capture_batch = netdev_capture_batch_sock,
     .release = netdev_release_sock,
 
+    .set_filter = netdev_set_filter_sock,
+
     .close   = netdev_close_sock,
 };
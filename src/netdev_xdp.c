@@ -0,0 +1,860 @@
+/*
+ * Scriptable, asynchronous network packet generator/analyzer.
+ *
+ * Copyright (c) 2015, Alessandro Ghedini
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/poll.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#include <net/if.h>
+#include <linux/bpf.h>
+#include <linux/ethtool.h>
+#include <linux/if_ether.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+#include <linux/sockios.h>
+
+#include <urcu/arch.h>
+#include <urcu/compiler.h>
+
+#include "netdev.h"
+#include "printf.h"
+#include "util.h"
+
+#ifndef AF_XDP
+#define AF_XDP  44
+#endif
+
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+
+#define UMEM_FRAME_SIZE (1 << 11)
+#define UMEM_FRAME_NR   (1 << 12)
+
+/* the first half of the UMEM is used for receiving, the second for sending */
+#define RX_FRAME_NR     (UMEM_FRAME_NR / 2)
+#define TX_FRAME_NR     (UMEM_FRAME_NR / 2)
+
+/* all rings have the same size, big enough to hold all the receive frames */
+#define RING_SIZE       (1 << 11)
+#define RING_MASK       (RING_SIZE - 1)
+
+#define XSKMAP_SIZE     64
+
+#define INSN(c, d, s, o, i) \
+    { .code = (c), .dst_reg = (d), .src_reg = (s), .off = (o), .imm = (i) }
+
+struct ring {
+    uint32_t *producer;
+    uint32_t *consumer;
+    uint32_t *flags;
+    void     *descs;
+
+    /* local copy of the producer or consumer index, depending on the ring */
+    uint32_t head;
+
+    void  *map;
+    size_t map_len;
+};
+
+struct priv {
+    int fd;
+
+    int map_fd;
+    int prog_fd;
+    int link_fd;
+
+    bool zerocopy;
+
+    uint8_t *umem;
+
+    struct ring fill;
+    struct ring comp;
+    struct ring rx;
+    struct ring tx;
+
+    uint64_t tx_free[TX_FRAME_NR];
+    size_t   tx_free_nr;
+
+    /* number of frames captured, but not yet released */
+    uint32_t rx_cnt;
+};
+
+/* native zero-copy, native copy and generic modes */
+static const struct {
+    uint16_t bind_flags;
+    uint32_t xdp_flags;
+} xdp_modes[] = {
+    { XDP_ZEROCOPY, XDP_FLAGS_DRV_MODE },
+    { XDP_COPY,     XDP_FLAGS_DRV_MODE },
+    { XDP_COPY,     XDP_FLAGS_SKB_MODE },
+};
+
+#define XDP_MODES_NR (sizeof(xdp_modes) / sizeof(*xdp_modes))
+
+static int sys_bpf(int cmd, union bpf_attr *attr) {
+    return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+static uint32_t ring_avail(struct ring *r) {
+    uint32_t n = CMM_LOAD_SHARED(*r->producer) - r->head;
+
+    /* make sure the descriptors are read after the producer index */
+    cmm_smp_rmb();
+
+    return n;
+}
+
+static uint32_t ring_free(struct ring *r) {
+    return RING_SIZE - (r->head - CMM_LOAD_SHARED(*r->consumer));
+}
+
+static void ring_produce(struct ring *r, uint32_t n) {
+    cmm_smp_wmb();
+
+    r->head += n;
+    CMM_STORE_SHARED(*r->producer, r->head);
+}
+
+static void ring_consume(struct ring *r, uint32_t n) {
+    cmm_smp_mb();
+
+    r->head += n;
+    CMM_STORE_SHARED(*r->consumer, r->head);
+}
+
+static int map_ring(struct priv *priv, struct ring *r,
+                    const struct xdp_ring_offset *off, size_t desc_size,
+                    off_t pgoff) {
+    uint8_t *base;
+
+    r->map_len = off->desc + (RING_SIZE * desc_size);
+    r->map     = mmap(NULL, r->map_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, priv->fd, pgoff);
+    if (r->map == MAP_FAILED) {
+        r->map = NULL;
+        return -1;
+    }
+
+    base = r->map;
+
+    r->producer = (uint32_t *) (base + off->producer);
+    r->consumer = (uint32_t *) (base + off->consumer);
+    r->flags    = (uint32_t *) (base + off->flags);
+    r->descs    = base + off->desc;
+
+    return 0;
+}
+
+static void unmap_ring(struct ring *r) {
+    if (r->map != NULL)
+        munmap(r->map, r->map_len);
+
+    memset(r, 0, sizeof(*r));
+}
+
+static int set_ring(struct priv *priv, int opt) {
+    int size = RING_SIZE;
+    return setsockopt(priv->fd, SOL_XDP, opt, &size, sizeof(size));
+}
+
+static int open_socket(struct priv *priv, const struct netdev_opts *opts) {
+    int rc;
+
+    struct xdp_umem_reg mr;
+    struct xdp_mmap_offsets off;
+
+    socklen_t off_len = sizeof(off);
+
+    priv->fd = socket(AF_XDP, SOCK_RAW, 0);
+    if (priv->fd < 0)
+        return -1;
+
+    priv->umem = mmap(NULL, UMEM_FRAME_NR * UMEM_FRAME_SIZE,
+                      PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                      -1, 0);
+    if (priv->umem == MAP_FAILED)
+        return -1;
+
+    memset(&mr, 0, sizeof(mr));
+    mr.addr       = (uintptr_t) priv->umem;
+    mr.len        = UMEM_FRAME_NR * UMEM_FRAME_SIZE;
+    mr.chunk_size = UMEM_FRAME_SIZE;
+    mr.headroom   = 0;
+
+    rc = setsockopt(priv->fd, SOL_XDP, XDP_UMEM_REG, &mr, sizeof(mr));
+    if (rc < 0)
+        return -1;
+
+    /* the fill and completion rings are required even if unused */
+    if ((set_ring(priv, XDP_UMEM_FILL_RING) < 0) ||
+        (set_ring(priv, XDP_UMEM_COMPLETION_RING) < 0))
+        return -1;
+
+    if ((opts->flags & NETDEV_RX) && (set_ring(priv, XDP_RX_RING) < 0))
+        return -1;
+
+    if ((opts->flags & NETDEV_TX) && (set_ring(priv, XDP_TX_RING) < 0))
+        return -1;
+
+    rc = getsockopt(priv->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &off_len);
+    if (rc < 0)
+        return -1;
+
+    if ((map_ring(priv, &priv->fill, &off.fr, sizeof(uint64_t),
+                  XDP_UMEM_PGOFF_FILL_RING) < 0) ||
+        (map_ring(priv, &priv->comp, &off.cr, sizeof(uint64_t),
+                  XDP_UMEM_PGOFF_COMPLETION_RING) < 0))
+        return -1;
+
+    if ((opts->flags & NETDEV_RX) &&
+        (map_ring(priv, &priv->rx, &off.rx, sizeof(struct xdp_desc),
+                  XDP_PGOFF_RX_RING) < 0))
+        return -1;
+
+    if ((opts->flags & NETDEV_TX) &&
+        (map_ring(priv, &priv->tx, &off.tx, sizeof(struct xdp_desc),
+                  XDP_PGOFF_TX_RING) < 0))
+        return -1;
+
+    if (opts->flags & NETDEV_RX) {
+        uint64_t *addrs = priv->fill.descs;
+
+        for (size_t i = 0; i < RX_FRAME_NR; i++)
+            addrs[i] = i * UMEM_FRAME_SIZE;
+
+        ring_produce(&priv->fill, RX_FRAME_NR);
+    }
+
+    for (size_t i = 0; i < TX_FRAME_NR; i++)
+        priv->tx_free[i] = (RX_FRAME_NR + i) * UMEM_FRAME_SIZE;
+
+    priv->tx_free_nr = TX_FRAME_NR;
+
+    return 0;
+}
+
+static int bind_socket(struct priv *priv, unsigned ifindex, unsigned queue,
+                       uint16_t flags) {
+    struct sockaddr_xdp addr;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sxdp_family   = AF_XDP;
+    addr.sxdp_ifindex  = ifindex;
+    addr.sxdp_queue_id = queue;
+    addr.sxdp_flags    = flags | XDP_USE_NEED_WAKEUP;
+
+    if (bind(priv->fd, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+        return -1;
+
+    priv->zerocopy = (flags & XDP_ZEROCOPY);
+
+    return 0;
+}
+
+/*
+ * Load and attach an XDP program that redirects the IPv4 packets and ARP
+ * replies addressed to the local address to the socket, and passes everything
+ * else to the kernel. The program is detached automatically once the link is
+ * closed.
+ */
+static int attach_prog(struct priv *priv, unsigned ifindex, unsigned queue,
+                       uint32_t addr, uint32_t flags) {
+    union bpf_attr attr;
+
+    if (queue >= XSKMAP_SIZE) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type    = BPF_MAP_TYPE_XSKMAP;
+    attr.key_size    = sizeof(uint32_t);
+    attr.value_size  = sizeof(uint32_t);
+    attr.max_entries = XSKMAP_SIZE;
+
+    priv->map_fd = sys_bpf(BPF_MAP_CREATE, &attr);
+    if (priv->map_fd < 0)
+        return -1;
+
+    /*
+     * if (data + ETH_HLEN + 28 > data_end)
+     *     return XDP_PASS;
+     *
+     * switch (eth->h_proto) {
+     * case htons(ETH_P_IP):
+     *     dst = ip->daddr;
+     *     break;
+     *
+     * case htons(ETH_P_ARP):
+     *     if (arp->ar_op != htons(ARPOP_REPLY))
+     *         return XDP_PASS;
+     *
+     *     dst = arp->ar_tip;
+     *     break;
+     *
+     * default:
+     *     return XDP_PASS;
+     * }
+     *
+     * if (dst != htonl(addr))
+     *     return XDP_PASS;
+     *
+     * return bpf_redirect_map(&xsks, ctx->rx_queue_index, XDP_PASS);
+     */
+    struct bpf_insn prog[] = {
+        /* 0 */
+        INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_1,
+             offsetof(struct xdp_md, data), 0),
+        INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_3, BPF_REG_1,
+             offsetof(struct xdp_md, data_end), 0),
+        INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_4, BPF_REG_1,
+             offsetof(struct xdp_md, rx_queue_index), 0),
+
+        /* 3: the ARP header is the longest one needed */
+        INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_5, BPF_REG_2, 0, 0),
+        INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_5, 0, 0, ETH_HLEN + 28),
+        INSN(BPF_JMP | BPF_JGT | BPF_X, BPF_REG_5, BPF_REG_3, 15, 0),
+
+        /* 6: ethertype */
+        INSN(BPF_LDX | BPF_MEM | BPF_H, BPF_REG_0, BPF_REG_2, 12, 0),
+        INSN(BPF_JMP32 | BPF_JEQ | BPF_K, BPF_REG_0, 0, 5, htons(ETH_P_IP)),
+        INSN(BPF_JMP32 | BPF_JNE | BPF_K, BPF_REG_0, 0, 12, htons(ETH_P_ARP)),
+
+        /* 9: ARP operation and target address */
+        INSN(BPF_LDX | BPF_MEM | BPF_H, BPF_REG_0, BPF_REG_2, ETH_HLEN + 6, 0),
+        INSN(BPF_JMP32 | BPF_JNE | BPF_K, BPF_REG_0, 0, 10, htons(2)),
+        INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_0, BPF_REG_2, ETH_HLEN + 24, 0),
+        INSN(BPF_JMP | BPF_JA, 0, 0, 1, 0),
+
+        /* 13: IPv4 destination address */
+        INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_0, BPF_REG_2, ETH_HLEN + 16, 0),
+
+        /* 14 */
+        INSN(BPF_JMP32 | BPF_JNE | BPF_K, BPF_REG_0, 0, 6, htonl(addr)),
+
+        /* 15 */
+        INSN(BPF_LD | BPF_DW | BPF_IMM, BPF_REG_1, BPF_PSEUDO_MAP_FD, 0,
+             priv->map_fd),
+        INSN(0, 0, 0, 0, 0),
+        INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_4, 0, 0),
+        INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_3, 0, 0, XDP_PASS),
+        INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map),
+        INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+
+        /* 21 */
+        INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, XDP_PASS),
+        INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+    };
+
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = BPF_PROG_TYPE_XDP;
+    attr.insns     = (uintptr_t) prog;
+    attr.insn_cnt  = sizeof(prog) / sizeof(*prog);
+    attr.license   = (uintptr_t) "Dual BSD/GPL";
+
+    priv->prog_fd = sys_bpf(BPF_PROG_LOAD, &attr);
+    if (priv->prog_fd < 0)
+        return -1;
+
+    uint32_t key = queue;
+    uint32_t val = priv->fd;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = priv->map_fd;
+    attr.key    = (uintptr_t) &key;
+    attr.value  = (uintptr_t) &val;
+
+    if (sys_bpf(BPF_MAP_UPDATE_ELEM, &attr) < 0)
+        return -1;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.link_create.prog_fd        = priv->prog_fd;
+    attr.link_create.target_ifindex = ifindex;
+    attr.link_create.attach_type    = BPF_XDP;
+    attr.link_create.flags          = flags;
+
+    priv->link_fd = sys_bpf(BPF_LINK_CREATE, &attr);
+    if (priv->link_fd < 0)
+        return -1;
+
+    return 0;
+}
+
+static int count_rx_queues(const char *dev_name) {
+    int cnt = 0;
+
+    char path[64];
+
+    struct dirent *ent;
+
+    snprintf(path, sizeof(path), "/sys/class/net/%s/queues", dev_name);
+
+    DIR *dir = opendir(path);
+    if (dir == NULL)
+        return -1;
+
+    while ((ent = readdir(dir)) != NULL) {
+        if (strncmp(ent->d_name, "rx-", 3) == 0)
+            cnt++;
+    }
+
+    closedir(dir);
+
+    return cnt;
+}
+
+static bool match_flow_rule(const struct ethtool_rx_flow_spec *fs,
+                            unsigned queue, uint32_t addr) {
+    uint32_t dst, mask;
+
+    if (fs->ring_cookie != queue)
+        return false;
+
+    switch (fs->flow_type & ~(FLOW_EXT | FLOW_MAC_EXT | FLOW_RSS)) {
+    case TCP_V4_FLOW:
+    case UDP_V4_FLOW:
+    case SCTP_V4_FLOW:
+        dst  = fs->h_u.tcp_ip4_spec.ip4dst;
+        mask = fs->m_u.tcp_ip4_spec.ip4dst;
+        break;
+
+    case IP_USER_FLOW:
+        dst  = fs->h_u.usr_ip4_spec.ip4dst;
+        mask = fs->m_u.usr_ip4_spec.ip4dst;
+        break;
+
+    default:
+        return false;
+    }
+
+    return (mask == UINT32_MAX) && (dst == htonl(addr));
+}
+
+/*
+ * Check whether any of the device's flow steering (ntuple) rules sends the
+ * packets addressed to the local address to the given queue.
+ */
+static bool has_flow_rule(const char *dev_name, unsigned queue, uint32_t addr) {
+    struct ifreq ifr;
+    struct ethtool_rxnfc cnt;
+
+    _free_ struct ethtool_rxnfc *all = NULL;
+
+    _close_ int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0)
+        return false;
+
+    memset(&ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, dev_name, sizeof(ifr.ifr_name) - 1);
+
+    memset(&cnt, 0, sizeof(cnt));
+    cnt.cmd = ETHTOOL_GRXCLSRLCNT;
+
+    ifr.ifr_data = (void *) &cnt;
+
+    if ((ioctl(fd, SIOCETHTOOL, &ifr) < 0) || (cnt.rule_cnt == 0))
+        return false;
+
+    all = calloc(1, sizeof(*all) + cnt.rule_cnt * sizeof(uint32_t));
+    if (all == NULL)
+        return false;
+
+    all->cmd      = ETHTOOL_GRXCLSRLALL;
+    all->rule_cnt = cnt.rule_cnt;
+
+    ifr.ifr_data = (void *) all;
+
+    if (ioctl(fd, SIOCETHTOOL, &ifr) < 0)
+        return false;
+
+    for (uint32_t i = 0; i < all->rule_cnt; i++) {
+        struct ethtool_rxnfc rule;
+
+        memset(&rule, 0, sizeof(rule));
+        rule.cmd         = ETHTOOL_GRXCLSRULE;
+        rule.fs.location = all->rule_locs[i];
+
+        ifr.ifr_data = (void *) &rule;
+
+        if (ioctl(fd, SIOCETHTOOL, &ifr) < 0)
+            continue;
+
+        if (match_flow_rule(&rule.fs, queue, addr))
+            return true;
+    }
+
+    return false;
+}
+
+/*
+ * Only a single device queue is bound to the socket, so all the replies must
+ * be received on it, either because the device has a single receive queue,
+ * or because a flow steering rule sends them there.
+ */
+static int check_rx_queues(const char *dev_name, unsigned queue,
+                           uint32_t addr) {
+    if (count_rx_queues(dev_name) == 1)
+        return 0;
+
+    if (has_flow_rule(dev_name, queue, addr))
+        return 0;
+
+    err_printf("Device %s has multiple receive queues, and no flow rule "
+               "steering the local address to queue %u (see ethtool -L or -N)",
+               dev_name, queue);
+    return -1;
+}
+
+static void netdev_close_xdp(void *p);
+
+/*
+ * Try the available XDP modes from the fastest to the slowest, and give up if
+ * none of them is supported by the kernel or the device driver, so that a
+ * different netdev driver can be used instead.
+ */
+static int netdev_open_xdp(void *p, const char *dev_name,
+                           const struct netdev_opts *opts) {
+    int err = 0;
+
+    struct priv *priv = p;
+
+    unsigned ifindex = if_nametoindex(dev_name);
+    if (ifindex == 0)
+        sysf_printf("if_nametoindex()");
+
+    if (opts->flags & NETDEV_FANOUT) {
+        err_printf("Multiple receive threads not supported by xdp netdev");
+        return -1;
+    }
+
+    if ((opts->flags & NETDEV_RX) &&
+        (check_rx_queues(dev_name, opts->queue, opts->local_addr) < 0))
+        return -1;
+
+    priv->fd      = -1;
+    priv->map_fd  = -1;
+    priv->prog_fd = -1;
+    priv->link_fd = -1;
+
+    for (size_t i = 0; i < XDP_MODES_NR; i++) {
+        /* the XDP program is only needed for receiving */
+        if (!(opts->flags & NETDEV_RX) &&
+            (xdp_modes[i].xdp_flags == XDP_FLAGS_SKB_MODE))
+            break;
+
+        if ((priv->fd < 0) &&
+            ((open_socket(priv, opts) < 0) ||
+             (bind_socket(priv, ifindex, opts->queue,
+                          xdp_modes[i].bind_flags) < 0))) {
+            err = errno;
+            netdev_close_xdp(priv);
+            continue;
+        }
+
+        if (!(opts->flags & NETDEV_RX) ||
+            (attach_prog(priv, ifindex, opts->queue, opts->local_addr,
+                         xdp_modes[i].xdp_flags) == 0))
+            return 0;
+
+        err = errno;
+
+        closep(&priv->link_fd);
+        closep(&priv->prog_fd);
+        closep(&priv->map_fd);
+
+        /*
+         * The device queue is only released some time after the socket is
+         * closed, so keep using the same socket if the next mode allows it.
+         */
+        if ((i + 1 < XDP_MODES_NR) &&
+            (xdp_modes[i + 1].bind_flags == xdp_modes[i].bind_flags))
+            continue;
+
+        netdev_close_xdp(priv);
+    }
+
+    netdev_close_xdp(priv);
+
+    err_printf("Error setting up AF_XDP socket: %s", strerror(err));
+    return -1;
+}
+
+static void tx_complete(struct priv *priv) {
+    uint64_t *addrs = priv->comp.descs;
+
+    uint32_t n = ring_avail(&priv->comp);
+
+    for (uint32_t i = 0; i < n; i++) {
+        uint64_t addr = addrs[(priv->comp.head + i) & RING_MASK];
+        priv->tx_free[priv->tx_free_nr++] = addr;
+    }
+
+    if (n > 0)
+        ring_consume(&priv->comp, n);
+}
+
+static void tx_kick(struct priv *priv) {
+    int rc;
+
+    /* in copy mode the packets are only sent from sendto() */
+    if (priv->zerocopy &&
+        !(CMM_LOAD_SHARED(*priv->tx.flags) & XDP_RING_NEED_WAKEUP))
+        return;
+
+    rc = sendto(priv->fd, NULL, 0, MSG_DONTWAIT, NULL, 0);
+    if ((rc < 0) && (errno != EAGAIN) && (errno != EBUSY) &&
+        (errno != ENOBUFS) && (errno != ENETDOWN))
+        sysf_printf("sendto()");
+}
+
+static void tx_wait(struct priv *priv) {
+    int rc;
+
+    struct pollfd pfd;
+
+    memset(&pfd, 0, sizeof(pfd));
+    pfd.fd      = priv->fd;
+    pfd.events  = POLLOUT;
+    pfd.revents = 0;
+
+    while (true) {
+        tx_complete(priv);
+
+        if ((priv->tx_free_nr > 0) && (ring_free(&priv->tx) > 0))
+            return;
+
+        tx_kick(priv);
+
+        rc = poll(&pfd, 1, 10);
+        if ((rc < 0) && (errno != EINTR))
+            sysf_printf("poll()");
+    }
+}
+
+/*
+ * Frames are handed out from the top of the free list, and only taken off it
+ * once committed, so the buffers must be committed in the same order they
+ * were reserved.
+ */
+static size_t netdev_reserve_xdp(void *p, uint8_t **bufs, size_t *lens,
+                                 size_t cnt) {
+    size_t i;
+
+    struct priv *priv = p;
+
+    tx_wait(priv);
+
+    if (cnt > priv->tx_free_nr)
+        cnt = priv->tx_free_nr;
+
+    if (cnt > ring_free(&priv->tx))
+        cnt = ring_free(&priv->tx);
+
+    for (i = 0; i < cnt; i++) {
+        uint64_t addr = priv->tx_free[priv->tx_free_nr - 1 - i];
+
+        bufs[i] = priv->umem + addr;
+        lens[i] = UMEM_FRAME_SIZE;
+    }
+
+    return i;
+}
+
+static void netdev_commit_xdp(void *p, uint8_t **bufs, size_t *lens,
+                              size_t cnt) {
+    struct priv *priv = p;
+
+    struct xdp_desc *descs = priv->tx.descs;
+
+    if (cnt == 0)
+        return;
+
+    for (size_t i = 0; i < cnt; i++) {
+        struct xdp_desc *desc = &descs[(priv->tx.head + i) & RING_MASK];
+
+        desc->addr    = bufs[i] - priv->umem;
+        desc->len     = lens[i];
+        desc->options = 0;
+    }
+
+    priv->tx_free_nr -= cnt;
+
+    ring_produce(&priv->tx, cnt);
+
+    /* kick the TX ring only once for the whole batch */
+    tx_kick(priv);
+}
+
+static uint8_t *netdev_get_buf_xdp(void *p, size_t *len) {
+    uint8_t *buf;
+
+    netdev_reserve_xdp(p, &buf, len, 1);
+
+    return buf;
+}
+
+static void netdev_inject_xdp(void *p, uint8_t *buf, size_t len) {
+    netdev_commit_xdp(p, &buf, &len, 1);
+}
+
+static size_t netdev_capture_batch_xdp(void *p, const uint8_t **bufs,
+                                       int *lens, size_t cnt) {
+    int rc;
+
+    struct priv *priv = p;
+
+    struct xdp_desc *descs = priv->rx.descs;
+
+    uint32_t avail = ring_avail(&priv->rx) - priv->rx_cnt;
+
+    if (avail == 0) {
+        struct pollfd pfd;
+
+        memset(&pfd, 0, sizeof(pfd));
+        pfd.fd      = priv->fd;
+        pfd.events  = POLLIN;
+        pfd.revents = 0;
+
+        rc = poll(&pfd, 1, 10);
+        if ((rc < 0) && (errno != EINTR))
+            sysf_printf("poll()");
+
+        avail = ring_avail(&priv->rx) - priv->rx_cnt;
+        if (avail == 0)
+            return 0;
+    }
+
+    if (cnt > avail)
+        cnt = avail;
+
+    for (size_t i = 0; i < cnt; i++) {
+        struct xdp_desc *desc =
+            &descs[(priv->rx.head + priv->rx_cnt + i) & RING_MASK];
+
+        bufs[i] = priv->umem + desc->addr;
+        lens[i] = desc->len;
+    }
+
+    priv->rx_cnt += cnt;
+
+    return cnt;
+}
+
+static const uint8_t *netdev_capture_xdp(void *p, int *len) {
+    const uint8_t *buf;
+
+    if (netdev_capture_batch_xdp(p, &buf, len, 1) == 0)
+        return NULL;
+
+    return buf;
+}
+
+/*
+ * Give the captured frames back to the kernel through the fill ring, which is
+ * big enough to hold all the receive frames, so it can never overflow.
+ */
+static void netdev_release_xdp(void *p) {
+    struct priv *priv = p;
+
+    uint64_t        *addrs = priv->fill.descs;
+    struct xdp_desc *descs = priv->rx.descs;
+
+    if (priv->rx_cnt == 0)
+        return;
+
+    for (uint32_t i = 0; i < priv->rx_cnt; i++) {
+        uint64_t addr = descs[(priv->rx.head + i) & RING_MASK].addr;
+
+        /* in aligned mode the address may point past the frame start */
+        addrs[(priv->fill.head + i) & RING_MASK] =
+            addr & ~((uint64_t) UMEM_FRAME_SIZE - 1);
+    }
+
+    ring_consume(&priv->rx, priv->rx_cnt);
+    ring_produce(&priv->fill, priv->rx_cnt);
+
+    priv->rx_cnt = 0;
+}
+
+static void netdev_close_xdp(void *p) {
+    struct priv *priv = p;
+
+    /* closing the link also detaches the XDP program */
+    closep(&priv->link_fd);
+    closep(&priv->prog_fd);
+    closep(&priv->map_fd);
+
+    unmap_ring(&priv->fill);
+    unmap_ring(&priv->comp);
+    unmap_ring(&priv->rx);
+    unmap_ring(&priv->tx);
+
+    closep(&priv->fd);
+
+    if ((priv->umem != NULL) && (priv->umem != MAP_FAILED))
+        munmap(priv->umem, UMEM_FRAME_NR * UMEM_FRAME_SIZE);
+
+    priv->umem = NULL;
+}
+
+const struct netdev_driver netdev_xdp = {
+    .name    = "xdp",
+
+    .priv_size = sizeof(struct priv),
+
+    .open    = netdev_open_xdp,
+
+    .get_buf = netdev_get_buf_xdp,
+    .inject  = netdev_inject_xdp,
+
+    .reserve = netdev_reserve_xdp,
+    .commit  = netdev_commit_xdp,
+
+    .capture = netdev_capture_xdp,
+    .capture_batch = netdev_capture_batch_xdp,
+    .release = netdev_release_xdp,
+
+    .close   = netdev_close_xdp,
+};
@@ -0,0 +1,527 @@
+/*
+ * Scriptable, asynchronous network packet generator/analyzer.
+ *
+ * Copyright (c) 2015, Alessandro Ghedini
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Records emitted by scripts are encoded into a ring owned by the emitting
+ * thread, without any formatting or locking, and a dedicated writer thread
+ * formats them and writes them out in large chunks. When the writer can't keep
+ * up and a ring is full, new records are dropped and counted rather than
+ * slowing down packet processing.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <unistd.h>
+
+#include <pthread.h>
+
+#include <urcu/arch.h>
+#include <urcu/uatomic.h>
+
+#include "output.h"
+#include "printf.h"
+#include "util.h"
+
+/* size of each thread's ring, must be a power of two */
+#define OUTPUT_RING (1 << 20)
+
+/* size of the write buffer */
+#define OUTPUT_BUF (1 << 20)
+
+/* microseconds the writer waits when there's nothing to write */
+#define OUTPUT_IDLE 1000
+
+static void *writer_cb(void *p);
+
+void output_open(struct output *out, const char *path,
+                 enum output_format format) {
+    if (!path || !strcmp(path, "-"))
+        out->fd = STDOUT_FILENO;
+    else
+        out->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+    if (out->fd < 0)
+        sysf_printf("Error opening '%s'", path);
+
+    out->format = format;
+    out->rings  = NULL;
+
+    out->buf = malloc(OUTPUT_BUF);
+    if (out->buf == NULL)
+        fail_printf("OOM");
+
+    out->len    = 0;
+    out->header = false;
+
+    out->records      = 0;
+    out->drops        = 0;
+    out->backlog      = 0;
+    out->backlog_peak = 0;
+
+    out->stop = false;
+
+    if (pthread_create(&out->thread, NULL, writer_cb, out))
+        fail_printf("Error creating output thread");
+}
+
+/*
+ * Only call once all the threads emitting records are done, the remaining
+ * records are written out before returning.
+ */
+void output_close(struct output *out) {
+    struct output_ring *ring, *tmp;
+
+    CMM_STORE_SHARED(out->stop, true);
+
+    pthread_join(out->thread, NULL);
+
+    if (out->fd != STDOUT_FILENO)
+        close(out->fd);
+
+    for (ring = out->rings; ring != NULL; ring = tmp) {
+        tmp = ring->next;
+
+        out->drops += ring->drops;
+
+        free(ring->buf);
+        free(ring);
+    }
+
+    freep(&out->buf);
+
+    out->rings = NULL;
+}
+
+struct output_ring *output_ring_new(struct output *out) {
+    struct output_ring *ring = calloc(1, sizeof(*ring));
+    if (ring == NULL)
+        fail_printf("OOM");
+
+    ring->size = OUTPUT_RING;
+    ring->buf  = malloc(ring->size);
+
+    if (ring->buf == NULL)
+        fail_printf("OOM");
+
+    /* rings are only ever added, and only freed by output_close() */
+    struct output_ring *old = CMM_LOAD_SHARED(out->rings), *cur;
+
+    do {
+        ring->next = old;
+
+        cur = old;
+        old = uatomic_cmpxchg(&out->rings, cur, ring);
+    } while (old != cur);
+
+    return ring;
+}
+
+void output_rec_init(struct output_rec *rec) {
+    uint32_t len = 1;
+
+    memcpy(rec->buf, &len, sizeof(len));
+    rec->buf[4] = 0;
+
+    rec->len      = 5;
+    rec->overflow = false;
+}
+
+static uint8_t *rec_field(struct output_rec *rec, enum output_type type,
+                          const char *key, size_t klen, size_t vlen) {
+    uint8_t *p = rec->buf + rec->len;
+
+    if ((klen > UINT8_MAX) || (rec->buf[4] == UINT8_MAX) ||
+        (rec->len + 2 + klen + vlen > sizeof(rec->buf))) {
+        rec->overflow = true;
+        return NULL;
+    }
+
+    *p++ = type;
+    *p++ = klen;
+
+    memcpy(p, key, klen);
+    p += klen;
+
+    rec->len += 2 + klen + vlen;
+    rec->buf[4]++;
+
+    uint32_t len = rec->len - sizeof(len);
+    memcpy(rec->buf, &len, sizeof(len));
+
+    return p;
+}
+
+void output_rec_int(struct output_rec *rec, const char *key, size_t klen,
+                    int64_t v) {
+    uint8_t *p = rec_field(rec, OUTPUT_INT, key, klen, sizeof(v));
+    if (p != NULL)
+        memcpy(p, &v, sizeof(v));
+}
+
+void output_rec_num(struct output_rec *rec, const char *key, size_t klen,
+                    double v) {
+    uint8_t *p = rec_field(rec, OUTPUT_NUM, key, klen, sizeof(v));
+    if (p != NULL)
+        memcpy(p, &v, sizeof(v));
+}
+
+void output_rec_bool(struct output_rec *rec, const char *key, size_t klen,
+                     bool v) {
+    uint8_t *p = rec_field(rec, OUTPUT_BOOL, key, klen, 1);
+    if (p != NULL)
+        *p = v;
+}
+
+void output_rec_str(struct output_rec *rec, const char *key, size_t klen,
+                    const char *s, size_t len) {
+    uint16_t len16 = len;
+
+    if (len > UINT16_MAX) {
+        rec->overflow = true;
+        return;
+    }
+
+    uint8_t *p = rec_field(rec, OUTPUT_STR, key, klen, sizeof(len16) + len);
+    if (p == NULL)
+        return;
+
+    memcpy(p, &len16, sizeof(len16));
+    memcpy(p + sizeof(len16), s, len);
+}
+
+/*
+ * Queue the record for the writer thread, or count it as dropped if it's too
+ * large or there isn't enough space in the ring. Only called by the thread
+ * owning the ring.
+ */
+bool output_push(struct output_ring *ring, const struct output_rec *rec) {
+    uint64_t head = ring->head;
+    uint64_t tail = CMM_LOAD_SHARED(ring->tail);
+
+    if (rec->overflow || (rec->len > ring->size - (head - tail))) {
+        CMM_STORE_SHARED(ring->drops, ring->drops + 1);
+        return false;
+    }
+
+    size_t off   = head & (ring->size - 1);
+    size_t first = ring->size - off;
+
+    if (first > rec->len)
+        first = rec->len;
+
+    memcpy(ring->buf + off, rec->buf, first);
+    memcpy(ring->buf, rec->buf + first, rec->len - first);
+
+    cmm_smp_wmb();
+    CMM_STORE_SHARED(ring->head, head + rec->len);
+
+    return true;
+}
+
+uint64_t output_drops(struct output *out) {
+    uint64_t drops = out->drops;
+
+    for (struct output_ring *ring = CMM_LOAD_SHARED(out->rings); ring != NULL;
+         ring = ring->next)
+        drops += CMM_LOAD_SHARED(ring->drops);
+
+    return drops;
+}
+
+static void out_flush(struct output *out) {
+    size_t off = 0;
+
+    while (off < out->len) {
+        ssize_t rc = write(out->fd, out->buf + off, out->len - off);
+        if (rc < 0) {
+            if (errno == EINTR)
+                continue;
+
+            sysf_printf("Error writing output");
+        }
+
+        off += rc;
+    }
+
+    out->len = 0;
+}
+
+static void out_write(struct output *out, const void *data, size_t len) {
+    if (out->len + len > OUTPUT_BUF)
+        out_flush(out);
+
+    memcpy(out->buf + out->len, data, len);
+    out->len += len;
+}
+
+static void out_char(struct output *out, char c) {
+    if (out->len == OUTPUT_BUF)
+        out_flush(out);
+
+    out->buf[out->len++] = c;
+}
+
+static void out_json_str(struct output *out, const uint8_t *s, size_t len) {
+    out_char(out, '"');
+
+    for (size_t i = 0; i < len; i++) {
+        char tmp[8];
+
+        if ((s[i] == '"') || (s[i] == '\\')) {
+            out_char(out, '\\');
+            out_char(out, s[i]);
+        } else if (s[i] < 0x20) {
+            snprintf(tmp, sizeof(tmp), "\\u%04x", s[i]);
+            out_write(out, tmp, 6);
+        } else {
+            out_char(out, s[i]);
+        }
+    }
+
+    out_char(out, '"');
+}
+
+static void out_csv_str(struct output *out, const uint8_t *s, size_t len) {
+    bool quote = false;
+
+    for (size_t i = 0; i < len && !quote; i++)
+        quote = (s[i] == ',') || (s[i] == '"') ||
+                (s[i] == '\r') || (s[i] == '\n');
+
+    if (!quote) {
+        out_write(out, s, len);
+        return;
+    }
+
+    out_char(out, '"');
+
+    for (size_t i = 0; i < len; i++) {
+        if (s[i] == '"')
+            out_char(out, '"');
+
+        out_char(out, s[i]);
+    }
+
+    out_char(out, '"');
+}
+
+/* write the record, with p pointing to the field count */
+static void out_record(struct output *out, const uint8_t *p, size_t len) {
+    bool json = (out->format == OUTPUT_JSON);
+
+    if (out->format == OUTPUT_BINARY) {
+        uint32_t len32 = len;
+
+        out_write(out, &len32, sizeof(len32));
+        out_write(out, p, len);
+        return;
+    }
+
+    unsigned cnt = *p++;
+
+    if (!json && !out->header) {
+        const uint8_t *q = p;
+
+        for (unsigned i = 0; i < cnt; i++) {
+            uint8_t type = *q++, klen = *q++;
+            uint16_t slen;
+
+            if (i > 0)
+                out_char(out, ',');
+
+            out_csv_str(out, q, klen);
+            q += klen;
+
+            switch (type) {
+            case OUTPUT_INT:
+            case OUTPUT_NUM:  q += 8; break;
+            case OUTPUT_BOOL: q += 1; break;
+            case OUTPUT_STR:
+                memcpy(&slen, q, sizeof(slen));
+                q += sizeof(slen) + slen;
+                break;
+            }
+        }
+
+        out_char(out, '\n');
+        out->header = true;
+    }
+
+    if (json)
+        out_char(out, '{');
+
+    for (unsigned i = 0; i < cnt; i++) {
+        uint8_t type = *p++, klen = *p++;
+        const uint8_t *key = p;
+
+        char tmp[32];
+        int n = 0;
+
+        int64_t  vi;
+        double   vd;
+        uint16_t slen;
+
+        p += klen;
+
+        if (i > 0)
+            out_char(out, ',');
+
+        if (json) {
+            out_json_str(out, key, klen);
+            out_char(out, ':');
+        }
+
+        switch (type) {
+        case OUTPUT_INT:
+            memcpy(&vi, p, sizeof(vi));
+            p += sizeof(vi);
+
+            n = snprintf(tmp, sizeof(tmp), "%lld", (long long) vi);
+            break;
+
+        case OUTPUT_NUM:
+            memcpy(&vd, p, sizeof(vd));
+            p += sizeof(vd);
+
+            if (isfinite(vd))
+                n = snprintf(tmp, sizeof(tmp), "%.17g", vd);
+            else if (json)
+                n = snprintf(tmp, sizeof(tmp), "null");
+            break;
+
+        case OUTPUT_BOOL:
+            n = snprintf(tmp, sizeof(tmp), "%s", *p++ ? "true" : "false");
+            break;
+
+        case OUTPUT_STR:
+            memcpy(&slen, p, sizeof(slen));
+            p += sizeof(slen);
+
+            if (json)
+                out_json_str(out, p, slen);
+            else
+                out_csv_str(out, p, slen);
+
+            p += slen;
+            break;
+        }
+
+        out_write(out, tmp, n);
+    }
+
+    if (json)
+        out_char(out, '}');
+
+    out_char(out, '\n');
+}
+
+static void ring_copy(struct output_ring *ring, uint64_t pos,
+                      void *dst, size_t len) {
+    size_t off   = pos & (ring->size - 1);
+    size_t first = ring->size - off;
+
+    if (first > len)
+        first = len;
+
+    memcpy(dst, ring->buf + off, first);
+    memcpy((uint8_t *) dst + first, ring->buf, len - first);
+}
+
+static void *writer_cb(void *p) {
+    struct output *out = p;
+
+    uint8_t rec[OUTPUT_REC_MAX];
+
+    if (pthread_setname_np(pthread_self(), "pktizr: output"))
+        fail_printf("Error setting thread name");
+
+    while (true) {
+        struct output_ring *ring;
+
+        bool stop = CMM_LOAD_SHARED(out->stop);
+        bool busy = false;
+
+        uint64_t backlog = 0;
+
+        cmm_smp_mb();
+
+        for (ring = CMM_LOAD_SHARED(out->rings); ring; ring = ring->next) {
+            uint64_t head = CMM_LOAD_SHARED(ring->head);
+            uint64_t tail = ring->tail;
+
+            cmm_smp_rmb();
+
+            backlog += head - tail;
+
+            while (tail < head) {
+                uint32_t len;
+
+                ring_copy(ring, tail, &len, sizeof(len));
+                ring_copy(ring, tail + sizeof(len), rec, len);
+
+                out_record(out, rec, len);
+
+                tail += sizeof(len) + len;
+                out->records++;
+            }
+
+            if (tail != ring->tail) {
+                cmm_smp_mb();
+                CMM_STORE_SHARED(ring->tail, tail);
+
+                busy = true;
+            }
+        }
+
+        CMM_STORE_SHARED(out->backlog, backlog);
+
+        if (backlog > out->backlog_peak)
+            CMM_STORE_SHARED(out->backlog_peak, backlog);
+
+        if (busy)
+            continue;
+
+        out_flush(out);
+
+        /* nothing left after every producer was done */
+        if (stop)
+            break;
+
+        time_sleep(OUTPUT_IDLE);
+    }
+
+    return NULL;
+}
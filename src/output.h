@@ -0,0 +1,117 @@
+/*
+ * Scriptable, asynchronous network packet generator/analyzer.
+ *
+ * Copyright (c) 2015, Alessandro Ghedini
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+enum output_format {
+    OUTPUT_JSON,
+    OUTPUT_CSV,
+    OUTPUT_BINARY,
+};
+
+enum output_type {
+    OUTPUT_INT  = 1,
+    OUTPUT_NUM  = 2,
+    OUTPUT_BOOL = 3,
+    OUTPUT_STR  = 4,
+};
+
+/* largest encoded record, larger ones are dropped */
+#define OUTPUT_REC_MAX 4096
+
+/*
+ * A record, encoded as a 32-bit length of the rest of the record, the number
+ * of fields and, for each field, its type, key length and key, followed by the
+ * value: 8 bytes for integers and numbers, 1 byte for booleans and a 16-bit
+ * length followed by the bytes for strings. All in native byte order.
+ */
+struct output_rec {
+    uint8_t buf[OUTPUT_REC_MAX];
+    size_t  len;
+
+    bool overflow;
+};
+
+/*
+ * Single producer, single consumer ring of encoded records. Each thread that
+ * emits records gets its own, so records are queued without any lock.
+ */
+struct output_ring {
+    uint8_t *buf;
+    size_t   size;
+
+    /* written by the producer and the writer thread respectively */
+    uint64_t head;
+    uint64_t tail;
+
+    uint64_t drops;
+
+    struct output_ring *next;
+};
+
+struct output {
+    int fd;
+    enum output_format format;
+
+    struct output_ring *rings;
+
+    uint8_t *buf;
+    size_t   len;
+
+    /* columns of the CSV header, taken from the first record */
+    bool header;
+
+    uint64_t records;
+    uint64_t drops;
+    uint64_t backlog;
+    uint64_t backlog_peak;
+
+    bool stop;
+
+    pthread_t thread;
+};
+
+void output_open(struct output *out, const char *path,
+                 enum output_format format);
+void output_close(struct output *out);
+
+struct output_ring *output_ring_new(struct output *out);
+
+void output_rec_init(struct output_rec *rec);
+void output_rec_int(struct output_rec *rec, const char *key, size_t klen,
+                    int64_t v);
+void output_rec_num(struct output_rec *rec, const char *key, size_t klen,
+                    double v);
+void output_rec_bool(struct output_rec *rec, const char *key, size_t klen,
+                     bool v);
+void output_rec_str(struct output_rec *rec, const char *key, size_t klen,
+                    const char *s, size_t len);
+
+bool output_push(struct output_ring *ring, const struct output_rec *rec);
+
+uint64_t output_drops(struct output *out);
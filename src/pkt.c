@@ -34,6 +34,8 @@
 
 #include <arpa/inet.h>
 
+#include <urcu/uatomic.h>
+
 #include "ut/utlist.h"
 
 #include "queue.h"
@@ -41,9 +43,104 @@
 #include "printf.h"
 #include "util.h"
 
+#define PKT_SLAB_SIZE 256
+
+struct pkt_slab {
+    struct pkt_slab *next;
+
+    struct pkt pkts[PKT_SLAB_SIZE];
+};
+
+static __thread struct pkt_pool *pool_cur;
+
+void pkt_pool_init(struct pkt_pool *pool) {
+    memset(pool, 0, sizeof(*pool));
+}
+
+/*
+ * Make the calling thread allocate its pkt layers from pool, or from the heap
+ * if pool is NULL. The pool must outlive all the layers allocated from it.
+ */
+void pkt_pool_attach(struct pkt_pool *pool) {
+    pool_cur = pool;
+}
+
+void pkt_pool_destroy(struct pkt_pool *pool) {
+    struct pkt_slab *slab, *tmp;
+
+    LL_FOREACH_SAFE(pool->slabs, slab, tmp) {
+        free(slab);
+    }
+
+    pkt_pool_init(pool);
+}
+
+static void pool_grow(struct pkt_pool *pool) {
+    struct pkt_slab *slab = malloc(sizeof(*slab));
+    if (slab == NULL)
+        fail_printf("OOM");
+
+    for (size_t i = 0; i < PKT_SLAB_SIZE; i++) {
+        slab->pkts[i].next = pool->free;
+        pool->free = &slab->pkts[i];
+    }
+
+    LL_PREPEND(pool->slabs, slab);
+
+    pool->size += PKT_SLAB_SIZE;
+}
+
+static struct pkt *pool_get(struct pkt_pool *pool) {
+    struct pkt *p;
+
+    if (caa_unlikely(pool->free == NULL)) {
+        /* the remote list is only ever taken as a whole, so no ABA issues */
+        pool->free = uatomic_xchg(&pool->remote, NULL);
+
+        LL_FOREACH(pool->free, p) {
+            pool->used--;
+        }
+
+        if (pool->free == NULL)
+            pool_grow(pool);
+    }
+
+    p = pool->free;
+    pool->free = p->next;
+
+    if (++pool->used > pool->peak)
+        pool->peak = pool->used;
+
+    return p;
+}
+
+static void pool_put(struct pkt_pool *pool, struct pkt *p) {
+    struct pkt *old;
+
+    if (caa_likely(pool == pool_cur)) {
+        p->next = pool->free;
+        pool->free = p;
+        pool->used--;
+        return;
+    }
+
+    do {
+        old = CMM_LOAD_SHARED(pool->remote);
+        p->next = old;
+    } while (uatomic_cmpxchg(&pool->remote, old, p) != old);
+}
+
 struct pkt *pkt_new(enum pkt_type type) {
-    struct pkt *p = calloc(1, sizeof(*p));
+    struct pkt *p;
+
+    if (pool_cur)
+        p = pool_get(pool_cur);
+    else if ((p = malloc(sizeof(*p))) == NULL)
+        fail_printf("OOM");
 
+    memset(p, 0, sizeof(*p));
+
+    p->pool   = pool_cur;
     p->type   = type;
     p->refcnt = 1;
 
@@ -251,9 +348,8 @@ int pkt_unpack(uint8_t *buf, size_t len, struct pkt **p) {
 }
 
 void pkt_free(struct pkt *pkt) {
-    pkt->refcnt--;
-
-    if (pkt->refcnt > 0)
+    /* layers can be shared by the Lua state and the reply queue */
+    if (uatomic_sub_return(&pkt->refcnt, 1) > 0)
         return;
 
     switch (pkt->type) {
@@ -265,11 +361,15 @@ void pkt_free(struct pkt *pkt) {
         break;
 
     case TYPE_RAW:
-        freep(&pkt->p.raw.payload);
+        if (!pkt->p.raw.view)
+            freep(&pkt->p.raw.payload);
         break;
     }
 
-    free(pkt);
+    if (pkt->pool)
+        pool_put(pkt->pool, pkt);
+    else
+        free(pkt);
 }
 
 void pkt_free_all(struct pkt *pkt) {
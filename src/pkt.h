@@ -175,6 +175,26 @@ struct tcp_hdr {
 struct raw_hdr {
     uint8_t *payload;
     size_t  len;
+
+    /* payload points into a received frame, and is not owned */
+    bool    view;
+};
+
+struct pkt_pool;
+
+#define PKT_FRAME_LAYERS 16
+
+/* layer offsets of a received frame, see pkt_frame_parse() */
+struct pkt_frame {
+    uint8_t *buf;
+    size_t   len;
+
+    unsigned count;
+
+    struct {
+        uint16_t type;
+        uint16_t off;
+    } layers[PKT_FRAME_LAYERS];
 };
 
 struct pkt {
@@ -182,6 +202,9 @@ struct pkt {
     uint16_t type;
     uint16_t refcnt;
 
+    /* pool the layer was allocated from, or NULL */
+    struct pkt_pool *pool;
+
     union {
         struct eth_hdr  eth;
         struct arp_hdr  arp;
@@ -197,13 +220,99 @@ struct pkt {
     struct queue_node queue;
 };
 
+struct pkt_slab;
+
+/*
+ * Per-thread cache of pkt layers. Layers are allocated from the pool of the
+ * calling thread (see pkt_pool_attach()) and always go back to the pool they
+ * came from: layers freed by a thread other than the owner (e.g. replies sent
+ * by a receive thread) are pushed on the remote list, which the owner reclaims
+ * once its own free list is empty.
+ */
+struct pkt_pool {
+    struct pkt *free;
+    struct pkt *remote;
+
+    struct pkt_slab *slabs;
+
+    /* layers currently in use, and their high-water mark */
+    size_t used;
+    size_t peak;
+
+    /* layers allocated from the system */
+    size_t size;
+};
+
+enum pkt_validate_type {
+    VALIDATE_NONE,
+    VALIDATE_TCP,
+    VALIDATE_ICMP,
+};
+
+struct pkt_validator {
+    enum pkt_validate_type type;
+
+    /* local port used for the ICMP cookies */
+    uint16_t port;
+
+    uint64_t seed;
+};
+
+enum pkt_template_flags {
+    TEMPLATE_DST   = 1 << 0,
+    TEMPLATE_DPORT = 1 << 1,
+};
+
+enum pkt_template_cookie {
+    COOKIE_NONE,
+    COOKIE_IP_ID,
+    COOKIE_ICMP_ID,
+    COOKIE_ICMP_SEQ,
+    COOKIE_TCP_SEQ,
+    COOKIE_SPORT,
+};
+
+struct pkt_template {
+    uint8_t *buf;
+    size_t   len;
+
+    size_t  ip4_off;
+    size_t  l4_off;
+    uint8_t l4_type;
+
+    int flags;
+
+    enum pkt_template_cookie cookie;
+
+    /* source port used to compute the cookies */
+    uint16_t cookie_port;
+
+    uint64_t seed;
+};
+
 struct pkt *pkt_new(enum pkt_type type);
 
+void pkt_pool_init(struct pkt_pool *pool);
+void pkt_pool_attach(struct pkt_pool *pool);
+void pkt_pool_destroy(struct pkt_pool *pool);
+
 uint16_t pkt_chksum(uint8_t *buf, size_t len, uint32_t csum);
+void pkt_chksum_batch(uint8_t **bufs, size_t count, size_t len,
+                      const uint32_t *csums, uint16_t *out);
+int pkt_chksum_select(const char *name);
+const char *pkt_chksum_impl(void);
 uint32_t pkt_pseudo_chksum(struct ip4_hdr *h);
+uint16_t pkt_chksum_update16(uint16_t csum, uint16_t old, uint16_t new);
+uint16_t pkt_chksum_update32(uint16_t csum, uint32_t old, uint32_t new);
 uint64_t pkt_cookie(uint32_t saddr, uint32_t daddr,
                     uint16_t sport, uint16_t dport,
                     uint64_t seed);
+void pkt_cookie_batch(const uint32_t *saddrs, const uint32_t *daddrs,
+                      const uint16_t *sports, const uint16_t *dports,
+                      size_t n, uint64_t seed, uint64_t *out);
+void pkt_cookie_legacy(bool legacy);
+bool pkt_validate(const struct pkt_validator *v, const uint8_t *buf,
+                  size_t len);
 
 void pkt_build_eth(struct pkt *p, uint8_t *src, uint8_t *dst, uint16_t type);
 void pkt_build_arp(struct pkt *p, uint16_t hwtype, uint16_t ptype, uint16_t op,
@@ -216,6 +325,8 @@ void pkt_pack_icmp(struct pkt *p, uint8_t *buf, size_t len);
 void pkt_pack_udp(struct pkt *p, uint8_t *buf, size_t len);
 void pkt_pack_tcp(struct pkt *p, uint8_t *buf, size_t len);
 void pkt_pack_raw(struct pkt *p, uint8_t *buf, size_t len);
+void pkt_raw_own(struct pkt *p);
+void pkt_raw_expire(struct pkt *p);
 
 int pkt_unpack_arp(struct pkt *p, uint8_t *buf, size_t len);
 int pkt_unpack_eth(struct pkt *p, uint8_t *buf, size_t len);
@@ -225,7 +336,17 @@ int pkt_unpack_udp(struct pkt *p, uint8_t *buf, size_t len);
 int pkt_unpack_tcp(struct pkt *p, uint8_t *buf, size_t len);
 int pkt_unpack_raw(struct pkt *p, uint8_t *buf, size_t len);
 
+struct pkt_template *pkt_template_new(struct pkt *pkt, int flags,
+                                      enum pkt_template_cookie cookie,
+                                      uint16_t port, uint64_t seed);
+int pkt_template_stamp(const struct pkt_template *t, uint8_t *buf, size_t len,
+                       uint32_t daddr, uint16_t dport);
+void pkt_template_free(struct pkt_template *t);
+
 int pkt_pack(uint8_t *buf, size_t len, struct pkt *p);
 int pkt_unpack(uint8_t *buf, size_t len, struct pkt **p);
+
+int pkt_frame_parse(struct pkt_frame *f, uint8_t *buf, size_t len);
+int pkt_frame_layer(const struct pkt_frame *f, unsigned i, struct pkt *p);
 void pkt_free(struct pkt *pkt);
 void pkt_free_all(struct pkt *pkt);
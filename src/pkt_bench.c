@@ -0,0 +1,201 @@
+/*
+ * Scriptable, asynchronous network packet generator/analyzer.
+ *
+ * Copyright (c) 2015, Alessandro Ghedini
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Micro-benchmarks of the hot paths that don't involve any I/O. Build with
+ * "./waf build_bench" and run as "./build/pkt_bench [iterations]".
+ */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "hash.h"
+#include "fastdiv.h"
+#include "shuffle.h"
+#include "printf.h"
+#include "queue.h"
+#include "pkt.h"
+#include "util.h"
+
+#define BENCH_BATCH 64
+
+/* keep the compiler from optimizing the benchmarked code away */
+static volatile uint64_t sink;
+
+static uint32_t saddrs[BENCH_BATCH];
+static uint32_t daddrs[BENCH_BATCH];
+static uint16_t sports[BENCH_BATCH];
+static uint16_t dports[BENCH_BATCH];
+
+static void report(const char *name, uint64_t start, uint64_t count) {
+    uint64_t elapsed = time_now() - start;
+
+    printf("%-24s %8.2f ns/op %10.2f Mops/s\n", name,
+           (double) elapsed * 1000.0 / count,
+           (double) count / (elapsed ? elapsed : 1));
+}
+
+static void bench_hash(uint64_t count) {
+    uint64_t start, acc = 0;
+
+    uint64_t key[2] = { 42, 42 };
+    uint64_t buf[2];
+
+    start = time_now();
+
+    for (uint64_t i = 0; i < count; i++) {
+        buf[0] = i;
+        buf[1] = acc;
+
+        acc += pyrhash((const uint8_t *) key, (const uint8_t *) buf,
+                       sizeof(buf));
+    }
+
+    report("pyrhash", start, count);
+
+    start = time_now();
+
+    for (uint64_t i = 0; i < count; i++) {
+        buf[0] = i;
+        buf[1] = acc;
+
+        acc += wyhash16(key[0], buf[0], buf[1]);
+    }
+
+    report("wyhash16", start, count);
+
+    sink = acc;
+}
+
+static void bench_cookie(const char *name, bool legacy, uint64_t count) {
+    uint64_t start, acc = 0;
+
+    pkt_cookie_legacy(legacy);
+
+    start = time_now();
+
+    for (uint64_t i = 0; i < count; i++) {
+        size_t j = i % BENCH_BATCH;
+
+        acc += pkt_cookie(saddrs[j], daddrs[j] + i, sports[j], dports[j], 42);
+    }
+
+    report(name, start, count);
+
+    sink = acc;
+}
+
+static void bench_cookie_batch(const char *name, bool legacy, uint64_t count) {
+    uint64_t start, acc = 0;
+
+    uint64_t out[BENCH_BATCH];
+
+    pkt_cookie_legacy(legacy);
+
+    start = time_now();
+
+    for (uint64_t i = 0; i < count; i += BENCH_BATCH) {
+        daddrs[0] = i;
+
+        pkt_cookie_batch(saddrs, daddrs, sports, dports, BENCH_BATCH, 42, out);
+
+        acc += out[BENCH_BATCH - 1];
+    }
+
+    report(name, start, count);
+
+    sink = acc;
+}
+
+static void bench_shuffle(const char *name, enum shuffle_type type,
+                          uint64_t count) {
+    uint64_t start, acc = 0;
+
+    uint64_t out[BENCH_BATCH];
+
+    char batch_name[32];
+
+    struct shuffle r;
+    shuffle_init(&r, UINT32_MAX * 16ULL, 42, type);
+
+    start = time_now();
+
+    for (uint64_t i = 0; i < count; i++)
+        acc += shuffle(&r, i);
+
+    report(name, start, count);
+
+    start = time_now();
+
+    for (uint64_t i = 0; i < count; i += BENCH_BATCH) {
+        shuffle_batch(&r, i, BENCH_BATCH, out);
+
+        acc += out[BENCH_BATCH - 1];
+    }
+
+    snprintf(batch_name, sizeof(batch_name), "%s (batch)", name);
+    report(batch_name, start, count);
+
+    sink = acc;
+}
+
+int main(int argc, char *argv[]) {
+    uint64_t count = 10000000;
+
+    if (argc > 1)
+        count = strtoull(argv[1], NULL, 10);
+
+    if (count == 0)
+        fail_printf("Invalid iteration count");
+
+    srand(42);
+
+    for (size_t i = 0; i < BENCH_BATCH; i++) {
+        saddrs[i] = rand();
+        daddrs[i] = rand();
+        sports[i] = rand();
+        dports[i] = rand();
+    }
+
+    bench_hash(count);
+
+    bench_cookie("pkt_cookie (legacy)", true, count);
+    bench_cookie("pkt_cookie", false, count);
+
+    bench_cookie_batch("pkt_cookie_batch (legacy)", true, count);
+    bench_cookie_batch("pkt_cookie_batch", false, count);
+
+    bench_shuffle("shuffle feistel", SHUFFLE_FEISTEL, count);
+    bench_shuffle("shuffle cyclic", SHUFFLE_CYCLIC, count);
+
+    return EXIT_SUCCESS;
+}
@@ -34,28 +34,245 @@
 
 #include <arpa/inet.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
 #include "queue.h"
 #include "pkt.h"
 
-static uint32_t sum(uint8_t *buf, size_t len) {
-    uint32_t csum = 0;
+/*
+ * The checksum kernels below return the ones' complement sum of buf, seen as
+ * a sequence of 16 bit words in host byte order, accumulated in 64 bits. Wider
+ * words can be summed directly since 2^16 = 1 (mod 2^16 - 1), as long as the
+ * carries are added back in (RFC 1071).
+ */
+struct chksum_impl {
+    const char *name;
+    uint64_t  (*sum)(const uint8_t *buf, size_t len);
+    bool      (*supported)(void);
+};
+
+static inline uint64_t add64(uint64_t a, uint64_t b) {
+    a += b;
+    return a + (a < b);
+}
+
+static inline uint32_t fold64(uint64_t sum) {
+    sum = (sum >> 32) + (sum & 0xFFFFFFFF);
+    sum = (sum >> 32) + (sum & 0xFFFFFFFF);
+
+    return sum;
+}
+
+static inline uint16_t fold32(uint64_t sum) {
+    sum = fold64(sum);
+
+    while (sum >> 16)
+        sum = (sum >> 16) + (sum & 0xFFFF);
+
+    return sum;
+}
+
+static uint64_t sum_scalar(const uint8_t *buf, size_t len) {
+    uint64_t acc = 0;
+    uint64_t w64[4];
+    uint32_t w32;
+    uint16_t w16;
+
+    while (len >= sizeof(w64)) {
+        memcpy(w64, buf, sizeof(w64));
+
+        acc = add64(acc, w64[0]);
+        acc = add64(acc, w64[1]);
+        acc = add64(acc, w64[2]);
+        acc = add64(acc, w64[3]);
+
+        buf += sizeof(w64);
+        len -= sizeof(w64);
+    }
+
+    while (len >= sizeof(w64[0])) {
+        memcpy(w64, buf, sizeof(w64[0]));
+        acc = add64(acc, w64[0]);
+
+        buf += sizeof(w64[0]);
+        len -= sizeof(w64[0]);
+    }
+
+    if (len >= sizeof(w32)) {
+        memcpy(&w32, buf, sizeof(w32));
+        acc = add64(acc, w32);
+
+        buf += sizeof(w32);
+        len -= sizeof(w32);
+    }
+
+    if (len >= sizeof(w16)) {
+        memcpy(&w16, buf, sizeof(w16));
+        acc = add64(acc, w16);
 
-    for (size_t i = 0; i < len - 1; i += 2)
-        csum += *(uint16_t *) &buf[i];
+        buf += sizeof(w16);
+        len -= sizeof(w16);
+    }
 
-    if (len & 1)
-        csum += (uint16_t) buf[len - 1];
+    /* odd trailing byte, padded with a zero byte */
+    if (len) {
+        w16 = 0;
+        memcpy(&w16, buf, 1);
+        acc = add64(acc, w16);
+    }
 
-    return csum;
+    return acc;
+}
+
+#ifdef HAVE_X86_SIMD
+/*
+ * The SIMD kernels zero-extend each 32 bit word to a 64 bit lane, so that the
+ * lanes can't overflow for buffers smaller than 64 GB and no carry needs to
+ * be tracked in the main loop.
+ */
+__attribute__((target("sse2")))
+static uint64_t sum_sse2(const uint8_t *buf, size_t len) {
+    const __m128i zero = _mm_setzero_si128();
+
+    __m128i acc0 = zero;
+    __m128i acc1 = zero;
+
+    uint64_t lanes[2];
+
+    while (len >= 32) {
+        __m128i a = _mm_loadu_si128((const __m128i *) buf);
+        __m128i b = _mm_loadu_si128((const __m128i *) (buf + 16));
+
+        acc0 = _mm_add_epi64(acc0, _mm_unpacklo_epi32(a, zero));
+        acc1 = _mm_add_epi64(acc1, _mm_unpackhi_epi32(a, zero));
+        acc0 = _mm_add_epi64(acc0, _mm_unpacklo_epi32(b, zero));
+        acc1 = _mm_add_epi64(acc1, _mm_unpackhi_epi32(b, zero));
+
+        buf += 32;
+        len -= 32;
+    }
+
+    acc0 = _mm_add_epi64(acc0, acc1);
+
+    _mm_storeu_si128((__m128i *) lanes, acc0);
+
+    return add64(add64(lanes[0], lanes[1]), sum_scalar(buf, len));
+}
+
+__attribute__((target("avx2")))
+static uint64_t sum_avx2(const uint8_t *buf, size_t len) {
+    const __m256i zero = _mm256_setzero_si256();
+
+    __m256i acc0 = zero;
+    __m256i acc1 = zero;
+
+    uint64_t lanes[4];
+
+    while (len >= 64) {
+        __m256i a = _mm256_loadu_si256((const __m256i *) buf);
+        __m256i b = _mm256_loadu_si256((const __m256i *) (buf + 32));
+
+        acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(a, zero));
+        acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(a, zero));
+        acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(b, zero));
+        acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(b, zero));
+
+        buf += 64;
+        len -= 64;
+    }
+
+    acc0 = _mm256_add_epi64(acc0, acc1);
+
+    _mm256_storeu_si256((__m256i *) lanes, acc0);
+
+    return add64(add64(lanes[0], lanes[1]),
+                 add64(add64(lanes[2], lanes[3]), sum_sse2(buf, len)));
+}
+
+static bool has_sse2(void) {
+    return __builtin_cpu_supports("sse2");
+}
+
+static bool has_avx2(void) {
+    return __builtin_cpu_supports("avx2");
+}
+#endif
+
+/* ordered by preference, the last one must always be supported */
+static const struct chksum_impl chksum_impls[] = {
+#ifdef HAVE_X86_SIMD
+    { "avx2",   sum_avx2,   has_avx2 },
+    { "sse2",   sum_sse2,   has_sse2 },
+#endif
+    { "scalar", sum_scalar, NULL     },
+};
+
+static const struct chksum_impl *chksum_impl =
+    &chksum_impls[sizeof(chksum_impls) / sizeof(*chksum_impls) - 1];
+
+/*
+ * Select the checksum kernel called name, or the fastest one supported by the
+ * CPU if name is NULL. Returns -1 if the kernel is unknown or unsupported.
+ */
+int pkt_chksum_select(const char *name) {
+    size_t n = sizeof(chksum_impls) / sizeof(*chksum_impls);
+
+    for (size_t i = 0; i < n; i++) {
+        const struct chksum_impl *c = &chksum_impls[i];
+
+        if (name && strcmp(name, c->name))
+            continue;
+
+        if (c->supported && !c->supported())
+            continue;
+
+        chksum_impl = c;
+        return 0;
+    }
+
+    return -1;
+}
+
+const char *pkt_chksum_impl(void) {
+    return chksum_impl->name;
+}
+
+__attribute__((constructor))
+static void pkt_chksum_init(void) {
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+#endif
+
+    pkt_chksum_select(NULL);
+}
+
+static uint32_t sum(uint8_t *buf, size_t len) {
+    return fold64(chksum_impl->sum(buf, len));
 }
 
 uint16_t pkt_chksum(uint8_t *buf, size_t len, uint32_t csum) {
-    csum += sum(buf, len);
+    return ~fold32((uint64_t) csum + sum(buf, len));
+}
 
-    while (csum >> 16)
-        csum = (csum >> 16) + (csum & 0xFFFF);
+/*
+ * Compute the checksums of count buffers of len bytes each. If csums is not
+ * NULL, csums[i] is the initial (e.g. pseudo-header) sum of bufs[i].
+ */
+void pkt_chksum_batch(uint8_t **bufs, size_t count, size_t len,
+                      const uint32_t *csums, uint16_t *out) {
+    uint64_t (*sum_fn)(const uint8_t *, size_t) = chksum_impl->sum;
 
-    return ~csum;
+    for (size_t i = 0; i < count; i++) {
+        uint64_t csum = sum_fn(bufs[i], len);
+
+        if (csums)
+            csum = add64(csum, csums[i]);
+
+        out[i] = ~fold32(csum);
+    }
 }
 
 uint32_t pkt_pseudo_chksum(struct ip4_hdr *h) {
@@ -77,3 +294,32 @@ uint32_t pkt_pseudo_chksum(struct ip4_hdr *h) {
 
     return sum((uint8_t *) &hdr, sizeof(hdr));
 }
+
+/*
+ * Update the checksum csum of some data after one of its 16 bit words changed
+ * from old to new, as described in RFC 1624 (eqn. 3). All the values must be
+ * in the same byte order, usually the network byte order they are stored in.
+ */
+uint16_t pkt_chksum_update16(uint16_t csum, uint16_t old, uint16_t new) {
+    uint32_t sum = (uint16_t) ~csum + (uint16_t) ~old + new;
+
+    while (sum >> 16)
+        sum = (sum >> 16) + (sum & 0xFFFF);
+
+    return ~sum;
+}
+
+/*
+ * Same as pkt_chksum_update16(), for a 32 bit word (e.g. an IP address).
+ */
+uint16_t pkt_chksum_update32(uint16_t csum, uint32_t old, uint32_t new) {
+    uint32_t sum = (uint16_t) ~csum;
+
+    sum += (uint16_t) ~(old >> 16) + (uint16_t) ~(old & 0xFFFF);
+    sum += (new >> 16) + (new & 0xFFFF);
+
+    while (sum >> 16)
+        sum = (sum >> 16) + (sum & 0xFFFF);
+
+    return ~sum;
+}
@@ -29,12 +29,23 @@
  */
 
 #include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include <arpa/inet.h>
+
+#include <urcu/compiler.h>
 
 #include "hash.h"
+#include "queue.h"
+#include "pkt.h"
 
-uint64_t pkt_cookie(uint32_t saddr, uint32_t daddr,
-                    uint16_t sport, uint16_t dport,
-                    uint64_t seed) {
+/* whether to compute the cookies like older versions, see pkt_cookie_legacy() */
+static bool cookie_legacy = false;
+
+static inline uint64_t cookie_pyrhash(uint32_t saddr, uint32_t daddr,
+                                      uint16_t sport, uint16_t dport,
+                                      uint64_t seed) {
     uint32_t buf[4];
     uint64_t key[2];
 
@@ -48,3 +59,112 @@ uint64_t pkt_cookie(uint32_t saddr, uint32_t daddr,
 
     return pyrhash((const uint8_t *)key, (const uint8_t *)buf, sizeof(buf));
 }
+
+static inline uint64_t cookie_wyhash(uint32_t saddr, uint32_t daddr,
+                                     uint16_t sport, uint16_t dport,
+                                     uint64_t seed) {
+    return wyhash16(seed, ((uint64_t) saddr << 32) | daddr,
+                          ((uint64_t) sport << 16) | dport);
+}
+
+/*
+ * Use the same hash function as older versions to compute the cookies, so that
+ * the replies to the probes they sent with the same seed can be recognized.
+ * This must be called before any cookie is computed.
+ */
+void pkt_cookie_legacy(bool legacy) {
+    cookie_legacy = legacy;
+}
+
+uint64_t pkt_cookie(uint32_t saddr, uint32_t daddr,
+                    uint16_t sport, uint16_t dport,
+                    uint64_t seed) {
+    if (caa_unlikely(cookie_legacy))
+        return cookie_pyrhash(saddr, daddr, sport, dport, seed);
+
+    return cookie_wyhash(saddr, daddr, sport, dport, seed);
+}
+
+/*
+ * Compute the cookies of n address/port tuples at once, same as calling
+ * pkt_cookie() for each of them. The tuples are independent of each other, so
+ * the hash computations can be overlapped by the CPU.
+ */
+void pkt_cookie_batch(const uint32_t *saddrs, const uint32_t *daddrs,
+                      const uint16_t *sports, const uint16_t *dports,
+                      size_t n, uint64_t seed, uint64_t *out) {
+    if (caa_unlikely(cookie_legacy)) {
+        for (size_t i = 0; i < n; i++)
+            out[i] = cookie_pyrhash(saddrs[i], daddrs[i],
+                                    sports[i], dports[i], seed);
+        return;
+    }
+
+    for (size_t i = 0; i < n; i++)
+        out[i] = cookie_wyhash(saddrs[i], daddrs[i],
+                               sports[i], dports[i], seed);
+}
+
+/*
+ * Check that a raw received frame carries the cookie of one of our probes, as
+ * computed by the scripts for the reply's reversed addresses and ports. This
+ * runs before the frame is unpacked, so only the bare minimum is parsed.
+ */
+bool pkt_validate(const struct pkt_validator *v, const uint8_t *buf,
+                  size_t len) {
+    struct eth_hdr  eth;
+    struct ip4_hdr  ip4;
+    struct tcp_hdr  tcp;
+    struct icmp_hdr icmp;
+
+    size_t off;
+
+    uint64_t cookie;
+
+    if (v->type == VALIDATE_NONE)
+        return true;
+
+    if (len < sizeof(eth) + sizeof(ip4))
+        return false;
+
+    memcpy(&eth, buf, sizeof(eth));
+
+    if (ntohs(eth.type) != ETHERTYPE_IP)
+        return false;
+
+    memcpy(&ip4, buf + sizeof(eth), sizeof(ip4));
+
+    if ((ip4.version != 4) || (ip4.ihl < 5))
+        return false;
+
+    off = sizeof(eth) + (ip4.ihl * 4);
+
+    switch (v->type) {
+    case VALIDATE_TCP:
+        if ((ip4.proto != PROTO_TCP) || (len < off + sizeof(tcp)))
+            return false;
+
+        memcpy(&tcp, buf + off, sizeof(tcp));
+
+        cookie = pkt_cookie(ip4.dst, ip4.src,
+                            ntohs(tcp.dport), ntohs(tcp.sport), v->seed);
+
+        return (uint32_t) (ntohl(tcp.ack_seq) - 1) == (uint32_t) cookie;
+
+    case VALIDATE_ICMP:
+        if ((ip4.proto != PROTO_ICMP) || (len < off + sizeof(icmp)))
+            return false;
+
+        memcpy(&icmp, buf + off, sizeof(icmp));
+
+        if (icmp.type != ICMPOP_ECHOREPLY)
+            return false;
+
+        cookie = pkt_cookie(ip4.dst, ip4.src, v->port, 0, v->seed);
+
+        return ntohs(icmp.seq) == (uint16_t) cookie;
+
+    default:
+        return true;
+    }
+}
@@ -0,0 +1,192 @@
+/*
+ * Scriptable, asynchronous network packet generator/analyzer.
+ *
+ * Copyright (c) 2015, Alessandro Ghedini
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include <arpa/inet.h>
+
+#include "queue.h"
+#include "pkt.h"
+
+/*
+ * Find the layers of a received frame in a single pass, without decoding them.
+ * The layers are split exactly like pkt_unpack() does, but only the fields
+ * needed to find the next layer are read. Returns the number of layers, or 0
+ * if the frame is malformed.
+ */
+int pkt_frame_parse(struct pkt_frame *f, uint8_t *buf, size_t len) {
+    size_t i = 0;
+    int next_type = TYPE_ETH;
+
+    f->buf   = buf;
+    f->len   = len;
+    f->count = 0;
+
+    if (len < 14)
+        return 0;
+
+    while ((i < len) && (next_type != TYPE_NONE)) {
+        const uint8_t *p = buf + i;
+        size_t rem = len - i, length;
+
+        int type = next_type;
+
+        switch (type) {
+        case TYPE_ETH:
+            length = 14;
+
+            switch ((p[12] << 8) | p[13]) {
+            case ETHERTYPE_ARP:
+                next_type = TYPE_ARP;
+                break;
+
+            case ETHERTYPE_IP:
+                next_type = TYPE_IP4;
+                break;
+
+            default:
+                next_type = TYPE_NONE;
+            }
+            break;
+
+        case TYPE_ARP:
+            if (rem < 8)
+                return 0;
+
+            length    = 8 + p[4] * 2 + p[5] * 2;
+            next_type = TYPE_NONE;
+            break;
+
+        case TYPE_IP4:
+            if ((rem < 20) || ((p[0] >> 4) != 4))
+                return 0;
+
+            length = (p[0] & 0x0f) * 4;
+
+            switch (p[9]) {
+            case PROTO_ICMP:
+                next_type = TYPE_ICMP;
+                break;
+
+            case PROTO_UDP:
+                next_type = TYPE_UDP;
+                break;
+
+            case PROTO_TCP:
+                next_type = TYPE_TCP;
+                break;
+
+            default:
+                next_type = TYPE_NONE;
+            }
+            break;
+
+        case TYPE_ICMP:
+            if (rem < 8)
+                return 0;
+
+            length = 8;
+
+            if ((p[0] == 3) || (p[0] == 4) || (p[0] == 5) || (p[0] == 11))
+                next_type = TYPE_IP4;
+            else
+                next_type = TYPE_RAW;
+            break;
+
+        case TYPE_UDP:
+            if (rem < 8)
+                return 0;
+
+            length    = 8;
+            next_type = TYPE_RAW;
+            break;
+
+        case TYPE_TCP:
+            if (rem < 20)
+                return 0;
+
+            length    = (p[12] >> 4) * 4;
+            next_type = TYPE_RAW;
+            break;
+
+        default:
+            length    = rem;
+            next_type = TYPE_NONE;
+        }
+
+        if (f->count == PKT_FRAME_LAYERS)
+            return 0;
+
+        f->layers[f->count].type = type;
+        f->layers[f->count].off  = i;
+        f->count++;
+
+        i += length;
+    }
+
+    return f->count;
+}
+
+/*
+ * Decode the i-th layer of a parsed frame into p, which doesn't need to be
+ * allocated with pkt_new(). Raw payloads point into the frame.
+ */
+int pkt_frame_layer(const struct pkt_frame *f, unsigned i, struct pkt *p) {
+    uint8_t *buf = f->buf + f->layers[i].off;
+    size_t   len = f->len - f->layers[i].off;
+
+    memset(p, 0, sizeof(*p));
+
+    switch (f->layers[i].type) {
+    case TYPE_ETH:
+        return pkt_unpack_eth(p, buf, len);
+
+    case TYPE_IP4:
+        return pkt_unpack_ip4(p, buf, len);
+
+    case TYPE_ICMP:
+        return pkt_unpack_icmp(p, buf, len);
+
+    case TYPE_UDP:
+        return pkt_unpack_udp(p, buf, len);
+
+    case TYPE_TCP:
+        return pkt_unpack_tcp(p, buf, len);
+
+    case TYPE_RAW:
+        return pkt_unpack_raw(p, buf, len);
+    }
+
+    /* ARP layers own their addresses, so they are never decoded here */
+    return -1;
+}
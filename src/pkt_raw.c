@@ -37,19 +37,60 @@
 
 #include "queue.h"
 #include "pkt.h"
+#include "printf.h"
 
 void pkt_pack_raw(struct pkt *p, uint8_t *buf, size_t len) {
-    memcpy(buf, p->p.raw.payload, p->p.raw.len);
+    if (p->p.raw.len)
+        memcpy(buf, p->p.raw.payload, p->p.raw.len);
 }
 
+/*
+ * The payload is not copied: it's only valid until the frame is released (see
+ * netdev_release()), unless pkt_raw_own() is called before that.
+ */
 int pkt_unpack_raw(struct pkt *p, uint8_t *buf, size_t len) {
-    p->p.raw.payload = malloc(len);
+    p->p.raw.payload = buf;
     p->p.raw.len     = len;
-
-    memcpy(p->p.raw.payload, buf, len);
+    p->p.raw.view    = true;
 
     p->type   = TYPE_RAW;
     p->length = p->p.raw.len;
 
     return TYPE_NONE;
 }
+
+/*
+ * Replace a payload view with a private copy, so that the packet can outlive
+ * the received frame.
+ */
+void pkt_raw_own(struct pkt *p) {
+    struct raw_hdr *raw = &p->p.raw;
+
+    if (!raw->view || raw->payload == NULL)
+        return;
+
+    uint8_t *payload = malloc(raw->len ? raw->len : 1);
+    if (payload == NULL)
+        fail_printf("OOM");
+
+    memcpy(payload, raw->payload, raw->len);
+
+    raw->payload = payload;
+    raw->view    = false;
+}
+
+/*
+ * Drop a payload view before its frame is released. The packet is then left
+ * with an empty payload, and raw->view still set to tell it apart.
+ */
+void pkt_raw_expire(struct pkt *p) {
+    struct raw_hdr *raw = &p->p.raw;
+
+    if (!raw->view)
+        return;
+
+    raw->payload = NULL;
+    raw->len     = 0;
+
+    p->length = 0;
+}
@@ -0,0 +1,262 @@
+/*
+ * Scriptable, asynchronous network packet generator/analyzer.
+ *
+ * Copyright (c) 2015, Alessandro Ghedini
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <arpa/inet.h>
+
+#include "ut/utlist.h"
+
+#include "queue.h"
+#include "pkt.h"
+#include "printf.h"
+#include "util.h"
+
+/*
+ * Pack the given packet layers once, and record where the per-probe fields are
+ * located in the packed frame, so that probes can be generated by copying the
+ * frame and patching it, without going through the scripting engine.
+ */
+struct pkt_template *pkt_template_new(struct pkt *pkt, int flags,
+                                      enum pkt_template_cookie cookie,
+                                      uint16_t port, uint64_t seed) {
+    struct pkt *cur, *ip4 = NULL, *l4 = NULL;
+    size_t off;
+
+    struct pkt_template *t = calloc(1, sizeof(*t));
+
+    t->len = 0;
+
+    DL_FOREACH(pkt, cur)
+        t->len += cur->length;
+
+    t->buf = malloc(t->len);
+
+    if (pkt_pack(t->buf, t->len, pkt) < 0)
+        goto error;
+
+    /* layers are stored from the innermost to the outermost */
+    off = t->len;
+
+    DL_FOREACH(pkt, cur) {
+        off -= cur->length;
+
+        if ((cur->type == TYPE_IP4) && !ip4) {
+            ip4 = cur;
+            t->ip4_off = off;
+        }
+
+        if ((cur->next && (cur->next->type == TYPE_IP4)) &&
+            ((cur->type == TYPE_ICMP) || (cur->type == TYPE_UDP) ||
+             (cur->type == TYPE_TCP)) && !l4) {
+            l4 = cur;
+            t->l4_off = off;
+        }
+    }
+
+    if (!ip4)
+        goto error;
+
+    t->flags = flags;
+    t->seed  = seed;
+
+    t->cookie      = cookie;
+    t->cookie_port = port;
+
+    t->l4_type = l4 ? l4->type : TYPE_NONE;
+
+    switch (t->l4_type) {
+    case TYPE_UDP:
+        t->cookie_port = l4->p.udp.sport;
+        break;
+
+    case TYPE_TCP:
+        t->cookie_port = l4->p.tcp.sport;
+        break;
+
+    default:
+        if (flags & TEMPLATE_DPORT)
+            goto error;
+        break;
+    }
+
+    /* make sure the cookie has somewhere to go */
+    switch (cookie) {
+    case COOKIE_NONE:
+    case COOKIE_IP_ID:
+        break;
+
+    case COOKIE_ICMP_ID:
+    case COOKIE_ICMP_SEQ:
+        if (t->l4_type != TYPE_ICMP)
+            goto error;
+        break;
+
+    case COOKIE_TCP_SEQ:
+        if (t->l4_type != TYPE_TCP)
+            goto error;
+        break;
+
+    case COOKIE_SPORT:
+        if ((t->l4_type != TYPE_TCP) && (t->l4_type != TYPE_UDP))
+            goto error;
+        break;
+    }
+
+    return t;
+
+error:
+    pkt_template_free(t);
+    return NULL;
+}
+
+static void set16(uint16_t *field, uint16_t val,
+                  uint16_t *csum1, uint16_t *csum2) {
+    if (csum1)
+        *csum1 = pkt_chksum_update16(*csum1, *field, val);
+
+    if (csum2)
+        *csum2 = pkt_chksum_update16(*csum2, *field, val);
+
+    *field = val;
+}
+
+static void set32(uint32_t *field, uint32_t val,
+                  uint16_t *csum1, uint16_t *csum2) {
+    if (csum1)
+        *csum1 = pkt_chksum_update32(*csum1, *field, val);
+
+    if (csum2)
+        *csum2 = pkt_chksum_update32(*csum2, *field, val);
+
+    *field = val;
+}
+
+/*
+ * Copy the template into buf, setting the destination address and port of the
+ * given probe and its cookie, and return the frame length. The checksums of
+ * the template are adjusted incrementally for each patched field.
+ */
+int pkt_template_stamp(const struct pkt_template *t, uint8_t *buf, size_t len,
+                       uint32_t daddr, uint16_t dport) {
+    uint64_t cookie;
+    uint16_t cookie_dport = 0;
+
+    struct ip4_hdr  *ip4  = (struct ip4_hdr *)  (buf + t->ip4_off);
+    struct icmp_hdr *icmp = (struct icmp_hdr *) (buf + t->l4_off);
+    struct udp_hdr  *udp  = (struct udp_hdr *)  (buf + t->l4_off);
+    struct tcp_hdr  *tcp  = (struct tcp_hdr *)  (buf + t->l4_off);
+
+    /* checksums covering the transport header and the IP pseudo header */
+    uint16_t *l4_csum     = NULL;
+    uint16_t *pseudo_csum = NULL;
+
+    uint16_t *sport_ptr = NULL;
+    uint16_t *dport_ptr = NULL;
+
+    if (len < t->len)
+        return -1;
+
+    memcpy(buf, t->buf, t->len);
+
+    switch (t->l4_type) {
+    case TYPE_ICMP:
+        l4_csum     = &icmp->chksum;
+        break;
+
+    case TYPE_UDP:
+        l4_csum     = &udp->chksum;
+        pseudo_csum = &udp->chksum;
+        sport_ptr   = &udp->sport;
+        dport_ptr   = &udp->dport;
+        break;
+
+    case TYPE_TCP:
+        l4_csum     = &tcp->chksum;
+        pseudo_csum = &tcp->chksum;
+        sport_ptr   = &tcp->sport;
+        dport_ptr   = &tcp->dport;
+        break;
+
+    default:
+        break;
+    }
+
+    if (t->flags & TEMPLATE_DST)
+        set32(&ip4->dst, htonl(daddr), &ip4->chksum, pseudo_csum);
+
+    if (t->flags & TEMPLATE_DPORT)
+        set16(dport_ptr, htons(dport), l4_csum, NULL);
+
+    if (dport_ptr)
+        cookie_dport = ntohs(*dport_ptr);
+
+    if (t->cookie != COOKIE_NONE)
+        cookie = pkt_cookie(ip4->src, ip4->dst, t->cookie_port, cookie_dport,
+                            t->seed);
+
+    switch (t->cookie) {
+    case COOKIE_NONE:
+        break;
+
+    case COOKIE_IP_ID:
+        set16(&ip4->id, htons((uint16_t) cookie), &ip4->chksum, NULL);
+        break;
+
+    case COOKIE_ICMP_ID:
+        set16(&icmp->id, htons((uint16_t) cookie), l4_csum, NULL);
+        break;
+
+    case COOKIE_ICMP_SEQ:
+        set16(&icmp->seq, htons((uint16_t) cookie), l4_csum, NULL);
+        break;
+
+    case COOKIE_TCP_SEQ:
+        set32(&tcp->seq, htonl((uint32_t) cookie), l4_csum, NULL);
+        break;
+
+    case COOKIE_SPORT:
+        set16(sport_ptr, htons((uint16_t) cookie), l4_csum, NULL);
+        break;
+    }
+
+    return t->len;
+}
+
+void pkt_template_free(struct pkt_template *t) {
+    if (t == NULL)
+        return;
+
+    freep(&t->buf);
+    free(t);
+}
@@ -41,39 +41,61 @@
 #include <arpa/inet.h>
 #include <net/if.h>
 
+#include <urcu/arch.h>
 #include <urcu/uatomic.h>
 
 #include "bucket.h"
 #include "netdev.h"
+#include "fastdiv.h"
 #include "shuffle.h"
+#include "checkpoint.h"
 #include "ranges.h"
 #include "resolv.h"
 #include "routes.h"
 #include "queue.h"
+#include "output.h"
 #include "pkt.h"
 #include "printf.h"
 #include "util.h"
 #include "pktizr.h"
 #include "script.h"
 
-static const char *short_opts = "S:p:r:s:w:c:l:g:n:Roqh?";
+static const char *short_opts = "S:p:i:x:X:r:s:w:c:H:k:E:O:F:l:g:n:T:C:b:t:R::Koqh?";
 
 static bool stop = false;
 
 static struct option long_opts[] = {
     { "script",      required_argument, NULL, 'S' },
     { "ports",       required_argument, NULL, 'p' },
+    { "input-list",  required_argument, NULL, 'i' },
+    { "exclude",     required_argument, NULL, 'x' },
+    { "exclude-file",required_argument, NULL, 'X' },
     { "rate",        required_argument, NULL, 'r' },
     { "seed",        required_argument, NULL, 's' },
     { "wait",        required_argument, NULL, 'w' },
     { "count",       required_argument, NULL, 'c' },
 
+    { "shard",       required_argument, NULL, 'H' },
+
+    { "checkpoint",  required_argument, NULL, 'k' },
+    { "resume",      required_argument, NULL, 'E' },
+
+    { "output",      required_argument, NULL, 'O' },
+    { "output-format", required_argument, NULL, 'F' },
+
     { "local-addr",  required_argument, NULL, 'l' },
     { "gateway-addr",required_argument, NULL, 'g' },
 
     { "netdev",      required_argument, NULL, 'n' },
 
-    { "shuffle",     no_argument,       NULL, 'R' },
+    { "tx-threads",  required_argument, NULL, 'T' },
+    { "rx-threads",  required_argument, NULL, 'C' },
+
+    { "rx-block-size", required_argument, NULL, 'b' },
+    { "rx-timeout",  required_argument, NULL, 't' },
+
+    { "shuffle",     optional_argument, NULL, 'R' },
+    { "legacy-cookies", no_argument,    NULL, 'K' },
     { "offline",     no_argument,       NULL, 'o' },
 
     { "quiet",       no_argument,       NULL, 'q' },
@@ -85,13 +107,26 @@ static struct option long_opts[] = {
 static void *recv_cb(void *p);
 static void *loop_cb(void *p);
 
+static void loop_init(struct pktizr_args *args, uint64_t tot_cnt);
+static void recv_init(struct pktizr_args *args);
+
+static void loop_checkpoint(struct pktizr_args *args);
+static void loop_resume(struct pktizr_args *args, struct checkpoint *ck);
+
 static void status_line(struct pktizr_args *args);
+static void print_stats(struct pktizr_args *args);
 static void setup_signals(void);
 
 static uint64_t get_entropy(void);
 
 static inline void help(void);
 
+/* number of indexes claimed at once by a loop thread */
+#define LOOP_CHUNK 1024
+
+/* microseconds between checkpoints */
+#define CHECKPOINT_INTERVAL 10000000
+
 #define START_THREAD(MUTEX, COND, THREAD, FUNC, ARGS)   \
     pthread_mutex_init(&ARGS->MUTEX, NULL);     \
     pthread_cond_init(&ARGS->COND, NULL);       \
@@ -103,6 +138,10 @@ static inline void help(void);
 int main(int argc, char *argv[]) {
     int rc, i;
 
+    size_t tgt_cnt, prt_cnt, tot_cnt;
+
+    struct range_list targets = { 0 }, ports = { 0 }, exclude = { 0 };
+
     _free_ struct pktizr_args *args = NULL;
 
     _free_ char *local_addr = NULL;
@@ -110,26 +149,55 @@ int main(int argc, char *argv[]) {
 
     _free_ char *netdev = NULL;
 
+    _free_ char *resume = NULL;
+
+    _free_ char *output = NULL;
+    enum output_format output_format = OUTPUT_JSON;
+
+    struct checkpoint ck = { 0 };
+
+    struct netdev_opts netdev_opts = {
+        .flags      = NETDEV_RX | NETDEV_TX,
+        .block_size = 1 << 18,
+        .block_tmo  = 1,
+    };
+
     if (argc < 4) {
         help();
         return 0;
     }
 
-    args = malloc(sizeof(*args));
+    args = calloc(1, sizeof(*args));
+
+    /* targets may also be given with --input-list only */
+    if (argv[1][0] != '-')
+        range_parse_targets(&targets, argv[1]);
 
-    /* TODO: add --exclude option */
+    range_parse_ports(&ports, "1");
 
-    args->targets = range_parse_targets(args, argv[1]);
-    args->ports   = range_parse_ports(args, "1");
     args->rate    = 100;
     args->seed    = get_entropy();
     args->wait    = 5;
     args->count   = 1;
     args->script  = NULL;
+    args->tx_threads = 1;
+    args->rx_threads = 1;
     args->quiet   = !isatty(STDERR_FILENO);
     args->done    = false;
     args->stop    = false;
 
+    args->shuffle        = false;
+    args->shuffle_cyclic = false;
+    args->offline        = false;
+
+    args->shard   = 0;
+    args->shards  = 1;
+
+    args->checkpoint = NULL;
+    args->ckpt_sent  = 0;
+    args->ckpt_probe = 0;
+    args->ckpt_recv  = 0;
+
     while ((rc = getopt_long(argc, argv, short_opts, long_opts, &i)) !=-1) {
         char *end;
 
@@ -140,9 +208,23 @@ int main(int argc, char *argv[]) {
 
         case 'p':
             validate_optlist("--ports", optarg);
-            free(args->ports);
+            range_list_free(&ports);
+
+            range_parse_ports(&ports, optarg);
+            break;
 
-            args->ports = range_parse_ports(args, optarg);
+        case 'i':
+            range_parse_file(&targets, optarg);
+            break;
+
+        case 'x':
+            validate_optlist("--exclude", optarg);
+
+            range_parse_targets(&exclude, optarg);
+            break;
+
+        case 'X':
+            range_parse_file(&exclude, optarg);
             break;
 
         case 'r':
@@ -169,8 +251,59 @@ int main(int argc, char *argv[]) {
                 fail_printf("Invalid wait value");
             break;
 
+        case 'H':
+            args->shard = strtoul(optarg, &end, 10);
+            if ((end == optarg) || (*end != '/'))
+                fail_printf("Invalid shard value");
+
+            args->shards = strtoul(end + 1, &end, 10);
+            if ((*end != '\0') || (args->shard < 1) ||
+                (args->shard > args->shards))
+                fail_printf("Invalid shard value");
+
+            /* 1-based on the command line */
+            args->shard--;
+            break;
+
+        case 'k':
+            freep(&args->checkpoint);
+            args->checkpoint = strdup(optarg);
+            break;
+
+        case 'E':
+            freep(&resume);
+            resume = strdup(optarg);
+            break;
+
+        case 'O':
+            freep(&output);
+            output = strdup(optarg);
+            break;
+
+        case 'F':
+            if (!strcmp(optarg, "json"))
+                output_format = OUTPUT_JSON;
+            else if (!strcmp(optarg, "csv"))
+                output_format = OUTPUT_CSV;
+            else if (!strcmp(optarg, "binary"))
+                output_format = OUTPUT_BINARY;
+            else
+                fail_printf("Invalid output format '%s'", optarg);
+            break;
+
         case 'R':
             args->shuffle = true;
+
+            if (!optarg || !strcmp(optarg, "feistel"))
+                args->shuffle_cyclic = false;
+            else if (!strcmp(optarg, "cyclic"))
+                args->shuffle_cyclic = true;
+            else
+                fail_printf("Invalid shuffle engine '%s'", optarg);
+            break;
+
+        case 'K':
+            pkt_cookie_legacy(true);
             break;
 
         case 'o':
@@ -192,6 +325,30 @@ int main(int argc, char *argv[]) {
             netdev = strdup(optarg);
             break;
 
+        case 'T':
+            args->tx_threads = strtoul(optarg, &end, 10);
+            if ((*end != '\0') || (args->tx_threads == 0))
+                fail_printf("Invalid tx-threads value");
+            break;
+
+        case 'C':
+            args->rx_threads = strtoul(optarg, &end, 10);
+            if ((*end != '\0') || (args->rx_threads == 0))
+                fail_printf("Invalid rx-threads value");
+            break;
+
+        case 'b':
+            netdev_opts.block_size = strtoull(optarg, &end, 10);
+            if (*end != '\0')
+                fail_printf("Invalid rx-block-size value");
+            break;
+
+        case 't':
+            netdev_opts.block_tmo = strtoul(optarg, &end, 10);
+            if (*end != '\0')
+                fail_printf("Invalid rx-timeout value");
+            break;
+
         case 'q':
             args->quiet = true;
             break;
@@ -206,6 +363,25 @@ int main(int argc, char *argv[]) {
     if (!args->script)
         fail_printf("No script provided");
 
+    if (targets.cnt == 0)
+        fail_printf("No targets provided");
+
+    /* the order of the probes must be the same as in the resumed scan */
+    if (resume) {
+        checkpoint_load(resume, &ck);
+
+        args->seed           = ck.seed;
+        args->count          = ck.count;
+        args->shuffle        = ck.shuffle;
+        args->shuffle_cyclic = ck.shuffle_cyclic;
+        args->shard          = ck.shard;
+        args->shards         = ck.shards;
+        args->tx_threads     = ck.slice_cnt;
+
+        if (!args->checkpoint)
+            args->checkpoint = strdup(resume);
+    }
+
     struct route route;
     rc = routes_get_default(&route);
     if (rc < 0)
@@ -228,7 +404,12 @@ int main(int argc, char *argv[]) {
             fail_printf("Error resolving local IP");
     }
 
-    args->netdev = netdev_open(netdev, route.if_name);
+    netdev_opts.local_addr = args->local_addr;
+
+    if (args->rx_threads > 1)
+        netdev_opts.flags |= NETDEV_FANOUT;
+
+    args->netdev = netdev_open(netdev, route.if_name, &netdev_opts);
     if (!args->netdev)
         fail_printf("Error opening netdev");
 
@@ -240,8 +421,87 @@ int main(int argc, char *argv[]) {
 
     queue_init(&args->queue);
 
-    START_THREAD(recv_mutex, recv_started, recv_thread, recv_cb, args);
-    START_THREAD(loop_mutex, loop_started, loop_thread, loop_cb, args);
+    output_open(&args->output, output, output_format);
+
+    range_set_init(&args->targets, &targets, &exclude);
+    range_set_init(&args->ports, &ports, NULL);
+
+    range_list_free(&targets);
+    range_list_free(&ports);
+    range_list_free(&exclude);
+
+    tgt_cnt = range_set_count(&args->targets);
+    prt_cnt = range_set_count(&args->ports);
+    tot_cnt = tgt_cnt * prt_cnt * args->count;
+
+    if (tgt_cnt == 0)
+        fail_printf("No targets left after exclusions");
+
+    /* every thread needs at least one token per second */
+    if (args->rate && (args->tx_threads > args->rate)) {
+        if (resume)
+            fail_printf("Rate too low to resume with %u threads",
+                        args->tx_threads);
+
+        args->tx_threads = args->rate;
+    }
+
+    loop_init(args, tot_cnt);
+    recv_init(args);
+
+    if (resume)
+        loop_resume(args, &ck);
+
+    checkpoint_free(&ck);
+
+    /* the other threads use the same driver as the main netdev, instead of
+     * going through the driver selection again with different flags */
+    const char *driver = args->netdev->driver->name;
+
+    netdev_opts.flags = NETDEV_TX;
+
+    for (i = 1; i < args->tx_threads; i++) {
+        struct pktizr_loop *loop = &args->loops[i];
+
+        /* use a different device queue for each thread, if supported */
+        netdev_opts.queue = i;
+
+        loop->netdev = netdev_open(driver, route.if_name, &netdev_opts);
+        if (!loop->netdev)
+            fail_printf("Error opening netdev");
+    }
+
+    netdev_opts.flags = NETDEV_RX | NETDEV_FANOUT;
+
+    for (i = 1; i < args->rx_threads; i++) {
+        struct pktizr_recv *recv = &args->recvs[i];
+
+        netdev_opts.queue = i;
+
+        recv->netdev = netdev_open(driver, route.if_name, &netdev_opts);
+        if (!recv->netdev)
+            fail_printf("Error opening netdev");
+    }
+
+    if (!args->quiet)
+        fprintf(stderr, "Scanning %zu ports on %zu hosts...\n",
+                prt_cnt, tgt_cnt);
+
+    if (!args->quiet && (args->shards > 1))
+        fprintf(stderr, "Sending shard %u/%u, %zu of %zu probes...\n",
+                args->shard + 1, args->shards, args->pkt_shard, tot_cnt);
+
+    for (i = 0; i < args->rx_threads; i++) {
+        struct pktizr_recv *recv = &args->recvs[i];
+
+        START_THREAD(mutex, started, thread, recv_cb, recv);
+    }
+
+    for (i = 0; i < args->tx_threads; i++) {
+        struct pktizr_loop *loop = &args->loops[i];
+
+        START_THREAD(mutex, started, thread, loop_cb, loop);
+    }
 
     setup_signals();
 
@@ -249,52 +509,166 @@ int main(int argc, char *argv[]) {
 
     args->done = true;
 
-    pthread_join(args->recv_thread, NULL);
-    pthread_join(args->loop_thread, NULL);
+    for (i = 0; i < args->rx_threads; i++) {
+        struct pktizr_recv *recv = &args->recvs[i];
+
+        pthread_join(recv->thread, NULL);
+
+        if (recv->netdev != args->netdev)
+            netdev_close(recv->netdev);
+    }
+
+    for (i = 0; i < args->tx_threads; i++) {
+        struct pktizr_loop *loop = &args->loops[i];
+
+        pthread_join(loop->thread, NULL);
+
+        if (loop->netdev != args->netdev)
+            netdev_close(loop->netdev);
+    }
 
     netdev_close(args->netdev);
 
-    range_list_free(args->targets);
-    range_list_free(args->ports);
+    /* the script threads are done, write out the remaining records */
+    output_close(&args->output);
+
+    /* all the loop threads are gone, so this records exactly where they were */
+    if (args->checkpoint)
+        loop_checkpoint(args);
+
+    if (!args->quiet)
+        print_stats(args);
+
+    /* only now, since replies can be freed by a thread other than the owner */
+    for (i = 0; i < args->rx_threads; i++)
+        pkt_pool_destroy(&args->recvs[i].pool);
+
+    for (i = 0; i < args->tx_threads; i++)
+        pkt_pool_destroy(&args->loops[i].pool);
+
+    free(args->loops);
+    free(args->recvs);
+
+    range_set_free(&args->targets);
+    range_set_free(&args->ports);
     free(args->script);
+    free(args->checkpoint);
 
     return 0;
 }
 
+/*
+ * Each receive thread has its own netdev, member of the same fanout group, so
+ * that all the packets of a given flow are handled by the same thread.
+ */
+static void recv_init(struct pktizr_args *args) {
+    unsigned n = args->rx_threads;
+
+    args->recvs = calloc(n, sizeof(*args->recvs));
+
+    for (unsigned i = 0; i < n; i++) {
+        struct pktizr_recv *recv = &args->recvs[i];
+
+        recv->args   = args;
+        recv->id     = i;
+        recv->netdev = args->netdev;
+
+        pkt_pool_init(&recv->pool);
+    }
+}
+
 static void *recv_cb(void *p) {
-    struct pktizr_args *args = p;
+    struct pktizr_recv *recv = p;
+    struct pktizr_args *args = recv->args;
+
+    char name[16];
+
+    pkt_pool_attach(&recv->pool);
 
     void *L = script_load(args);
 
-    args->pkt_recv = 0;
+    _free_ char *filter = script_filter(L);
+
+    if (filter)
+        netdev_set_filter(recv->netdev, filter);
+
+    struct pkt_validator validator;
+    script_validator(L, args, &validator);
+
+    bool lazy  = script_lazy(L);
+    bool batch = script_has_recv_batch(L);
+
+    recv->pkt_recv = 0;
 
-    if (pthread_setname_np(pthread_self(), "pktizr: recv"))
+    snprintf(name, sizeof(name), "pktizr: recv %u", recv->id);
+
+    if (pthread_setname_np(pthread_self(), name))
         fail_printf("Error setting thread name");
 
-    pthread_mutex_lock(&args->recv_mutex);
-    pthread_cond_signal(&args->recv_started);
-    pthread_mutex_unlock(&args->recv_mutex);
+    pthread_mutex_lock(&recv->mutex);
+    pthread_cond_signal(&recv->started);
+    pthread_mutex_unlock(&recv->mutex);
 
     while (!args->done) {
-        int rc, len;
-        struct pkt *pkt = NULL;
+        int rc;
+
+        const uint8_t *bufs[NETDEV_BATCH];
+        int            lens[NETDEV_BATCH];
 
-        const uint8_t *buf = netdev_capture(args->netdev, &len);
-        if (buf == NULL)
+        size_t cnt = netdev_capture_batch(recv->netdev, bufs, lens,
+                                          NETDEV_BATCH);
+        if (cnt == 0)
             continue;
 
-        rc = pkt_unpack((uint8_t *) buf, len, &pkt);
-        if (!rc)
-            goto done;
+        if (batch) {
+            uint8_t *valid_bufs[NETDEV_BATCH];
+            int      valid_lens[NETDEV_BATCH];
+            size_t   valid_cnt = 0;
 
-        rc = script_recv(L, args, pkt);
-        if (rc < 0)
-            goto done;
+            for (size_t i = 0; i < cnt; i++) {
+                if (!pkt_validate(&validator, bufs[i], lens[i]))
+                    continue;
 
-        args->pkt_recv++;
+                valid_bufs[valid_cnt]   = (uint8_t *) bufs[i];
+                valid_lens[valid_cnt++] = lens[i];
+            }
 
-done:
-        netdev_release(args->netdev);
+            if (valid_cnt > 0)
+                recv->pkt_recv += script_recv_batch(L, args, valid_bufs,
+                                                    valid_lens, valid_cnt);
+
+            netdev_release(recv->netdev);
+            continue;
+        }
+
+        for (size_t i = 0; i < cnt; i++) {
+            struct pkt *pkt = NULL;
+
+            /* drop replies to someone else's probes before any Lua work */
+            if (!pkt_validate(&validator, bufs[i], lens[i]))
+                continue;
+
+            if (lazy) {
+                rc = script_recv_frame(L, args, (uint8_t *) bufs[i], lens[i]);
+                if (rc < 0)
+                    continue;
+
+                recv->pkt_recv++;
+                continue;
+            }
+
+            rc = pkt_unpack((uint8_t *) bufs[i], lens[i], &pkt);
+            if (!rc)
+                continue;
+
+            rc = script_recv(L, args, pkt);
+            if (rc < 0)
+                continue;
+
+            recv->pkt_recv++;
+        }
+
+        netdev_release(recv->netdev);
     }
 
     script_close(L);
@@ -302,115 +676,483 @@ done:
     return NULL;
 }
 
-int pkt_send(struct pktizr_args *args, struct pkt *pkt) {
-    uint8_t *buf;
-    size_t   len;
+static void pkt_flush(struct pktizr_loop *loop) {
+    if (loop->tx_cnt == 0)
+        goto done;
+
+    if (caa_likely(!loop->args->offline))
+        netdev_commit(loop->netdev, loop->tx_bufs, loop->tx_lens,
+                      loop->tx_cnt);
+
+    loop->pkt_sent += loop->tx_cnt;
+    loop->pkt_batch++;
+
+done:
+    loop->tx_cnt = 0;
+    loop->tx_max = 0;
+}
+
+static void pkt_reserve(struct pktizr_loop *loop) {
+    if (loop->tx_cnt < loop->tx_max)
+        return;
+
+    pkt_flush(loop);
 
-    buf = netdev_get_buf(args->netdev, &len);
+    loop->tx_max = netdev_reserve(loop->netdev, loop->tx_bufs,
+                                  loop->tx_lens, NETDEV_BATCH);
+}
+
+int pkt_send(struct pktizr_loop *loop, struct pkt *pkt) {
+    pkt_reserve(loop);
 
-    int pkt_len = pkt_pack(buf, len, pkt);
+    int pkt_len = pkt_pack(loop->tx_bufs[loop->tx_cnt],
+                           loop->tx_lens[loop->tx_cnt], pkt);
     if (pkt_len < 0)
         return -1;
 
-    if (caa_likely(!args->offline))
-        netdev_inject(args->netdev, buf, pkt_len);
+    loop->tx_lens[loop->tx_cnt++] = pkt_len;
+
+    return 0;
+}
+
+static int pkt_send_template(struct pktizr_loop *loop,
+                             const struct pkt_template *t,
+                             uint32_t daddr, uint16_t dport) {
+    pkt_reserve(loop);
+
+    int pkt_len = pkt_template_stamp(t, loop->tx_bufs[loop->tx_cnt],
+                                     loop->tx_lens[loop->tx_cnt],
+                                     daddr, dport);
+    if (pkt_len < 0)
+        return -1;
 
-    args->pkt_sent++;
+    loop->tx_lens[loop->tx_cnt++] = pkt_len;
 
     return 0;
 }
 
+/*
+ * The shard's part of the index space is split into one contiguous slice per
+ * loop thread, and each thread claims chunks of LOOP_CHUNK indexes from its own
+ * slice. Once a slice is exhausted its thread starts claiming chunks from the
+ * other slices, so that faster threads can pick up the slack of slower ones.
+ *
+ * Since the index to target mapping doesn't depend on which thread or shard
+ * handles the index, the set of generated probes is the same as with a single
+ * thread, and the probes of a shard are just as shuffled as those of a full
+ * scan.
+ */
+static void loop_init(struct pktizr_args *args, uint64_t tot_cnt) {
+    unsigned k = args->shard, shards = args->shards;
+
+    uint64_t start = (tot_cnt / shards) * k +
+                     ((k < (tot_cnt % shards)) ? k : (tot_cnt % shards));
+    uint64_t count = (tot_cnt / shards) + (k < (tot_cnt % shards));
+
+    unsigned n = args->tx_threads;
+
+    args->pkt_count = tot_cnt;
+    args->pkt_shard = count;
+    args->loops     = calloc(n, sizeof(*args->loops));
+
+    for (unsigned i = 0; i < n; i++) {
+        struct pktizr_loop *loop = &args->loops[i];
+
+        loop->args   = args;
+        loop->id     = i;
+        loop->netdev = args->netdev;
+
+        loop->next   = start;
+        loop->end    = start + (count / n) + (i < (count % n));
+
+        loop->rate   = (args->rate / n) + (i < (args->rate % n));
+
+        loop->claims    = 0;
+        loop->cur_slice = NULL;
+
+        pkt_pool_init(&loop->pool);
+
+        start = loop->end;
+    }
+}
+
+static bool loop_claim(struct pktizr_loop *slice, uint64_t *i, uint64_t *end) {
+    uint64_t start;
+
+    if (CMM_LOAD_SHARED(slice->next) >= slice->end)
+        return false;
+
+    start = uatomic_add_return(&slice->next, LOOP_CHUNK) - LOOP_CHUNK;
+    if (start >= slice->end)
+        return false;
+
+    *i   = start;
+    *end = (slice->end - start > LOOP_CHUNK) ? start + LOOP_CHUNK :
+                                               slice->end;
+
+    return true;
+}
+
+static bool loop_next_chunk(struct pktizr_loop *loop,
+                            uint64_t *i, uint64_t *end) {
+    struct pktizr_args *args = loop->args;
+    struct pktizr_loop *slice = NULL;
+
+    /* a checkpoint taken while a chunk is claimed but not published yet could
+     * skip it, so let loop_snapshot() know (and retry later) */
+    CMM_STORE_SHARED(loop->claims, loop->claims + 1);
+    cmm_smp_mb();
+
+    if (loop_claim(loop, i, end))
+        slice = loop;
+
+    for (unsigned j = 1; !slice && (j < args->tx_threads); j++) {
+        unsigned victim = (loop->id + j) % args->tx_threads;
+
+        if (loop_claim(&args->loops[victim], i, end))
+            slice = &args->loops[victim];
+    }
+
+    CMM_STORE_SHARED(loop->cur, *i);
+    CMM_STORE_SHARED(loop->cur_slice, slice);
+
+    cmm_smp_wmb();
+    CMM_STORE_SHARED(loop->claims, loop->claims + 1);
+
+    return slice != NULL;
+}
+
 static void *loop_cb(void *p) {
-    struct pktizr_args *args = p;
+    struct pktizr_loop *loop = p;
+    struct pktizr_args *args = loop->args;
 
     int rc;
 
-    size_t i = 0;
+    uint64_t i = 0, end = 0;
+
+    char name[16];
 
     struct pkt *pkt;
     struct queue_node *node;
 
+    pkt_pool_attach(&loop->pool);
+
     void *L = script_load(args);
 
-    size_t tgt_cnt = range_list_count(args->targets);
-    size_t prt_cnt = range_list_count(args->ports);
-    size_t tot_cnt = tgt_cnt * prt_cnt * args->count;
+    /* with a template the probes are generated without calling the script */
+    struct pkt_template *tpl = script_template(L);
+
+    bool batch = script_has_loop_batch(L);
+
+    uint32_t batch_addrs[NETDEV_BATCH];
+    uint16_t batch_ports[NETDEV_BATCH];
+    size_t   batch_cnt = 0;
+
+    uint64_t tgt_cnt = range_set_count(&args->targets);
 
     struct bucket bucket;
-    bucket_init(&bucket, args->rate);
+    bucket_init(&bucket, loop->rate);
 
     struct shuffle rnd;
-    shuffle_init(&rnd, tot_cnt, args->seed);
+    shuffle_init(&rnd, args->pkt_count, args->seed,
+                 args->shuffle_cyclic ? SHUFFLE_CYCLIC : SHUFFLE_FEISTEL);
 
-    args->pkt_count = tot_cnt;
-    args->pkt_sent  = 0;
-    args->pkt_probe = 0;
+    /* shuffled indexes, generated NETDEV_BATCH at a time */
+    uint64_t shuf[NETDEV_BATCH];
+    uint64_t shuf_start = 0, shuf_cnt = 0;
 
-    if (pthread_setname_np(pthread_self(), "pktizr: loop"))
-        fail_printf("Error setting thread name");
+    /* both are only zero when there's nothing to send anyway */
+    struct fastdiv div_tgt, div_count;
+    fastdiv_init(&div_tgt, tgt_cnt ? tgt_cnt : 1);
+    fastdiv_init(&div_count, args->count ? args->count : 1);
 
-    if (!args->quiet)
-        printf("Scanning %zu ports on %zu hosts...\n",
-               prt_cnt, tgt_cnt);
+    loop->pkt_sent  = 0;
+    loop->pkt_probe = 0;
+    loop->pkt_batch = 0;
 
-    pthread_mutex_lock(&args->loop_mutex);
-    pthread_cond_signal(&args->loop_started);
-    pthread_mutex_unlock(&args->loop_mutex);
+    snprintf(name, sizeof(name), "pktizr: loop %u", loop->id);
 
-    while (!args->done) {
-        uint64_t tgt;
+    if (pthread_setname_np(pthread_self(), name))
+        fail_printf("Error setting thread name");
 
-        uint32_t daddr;
-        uint16_t dport;
+    pthread_mutex_lock(&loop->mutex);
+    pthread_cond_signal(&loop->started);
+    pthread_mutex_unlock(&loop->mutex);
+
+    while (!args->done) {
+        size_t burst = NETDEV_BATCH;
 
         bucket_consume(&bucket);
 
-        node = queue_dequeue(&args->queue);
-        if (!node)
-            goto script;
+        if (bucket.rate && (bucket.tokens < burst))
+            burst = bucket.tokens;
 
-        pkt = caa_container_of(node, struct pkt, queue);
+        for (size_t n = 0; n < burst; n++) {
+            uint64_t tgt;
 
-        pkt_send(args, pkt);
+            uint32_t daddr;
+            uint16_t dport;
 
-        bucket.tokens--;
-        goto done;
+            /* replies are only sent by the first loop thread */
+            if (loop->id != 0)
+                goto script;
+
+            node = queue_dequeue(&args->queue);
+            if (!node)
+                goto script;
+
+            pkt = caa_container_of(node, struct pkt, queue);
+
+            pkt_send(loop, pkt);
+
+            bucket.tokens--;
+            goto done;
 
 script:
-        if (caa_unlikely((i >= tot_cnt) || args->stop))
-            continue;
+            if (caa_unlikely(args->stop))
+                break;
 
-        tgt = (args->shuffle) ? shuffle(&rnd, i) : i;
+            if (caa_unlikely(i >= end)) {
+                /* the probes of the current chunk must be flushed before a
+                 * new one is published, or a checkpoint could skip them */
+                if (n > 0)
+                    break;
 
-        daddr = range_list_pick(args->targets,
-                                (tgt % tgt_cnt) / args->count);
-        dport = range_list_pick(args->ports,
-                                (tgt / tgt_cnt) / args->count);
+                if (!loop_next_chunk(loop, &i, &end))
+                    break;
+            }
 
-        i++;
+            tgt = i;
 
-        rc = script_loop(L, args, &pkt, daddr, dport);
-        if (caa_unlikely(rc < 0))
-            continue;
+            if (args->shuffle) {
+                if (caa_unlikely(i - shuf_start >= shuf_cnt)) {
+                    shuf_start = i;
+                    shuf_cnt   = end - i;
+
+                    if (shuf_cnt > NETDEV_BATCH)
+                        shuf_cnt = NETDEV_BATCH;
 
-        pkt_send(args, pkt);
+                    shuffle_batch(&rnd, shuf_start, shuf_cnt, shuf);
+                }
 
-        args->pkt_probe++;
-        bucket.tokens--;
+                tgt = shuf[i - shuf_start];
+            }
+
+            daddr = range_set_pick(&args->targets,
+                        fastdiv_div(&div_count, fastdiv_mod(&div_tgt, tgt)));
+            dport = range_set_pick(&args->ports,
+                        fastdiv_div(&div_count, fastdiv_div(&div_tgt, tgt)));
+
+            i++;
+
+            if (tpl) {
+                rc = pkt_send_template(loop, tpl, daddr, dport);
+                if (caa_unlikely(rc < 0))
+                    continue;
+
+                loop->pkt_probe++;
+                bucket.tokens--;
+                continue;
+            }
+
+            if (batch) {
+                batch_addrs[batch_cnt]   = daddr;
+                batch_ports[batch_cnt++] = dport;
+                continue;
+            }
+
+            rc = script_loop(L, args, &pkt, daddr, dport);
+            if (caa_unlikely(rc < 0))
+                continue;
+
+            pkt_send(loop, pkt);
+
+            loop->pkt_probe++;
+            bucket.tokens--;
 
 done:
-        pkt_free_all(pkt);
+            pkt_free_all(pkt);
+        }
+
+        /* a single script call for the whole burst */
+        if (batch_cnt > 0) {
+            script_loop_batch(L, loop, batch_addrs, batch_ports, batch_cnt);
+
+            loop->pkt_probe += batch_cnt;
+            bucket.tokens   -= batch_cnt;
+
+            batch_cnt = 0;
+        }
+
+        pkt_flush(loop);
     }
 
+    /* when stopped in the middle of a chunk, resume right where it was left */
+    CMM_STORE_SHARED(loop->claims, loop->claims + 1);
+    cmm_smp_wmb();
+
+    CMM_STORE_SHARED(loop->cur, i);
+
+    cmm_smp_wmb();
+    CMM_STORE_SHARED(loop->claims, loop->claims + 1);
+
     script_close(L);
 
     return NULL;
 }
 
+static uint64_t loop_sent(struct pktizr_args *args) {
+    uint64_t sent = 0;
+
+    for (unsigned i = 0; i < args->tx_threads; i++)
+        sent += args->loops[i].pkt_sent;
+
+    return sent;
+}
+
+static uint64_t loop_batch(struct pktizr_args *args) {
+    uint64_t batch = 0;
+
+    for (unsigned i = 0; i < args->tx_threads; i++)
+        batch += args->loops[i].pkt_batch;
+
+    return batch;
+}
+
+static uint64_t loop_probe(struct pktizr_args *args) {
+    uint64_t probe = 0;
+
+    for (unsigned i = 0; i < args->tx_threads; i++)
+        probe += args->loops[i].pkt_probe;
+
+    return probe;
+}
+
+static uint64_t recv_count(struct pktizr_args *args) {
+    uint64_t recv = 0;
+
+    for (unsigned i = 0; i < args->rx_threads; i++)
+        recv += args->recvs[i].pkt_recv;
+
+    return recv;
+}
+
+/*
+ * Find the first index of each slice that may not have been sent yet, that is
+ * the lowest between the next chunk to be claimed and the chunks being sent.
+ * A loop thread only claims a new chunk once the probes of the previous one
+ * are flushed, so its published chunk covers all of its unflushed probes.
+ * Returns false if a loop thread was claiming a chunk at the same time.
+ */
+static bool loop_snapshot(struct pktizr_args *args,
+                          struct checkpoint_slice *slices) {
+    for (unsigned i = 0; i < args->tx_threads; i++) {
+        struct pktizr_loop *slice = &args->loops[i];
+
+        uint64_t next = CMM_LOAD_SHARED(slice->next);
+
+        slices[i].next = (next < slice->end) ? next : slice->end;
+        slices[i].end  = slice->end;
+    }
+
+    cmm_smp_mb();
+
+    for (unsigned i = 0; i < args->tx_threads; i++) {
+        struct pktizr_loop *loop = &args->loops[i];
+
+        uint64_t claims = CMM_LOAD_SHARED(loop->claims);
+        if (claims & 1)
+            return false;
+
+        cmm_smp_rmb();
+
+        uint64_t cur = CMM_LOAD_SHARED(loop->cur);
+        struct pktizr_loop *slice = CMM_LOAD_SHARED(loop->cur_slice);
+
+        cmm_smp_rmb();
+
+        if (CMM_LOAD_SHARED(loop->claims) != claims)
+            return false;
+
+        if (slice == NULL)
+            continue;
+
+        struct checkpoint_slice *s = &slices[slice - args->loops];
+
+        if (cur < s->next)
+            s->next = cur;
+    }
+
+    return true;
+}
+
+static void loop_checkpoint(struct pktizr_args *args) {
+    _free_ struct checkpoint_slice *slices = NULL;
+
+    struct checkpoint ck = {
+        .seed           = args->seed,
+        .count          = args->count,
+        .total          = args->pkt_count,
+        .targets        = range_set_hash(&args->targets),
+        .ports          = range_set_hash(&args->ports),
+        .shuffle        = args->shuffle,
+        .shuffle_cyclic = args->shuffle_cyclic,
+        .shard          = args->shard,
+        .shards         = args->shards,
+        .pkt_sent       = args->ckpt_sent + loop_sent(args),
+        .pkt_probe      = args->pkt_shard,
+        .pkt_recv       = args->ckpt_recv + recv_count(args),
+        .slice_cnt      = args->tx_threads,
+    };
+
+    slices = malloc(args->tx_threads * sizeof(*slices));
+    if (slices == NULL)
+        fail_printf("OOM");
+
+    /* try again at the next one */
+    if (!loop_snapshot(args, slices))
+        return;
+
+    for (unsigned i = 0; i < args->tx_threads; i++)
+        ck.pkt_probe -= slices[i].end - slices[i].next;
+
+    ck.slices = slices;
+
+    if (checkpoint_save(args->checkpoint, &ck) < 0)
+        err_printf("Error saving checkpoint '%s'", args->checkpoint);
+}
+
+static void loop_resume(struct pktizr_args *args, struct checkpoint *ck) {
+    if ((ck->total != args->pkt_count) ||
+        (ck->targets != range_set_hash(&args->targets)) ||
+        (ck->ports != range_set_hash(&args->ports)))
+        fail_printf("Targets or ports don't match the checkpoint");
+
+    args->ckpt_sent  = ck->pkt_sent;
+    args->ckpt_probe = args->pkt_shard;
+    args->ckpt_recv  = ck->pkt_recv;
+
+    for (unsigned i = 0; i < args->tx_threads; i++) {
+        struct pktizr_loop *loop = &args->loops[i];
+
+        struct checkpoint_slice *s = &ck->slices[i];
+
+        /* the slices were split the same way by loop_init() */
+        if ((s->next < loop->next) || (s->end != loop->end))
+            fail_printf("Invalid checkpoint slice");
+
+        loop->next = s->next;
+        loop->end  = s->end;
+
+        args->ckpt_probe -= s->end - s->next;
+    }
+}
+
 static void status_line(struct pktizr_args *args) {
-    uint64_t tot      = args->pkt_count;
+    uint64_t tot      = args->pkt_shard;
     uint64_t now_old  = time_now();
-    uint64_t sent_old = args->pkt_sent;
+    uint64_t sent_old = loop_sent(args);
+    uint64_t ckpt_old = now_old;
 
     stop = false;
 
@@ -419,8 +1161,9 @@ static void status_line(struct pktizr_args *args) {
 
     while (1) {
         uint64_t now   = time_now();
-        uint64_t sent  = args->pkt_sent;
-        uint64_t probe = args->pkt_probe;
+        uint64_t sent  = loop_sent(args);
+        uint64_t probe = args->ckpt_probe + loop_probe(args);
+        uint64_t batch = loop_batch(args);
 
         double rate    = (sent - sent_old) / ((now - now_old) / 1e6);
         double percent = (double) probe * 100 / tot;
@@ -430,14 +1173,27 @@ static void status_line(struct pktizr_args *args) {
             fprintf(stderr, "Progress: %3.2f%% ", percent);
             fprintf(stderr, "Rate: %3.2fkpps ", rate / 1000);
             fprintf(stderr, "Sent: %zu ", sent);
-            fprintf(stderr, "Replies: %zu ", args->pkt_recv);
+            fprintf(stderr, "Batch: %.1f ", batch ? (double) sent / batch : 0);
+            fprintf(stderr, "Replies: %zu ", recv_count(args));
+
+            if (CMM_LOAD_SHARED(args->output.rings)) {
+                fprintf(stderr, "Backlog: %zuKB ",
+                        CMM_LOAD_SHARED(args->output.backlog) / 1024);
+                fprintf(stderr, "Dropped: %zu ", output_drops(&args->output));
+            }
             fprintf(stderr, "\r");
         }
 
         now_old  = now;
         sent_old = sent;
 
-        if (probe == tot)
+        if (args->checkpoint && (now - ckpt_old >= CHECKPOINT_INTERVAL)) {
+            loop_checkpoint(args);
+
+            ckpt_old = now;
+        }
+
+        if (probe >= tot)
             break;
 
         if (stop) {
@@ -469,6 +1225,31 @@ static void status_line(struct pktizr_args *args) {
         fprintf(stderr, "\r" LINE_CLEAR CURSOR_SHOW);
 }
 
+static void print_stats(struct pktizr_args *args) {
+    fprintf(stderr, "Sent %zu packets (%zu probes), received %zu replies\n",
+            loop_sent(args), loop_probe(args), recv_count(args));
+
+    if (args->output.records || args->output.drops)
+        fprintf(stderr,
+                "Wrote %zu records (%zu dropped, %zuKB peak backlog)\n",
+                args->output.records, args->output.drops,
+                args->output.backlog_peak / 1024);
+
+    for (unsigned i = 0; i < args->tx_threads; i++) {
+        struct pkt_pool *pool = &args->loops[i].pool;
+
+        fprintf(stderr, "Loop %u packet pool: %zu peak, %zu allocated\n",
+                i, pool->peak, pool->size);
+    }
+
+    for (unsigned i = 0; i < args->rx_threads; i++) {
+        struct pkt_pool *pool = &args->recvs[i].pool;
+
+        fprintf(stderr, "Recv %u packet pool: %zu peak, %zu allocated\n",
+                i, pool->peak, pool->size);
+    }
+}
+
 static void handle_term_sig(int sig) {
     stop = true;
 }
@@ -516,19 +1297,36 @@ static inline void help(void) {
     puts("");
 
     CMD_HELP("--ports", "-p", "Use the specified port ranges");
+    CMD_HELP("--input-list", "-i", "Read targets from the given file, or stdin if '-'");
+    CMD_HELP("--exclude", "-x", "Don't scan the specified addresses");
+    CMD_HELP("--exclude-file", "-X", "Don't scan the addresses listed in the given file");
     CMD_HELP("--rate",  "-r", "Send packets no faster than the specified rate");
     CMD_HELP("--seed",  "-s", "Use the given number as seed value");
     CMD_HELP("--wait",  "-w", "Wait the given amount of seconds after the scan is complete");
     CMD_HELP("--count", "-c", "Send the given amount of duplicate packets");
 
+    CMD_HELP("--shard", "-H", "Only send the given k/n part of the probes");
+    CMD_HELP("--checkpoint", "-k", "Periodically save the scan progress to the given file");
+    CMD_HELP("--resume", "-E", "Resume the scan saved in the given checkpoint file");
+
     CMD_HELP("--local-addr", "-l", "Use the given IP address as source");
     CMD_HELP("--gateway-addr", "-g", "Route the packets to the given gateway");
 
     CMD_HELP("--netdev", "-n", "Use the specified netdev driver");
 
-    CMD_HELP("--shuffle", "-R", "Shuffle the target address/port order");
+    CMD_HELP("--tx-threads", "-T", "Use the given number of transmit threads");
+    CMD_HELP("--rx-threads", "-C", "Use the given number of receive threads");
+
+    CMD_HELP("--rx-block-size", "-b", "Use the given receive ring block size");
+    CMD_HELP("--rx-timeout", "-t", "Retire receive ring blocks after the given ms");
+
+    CMD_HELP("--shuffle", "-R", "Shuffle the target address/port order (feistel or cyclic)");
+    CMD_HELP("--legacy-cookies", "-K", "Compute cookies like older versions");
     CMD_HELP("--offline", "-o", "Don't transmit packets");
 
+    CMD_HELP("--output", "-O", "Write the records emitted by the script to the given file");
+    CMD_HELP("--output-format", "-F", "Write records as json, csv or binary");
+
     CMD_HELP("--quiet", "-q", "Don't show the status line");
 
     puts("");
@@ -28,18 +28,76 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+struct pktizr_loop {
+    struct pktizr_args *args;
+
+    struct netdev *netdev;
+
+    unsigned id;
+
+    uint64_t next;
+    uint64_t end;
+
+    uint64_t rate;
+
+    uint64_t pkt_probe;
+    uint64_t pkt_sent;
+    uint64_t pkt_batch;
+
+    /* start of the chunk being sent and the slice it was claimed from, odd
+     * claims means that they are being updated, see loop_next_chunk() */
+    uint64_t claims;
+    uint64_t cur;
+    struct pktizr_loop *cur_slice;
+
+    uint8_t *tx_bufs[NETDEV_BATCH];
+    size_t   tx_lens[NETDEV_BATCH];
+    size_t   tx_cnt;
+    size_t   tx_max;
+
+    struct pkt_pool pool;
+
+    pthread_t       thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t  started;
+};
+
+struct pktizr_recv {
+    struct pktizr_args *args;
+
+    struct netdev *netdev;
+
+    unsigned id;
+
+    uint64_t pkt_recv;
+
+    struct pkt_pool pool;
+
+    pthread_t       thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t  started;
+};
+
 struct pktizr_args {
-    struct range *targets;
-    struct range *ports;
+    struct range_set targets;
+    struct range_set ports;
 
     struct netdev *netdev;
 
     char *script;
 
     uint64_t pkt_count;
-    uint64_t pkt_probe;
-    uint64_t pkt_recv;
-    uint64_t pkt_sent;
+
+    /* this instance only sends the indexes of its shard, out of pkt_count */
+    unsigned shard;
+    unsigned shards;
+    uint64_t pkt_shard;
+
+    /* checkpoint file, and counters of the resumed scan */
+    char *checkpoint;
+    uint64_t ckpt_sent;
+    uint64_t ckpt_probe;
+    uint64_t ckpt_recv;
 
     uint64_t rate;
     uint64_t seed;
@@ -47,18 +105,19 @@ struct pktizr_args {
     uint64_t count;
 
     bool shuffle;
+    bool shuffle_cyclic;
     bool offline;
 
-    pthread_t       recv_thread;
-    pthread_mutex_t recv_mutex;
-    pthread_cond_t  recv_started;
+    unsigned tx_threads;
+    struct pktizr_loop *loops;
 
-    pthread_t       loop_thread;
-    pthread_mutex_t loop_mutex;
-    pthread_cond_t  loop_started;
+    unsigned rx_threads;
+    struct pktizr_recv *recvs;
 
     struct queue queue;
 
+    struct output output;
+
     uint32_t local_addr;
     uint32_t gateway_addr;
 
@@ -67,3 +126,5 @@ struct pktizr_args {
 
     bool done, stop, quiet;
 };
+
+int pkt_send(struct pktizr_loop *loop, struct pkt *pkt);
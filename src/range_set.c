@@ -0,0 +1,269 @@
+/*
+ * Scriptable, asynchronous network packet generator/analyzer.
+ *
+ * Copyright (c) 2015, Alessandro Ghedini
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Target and port lists are compiled into a range set before the scan starts,
+ * that is, a sorted array of disjoint ranges along with the index of the first
+ * value of each range in the whole set. Picking the value at a given index is
+ * then a binary search over those indexes, instead of a walk over the list.
+ * Excluded ranges are removed from the set at this point, so they don't take
+ * up any index. Sets made only of single addresses, like hitlists, just keep
+ * the sorted array of addresses, which is indexed directly.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "ranges.h"
+#include "hash.h"
+#include "printf.h"
+
+/* lists shorter than this are sorted with qsort() instead of radix sort */
+#define RADIX_MIN 4096
+
+#define RADIX_BITS 11
+#define RADIX_SIZE (1 << RADIX_BITS)
+
+static int range_cmp(const void *a, const void *b) {
+    const struct range *ra = a;
+    const struct range *rb = b;
+
+    if (ra->start != rb->start)
+        return (ra->start < rb->start) ? -1 : 1;
+
+    return 0;
+}
+
+/* LSD radix sort by start, in three passes of 11 bits */
+static void radix_sort(struct range *ranges, size_t n) {
+    struct range *tmp = malloc(n * sizeof(*tmp));
+    if (tmp == NULL)
+        fail_printf("OOM");
+
+    struct range *src = ranges, *dst = tmp;
+
+    for (int shift = 0; shift < 32; shift += RADIX_BITS) {
+        size_t offs[RADIX_SIZE] = { 0 };
+
+        for (size_t i = 0; i < n; i++)
+            offs[(src[i].start >> shift) & (RADIX_SIZE - 1)]++;
+
+        for (size_t i = 0, sum = 0; i < RADIX_SIZE; i++) {
+            size_t c = offs[i];
+
+            offs[i] = sum;
+            sum += c;
+        }
+
+        for (size_t i = 0; i < n; i++)
+            dst[offs[(src[i].start >> shift) & (RADIX_SIZE - 1)]++] = src[i];
+
+        struct range *t = src;
+
+        src = dst;
+        dst = t;
+    }
+
+    /* odd number of passes, the result is in tmp */
+    memcpy(ranges, src, n * sizeof(*ranges));
+
+    free(tmp);
+}
+
+/*
+ * Sort the list and merge overlapping ranges, in place. Adjacent ranges are
+ * left alone, so that lists of single addresses stay that way.
+ */
+static size_t compile(struct range_list *list) {
+    struct range *ranges = list->ranges;
+
+    size_t n = list->cnt, cnt = 0;
+
+    if (n < RADIX_MIN)
+        qsort(ranges, n, sizeof(*ranges), range_cmp);
+    else
+        radix_sort(ranges, n);
+
+    for (size_t i = 0; i < n; i++) {
+        struct range *last = (cnt > 0) ? &ranges[cnt - 1] : NULL;
+
+        if (last && (ranges[i].start <= last->end)) {
+            if (ranges[i].end > last->end)
+                last->end = ranges[i].end;
+
+            continue;
+        }
+
+        ranges[cnt++] = ranges[i];
+    }
+
+    list->cnt = cnt;
+
+    return cnt;
+}
+
+/*
+ * Subtract the sorted, disjoint ranges in excl from the ones in incl in a
+ * single pass over both, so that excluded values never get an index.
+ */
+static struct range *subtract(struct range *incl, size_t n_incl,
+                              struct range *excl, size_t n_excl, size_t *cnt) {
+    /* every exclusion splits at most one range in two */
+    struct range *ranges = malloc((n_incl + n_excl + 1) * sizeof(*ranges));
+    if (ranges == NULL)
+        fail_printf("OOM");
+
+    size_t c = 0, j = 0;
+
+    for (size_t i = 0; i < n_incl; i++) {
+        uint64_t start = incl[i].start;
+        uint64_t end   = incl[i].end;
+
+        /* skip exclusions entirely before this range */
+        while ((j < n_excl) && (excl[j].end < start))
+            j++;
+
+        for (size_t k = j; (k < n_excl) && (excl[k].start <= end); k++) {
+            if (excl[k].start > start) {
+                ranges[c].start = start;
+                ranges[c].end   = excl[k].start - 1;
+                c++;
+            }
+
+            start = (uint64_t) excl[k].end + 1;
+
+            if (start > end)
+                break;
+        }
+
+        if (start <= end) {
+            ranges[c].start = start;
+            ranges[c].end   = end;
+            c++;
+        }
+    }
+
+    *cnt = c;
+
+    return ranges;
+}
+
+void range_set_init(struct range_set *set, struct range_list *list,
+                    struct range_list *exclude) {
+    size_t cnt;
+
+    size_t n_incl = compile(list);
+    size_t n_excl = exclude ? compile(exclude) : 0;
+
+    struct range *ranges = list->ranges;
+
+    if (n_excl > 0)
+        ranges = subtract(list->ranges, n_incl, exclude->ranges, n_excl, &cnt);
+    else
+        cnt = n_incl;
+
+    bool single = true;
+
+    for (size_t i = 0; (i < cnt) && single; i++)
+        single = (ranges[i].start == ranges[i].end);
+
+    set->cnt    = cnt;
+    set->starts = malloc((cnt ? cnt : 1) * sizeof(*set->starts));
+    set->offs   = NULL;
+
+    if (set->starts == NULL)
+        fail_printf("OOM");
+
+    for (size_t i = 0; i < cnt; i++)
+        set->starts[i] = ranges[i].start;
+
+    /* sparse lists of single addresses are indexed directly */
+    if (!single) {
+        set->offs = malloc((cnt + 1) * sizeof(*set->offs));
+        if (set->offs == NULL)
+            fail_printf("OOM");
+
+        set->offs[0] = 0;
+
+        for (size_t i = 0; i < cnt; i++) {
+            uint64_t size = (uint64_t) (ranges[i].end - ranges[i].start) + 1;
+
+            set->offs[i + 1] = set->offs[i] + size;
+        }
+    }
+
+    if (ranges != list->ranges)
+        free(ranges);
+}
+
+uint32_t range_set_pick(const struct range_set *set, uint64_t index) {
+    const uint64_t *base = set->offs;
+    size_t len = set->cnt;
+
+    if (base == NULL)
+        return set->starts[index];
+
+    /* find the last range starting at or before index, without branches */
+    while (len > 1) {
+        size_t half = len / 2;
+
+        base = (base[half] <= index) ? base + half : base;
+        len -= half;
+    }
+
+    size_t i = base - set->offs;
+
+    return set->starts[i] + (uint32_t) (index - set->offs[i]);
+}
+
+uint64_t range_set_count(const struct range_set *set) {
+    return set->offs ? set->offs[set->cnt] : set->cnt;
+}
+
+/* identifies the set, regardless of how the ranges were given */
+uint64_t range_set_hash(const struct range_set *set) {
+    uint64_t h = wyhash16(0, set->cnt, range_set_count(set));
+
+    for (size_t i = 0; i < set->cnt; i++)
+        h = wyhash16(h, set->starts[i], set->offs ? set->offs[i] : i);
+
+    return h;
+}
+
+void range_set_free(struct range_set *set) {
+    free(set->starts);
+    free(set->offs);
+
+    set->starts = NULL;
+    set->offs   = NULL;
+    set->cnt    = 0;
+}
@@ -28,13 +28,18 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
-#include <assert.h>
+#include <stdio.h>
 #include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
 
-#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
-#include "ut/utlist.h"
+#include <arpa/inet.h>
 
 #include "ranges.h"
 #include "netdev.h"
@@ -42,42 +47,41 @@
 #include "printf.h"
 #include "util.h"
 
-struct range *range_parse_targets(void *ta, char *spec) {
-    _free_ char **ranges = NULL;
-    size_t c = validate_optlist("<targets>", spec);
+static void parse_target(struct range_list *list, char *spec) {
+    struct in_addr a;
 
-    _free_ char *tmp = strdup(spec);
-    if (tmp == NULL) fail_printf("OOM");
+    int bits = inet_net_pton(AF_INET, spec, &a, sizeof(a));
+    if (bits < 0) {
+        int rc = resolv_name_to_addr(spec, &a.s_addr);
+        if (rc < 0)
+            sysf_printf("Invalid address '%s'", spec);
 
-    c = split_str(tmp, &ranges, ",");
-    if (c == 0) fail_printf("Invalid targets spec '%s'", spec);
+        bits = 32;
+    }
 
-    struct range *list = NULL;
+    uint32_t mask = 0xffffffff00000000ull >> bits;
 
-    for (int i = 0; i < c; i++) {
-        struct in_addr a;
+    uint32_t start = ntohl(a.s_addr) & mask;
+    uint32_t end   = start | ~mask;
 
-        int bits = inet_net_pton(AF_INET, ranges[i], &a, sizeof(a));
-        if (bits < 0) {
-            int rc = resolv_name_to_addr(ranges[i], &a.s_addr);
-            if (rc < 0)
-                sysf_printf("Invalid address '%s'", ranges[i]);
-
-            bits = 32;
-        }
+    range_list_add(list, start, end);
+}
 
-        uint32_t mask = 0xffffffff00000000ull >> bits;
+void range_parse_targets(struct range_list *list, char *spec) {
+    _free_ char **ranges = NULL;
+    size_t c = validate_optlist("<targets>", spec);
 
-        uint32_t start = ntohl(a.s_addr) & mask;
-        uint32_t end   = start | ~mask;
+    _free_ char *tmp = strdup(spec);
+    if (tmp == NULL) fail_printf("OOM");
 
-        range_list_add(ta, &list, start, end);
-    }
+    c = split_str(tmp, &ranges, ",");
+    if (c == 0) fail_printf("Invalid targets spec '%s'", spec);
 
-    return list;
+    for (int i = 0; i < c; i++)
+        parse_target(list, ranges[i]);
 }
 
-struct range *range_parse_ports(void *ta, char *spec) {
+void range_parse_ports(struct range_list *list, char *spec) {
     _free_ char **ranges = NULL;
 
     _free_ char *tmp = strdup(spec);
@@ -86,8 +90,6 @@ struct range *range_parse_ports(void *ta, char *spec) {
     size_t c = split_str(tmp, &ranges, ",");
     if (c == 0) fail_printf("Invalid ports spec '%s'", spec);
 
-    struct range *list = NULL;
-
     for (int i = 0; i < c; i++) {
         int x, y;
         char *s = ranges[i], *e;
@@ -97,7 +99,7 @@ struct range *range_parse_ports(void *ta, char *spec) {
         s = e;
 
         if (*s == '\0') {
-            range_list_add(ta, &list, x, x);
+            range_list_add(list, x, x);
             continue;
         }
 
@@ -107,93 +109,214 @@ struct range *range_parse_ports(void *ta, char *spec) {
 
         s++;
 
-        if (!(y = strtol(s, &e, 10), e != s) || (y < 1))
+        if (!(y = strtol(s, &e, 10), e != s) || (y < x))
             fail_printf("Invalid port range: %s", s);
 
-        range_list_add(ta, &list, x, y);
+        range_list_add(list, x, y);
     }
-
-    return list;
 }
 
-uint32_t range_list_pick(struct range *list, uint32_t index) {
-    struct range *cur;
+/*
+ * Parse a dotted-quad address with an optional prefix length, which is what
+ * large target files are made of, without copying the line. Anything else is
+ * left to parse_target().
+ */
+static bool parse_cidr(const char *s, const char *e,
+                       uint32_t *start, uint32_t *end) {
+    uint32_t addr = 0, bits = 32;
+
+    for (int i = 0; i < 4; i++) {
+        uint32_t octet = 0;
+        int digits = 0;
 
-    LL_FOREACH(list, cur) {
-        size_t cnt = (cur->end - cur->start) + 1;
+        if (i > 0) {
+            if ((s == e) || (*s != '.'))
+                return false;
 
-        if (index < cnt)
-            return cur->start + index;
+            s++;
+        }
+
+        while ((s < e) && (*s >= '0') && (*s <= '9') && (digits < 3)) {
+            octet = octet * 10 + (*s++ - '0');
+            digits++;
+        }
 
-        index -= cnt;
+        if ((digits == 0) || (octet > 255))
+            return false;
+
+        addr = (addr << 8) | octet;
     }
 
-    assert(1);
-    return 0;
-}
+    if ((s < e) && (*s == '/')) {
+        int digits = 0;
+
+        s++;
+        bits = 0;
+
+        while ((s < e) && (*s >= '0') && (*s <= '9') && (digits < 2)) {
+            bits = bits * 10 + (*s++ - '0');
+            digits++;
+        }
+
+        if ((digits == 0) || (bits > 32))
+            return false;
+    }
+
+    if (s != e)
+        return false;
 
-uint32_t range_list_min(struct range *list) {
-    return range_list_pick(list, 0);
+    uint32_t mask = 0xffffffff00000000ull >> bits;
+
+    *start = addr & mask;
+    *end   = *start | ~mask;
+
+    return true;
 }
 
-size_t range_list_count(struct range *list) {
-    size_t count = 0;
-    struct range *cur;
+static void parse_line(struct range_list *list, const char *s, const char *e) {
+    const char *c = memchr(s, '#', e - s);
+    if (c != NULL)
+        e = c;
+
+    while ((s < e) && ((*s == ' ') || (*s == '\t')))
+        s++;
+
+    while ((e > s) && ((e[-1] == ' ') || (e[-1] == '\t') || (e[-1] == '\r')))
+        e--;
 
-    LL_FOREACH(list, cur) {
-        count += (cur->end - cur->start) + 1;
+    if (s == e)
+        return;
+
+    uint32_t start, end;
+
+    if (parse_cidr(s, e, &start, &end)) {
+        range_list_add(list, start, end);
+        return;
     }
 
-    return count;
+    char spec[256];
+
+    if ((size_t) (e - s) >= sizeof(spec))
+        fail_printf("Invalid address '%.*s...'", 32, s);
+
+    memcpy(spec, s, e - s);
+    spec[e - s] = '\0';
+
+    parse_target(list, spec);
 }
 
-void range_list_add(void *ta, struct range **list, uint32_t start, uint32_t end) {
-    struct range *cur, *tmp;
+/*
+ * Parse all the complete lines in the buffer, and the trailing partial one
+ * too if there's no more input. Returns the number of bytes consumed.
+ */
+static size_t parse_buf(struct range_list *list, const char *buf, size_t len,
+                        bool eof) {
+    const char *p = buf, *end = buf + len;
 
-    LL_FOREACH_SAFE(*list, cur, tmp) {
-        if ((start >= cur->start) && (end <= cur->end))
-            return; /* skip */
+    while (p < end) {
+        const char *nl = memchr(p, '\n', end - p);
 
-        if ((start < cur->start) && (end >= cur->start)) {
-            cur->start = start;
-            return;
-        }
+        if (nl == NULL) {
+            if (!eof)
+                break;
 
-        if ((start < cur->end) && (end >= cur->end)) {
-            cur->end = end;
-            return;
+            nl = end;
         }
+
+        parse_line(list, p, nl);
+
+        p = (nl < end) ? nl + 1 : end;
     }
 
-    struct range *new = malloc(sizeof(*new));
+    return p - buf;
+}
+
+/*
+ * Read one address, prefix or host name per line from the given file, or from
+ * stdin if path is "-". Blank lines and anything following a '#' are ignored.
+ * Regular files are mapped and parsed in place, anything else is read in
+ * chunks.
+ */
+void range_parse_file(struct range_list *list, char *path) {
+    struct stat st;
 
-    new->start = start;
-    new->end   = end;
+    bool is_stdin = (strcmp(path, "-") == 0);
 
-    LL_FOREACH_SAFE(*list, cur, tmp) {
-        if (end < cur->start) {
-            LL_PREPEND_ELEM(*list, cur, new);
-            return;
+    int fd = is_stdin ? STDIN_FILENO : open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        sysf_printf("Error opening '%s'", path);
+
+    if (fstat(fd, &st) < 0)
+        sysf_printf("Error opening '%s'", path);
+
+    if (S_ISREG(st.st_mode) && (st.st_size > 0)) {
+        char *buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (buf == MAP_FAILED)
+            sysf_printf("Error mapping '%s'", path);
+
+        madvise(buf, st.st_size, MADV_SEQUENTIAL);
+
+        parse_buf(list, buf, st.st_size, true);
+
+        munmap(buf, st.st_size);
+    } else {
+        _free_ char *buf = malloc(READ_CHUNK);
+        if (buf == NULL)
+            fail_printf("OOM");
+
+        size_t have = 0;
+
+        while (true) {
+            ssize_t rc = read(fd, buf + have, READ_CHUNK - have);
+            if (rc < 0)
+                sysf_printf("Error reading '%s'", path);
+
+            have += rc;
+
+            size_t used = parse_buf(list, buf, have, rc == 0);
+
+            memmove(buf, buf + used, have - used);
+            have -= used;
+
+            if (rc == 0)
+                break;
+
+            if (have == READ_CHUNK)
+                fail_printf("Line too long in '%s'", path);
         }
     }
 
-    LL_APPEND(*list, new);
+    if (!is_stdin)
+        close(fd);
 }
 
-void range_list_dump(struct range *list) {
-    struct range *cur;
+void range_list_add(struct range_list *list, uint32_t start, uint32_t end) {
+    if (list->cnt == list->size) {
+        size_t size = list->size ? list->size * 2 : 16;
+
+        struct range *ranges = realloc(list->ranges, size * sizeof(*ranges));
+        if (ranges == NULL)
+            fail_printf("OOM");
 
-    LL_FOREACH(list, cur) {
-        ok_printf("[ %u - %u ]", cur->start, cur->end);
+        list->ranges = ranges;
+        list->size   = size;
     }
+
+    list->ranges[list->cnt].start = start;
+    list->ranges[list->cnt].end   = end;
+
+    list->cnt++;
 }
 
-void range_list_free(struct range *list) {
-    struct range *cur, *tmp;
+void range_list_dump(struct range_list *list) {
+    for (size_t i = 0; i < list->cnt; i++)
+        ok_printf("[ %u - %u ]", list->ranges[i].start, list->ranges[i].end);
+}
 
-    LL_FOREACH_SAFE(list, cur, tmp) {
-        LL_DELETE(list, cur);
+void range_list_free(struct range_list *list) {
+    free(list->ranges);
 
-        free(cur);
-    }
+    list->ranges = NULL;
+    list->size   = 0;
+    list->cnt    = 0;
 }
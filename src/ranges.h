@@ -28,21 +28,43 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+/* size of the buffer used when a target file can't be mapped */
+#define READ_CHUNK (1 << 20)
+
 struct range {
     uint32_t start;
     uint32_t end;
+};
+
+/* growable array of possibly overlapping, unsorted ranges */
+struct range_list {
+    size_t cnt;
+    size_t size;
 
-    struct range *next;
+    struct range *ranges;
 };
 
-struct range *range_parse_targets(void *ta, char *spec);
-struct range *range_parse_ports(void *ta, char *spec);
+struct range_set {
+    /* number of disjoint ranges, sorted by start */
+    size_t cnt;
 
-void range_list_free(struct range *list);
+    uint32_t *starts;
+
+    /* index of the first value of each range, and total count at [cnt], or
+     * NULL if every range holds a single value */
+    uint64_t *offs;
+};
 
-void range_list_add(void *ta, struct range **list, uint32_t start, uint32_t end);
+void range_parse_targets(struct range_list *list, char *spec);
+void range_parse_ports(struct range_list *list, char *spec);
+void range_parse_file(struct range_list *list, char *path);
 
-uint32_t range_list_pick(struct range *list, uint32_t index);
-uint32_t range_list_min(struct range *list);
+void range_list_add(struct range_list *list, uint32_t start, uint32_t end);
+void range_list_free(struct range_list *list);
 
-size_t range_list_count(struct range *list);
+void range_set_init(struct range_set *set, struct range_list *list,
+                    struct range_list *exclude);
+uint32_t range_set_pick(const struct range_set *set, uint64_t index);
+uint64_t range_set_count(const struct range_set *set);
+uint64_t range_set_hash(const struct range_set *set);
+void range_set_free(struct range_set *set);
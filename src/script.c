@@ -46,14 +46,80 @@
 
 #include "netdev.h"
 #include "queue.h"
+#include "output.h"
 #include "pkt.h"
 #include "printf.h"
 #include "util.h"
+#include "ranges.h"
 #include "pktizr.h"
 
 static void push_pkt(lua_State *L, enum pkt_type type, struct pkt *p);
 static struct pkt *pop_pkt(lua_State *L, struct pktizr_args *args);
 
+static void push_pkts(lua_State *L, struct pkt *pkt, struct pkt **raw);
+
+/*
+ * Frame passed to recv() in lazy mode. A single frame object, and one layer
+ * object per layer index, are created for each Lua state and reused for all
+ * the received frames.
+ */
+struct script_frame {
+    struct pkt_frame frame;
+
+    /* position in the frame table, see frame_init() */
+    unsigned id;
+
+    /* layers visible to the script (i.e. not Ethernet or ARP) */
+    unsigned count;
+    uint8_t  idx[PKT_FRAME_LAYERS];
+
+    /* whether recv() is running */
+    bool valid;
+};
+
+struct script_layer {
+    struct script_frame *frame;
+    unsigned i;
+};
+
+/*
+ * Per Lua state data, stored in the registry as a light userdata keyed by the
+ * address of script_state_key, see script_state().
+ */
+struct script_state {
+    /* registry references to the script functions, or LUA_NOREF */
+    int loop_ref;
+    int recv_ref;
+    int loop_batch_ref;
+    int recv_batch_ref;
+
+    /* loop_batch() arguments, reused for every call */
+    int addrs_ref;
+    int ports_ref;
+
+    /* recv_batch() frame table, and frame passed to recv() in lazy mode */
+    int frames_ref;
+    int frame_ref;
+
+    unsigned frame_cnt;
+    struct script_frame *frames[NETDEV_BATCH];
+
+    /* transmit loop running loop_batch(), if any */
+    struct pktizr_loop *loop;
+
+    struct pktizr_args *args;
+
+    /* where std.emit() queues records, created on first use */
+    struct output_ring *ring;
+
+    /* whether the script has run, and the "int_addrs" global since then */
+    bool loaded;
+    bool int_addrs;
+};
+
+static void frame_init(lua_State *L, unsigned n);
+static bool frame_set(struct script_frame *f, uint8_t *buf, size_t len);
+
 static int get_ip4(lua_State *L, const char *key, struct ip4_hdr *ip4);
 static int set_ip4(lua_State *L, const char *key, struct ip4_hdr *ip4);
 
@@ -82,14 +148,113 @@ static const luaL_Reg pktizr_libs[] = {
     { NULL,         NULL                    }
 };
 
+/* registry key of the script_state light userdata */
+static const char script_state_key;
+
+static int script_panic(lua_State *L) {
+    const char *err = lua_tostring(L, -1);
+
+    fail_printf("Lua error: %s", err ? err : "unknown error");
+
+    return 0;
+}
+
+static inline struct script_state *script_state(lua_State *L) {
+    struct script_state *st;
+
+    lua_rawgetp(L, LUA_REGISTRYINDEX, &script_state_key);
+    st = lua_touserdata(L, -1);
+    lua_pop(L, 1);
+
+    return st;
+}
+
+/*
+ * Return whether IP addresses are passed to and from the script as integers in
+ * host byte order, instead of dotted strings. The "int_addrs" global is only
+ * looked up again while the script is being run for the first time.
+ */
+static inline bool script_int_addrs(lua_State *L, struct script_state *st) {
+    if (caa_unlikely(!st->loaded)) {
+        bool int_addrs;
+
+        lua_getglobal(L, "int_addrs");
+        int_addrs = lua_toboolean(L, -1);
+        lua_pop(L, 1);
+
+        return int_addrs;
+    }
+
+    return st->int_addrs;
+}
+
+/*
+ * Push the IP address addr (in host byte order) as an integer or a string,
+ * depending on script_int_addrs().
+ */
+static void push_addr(lua_State *L, struct script_state *st, uint32_t addr) {
+    char addr_str[INET_ADDRSTRLEN];
+
+    if (script_int_addrs(L, st)) {
+        lua_pushinteger(L, addr);
+        return;
+    }
+
+    addr = htonl(addr);
+    inet_ntop(AF_INET, &addr, addr_str, sizeof(addr_str));
+
+    lua_pushstring(L, addr_str);
+}
+
+/*
+ * Parse the IP address at the given stack index, either an integer in host
+ * byte order or a dotted string, into addr (in network byte order).
+ */
+static bool to_addr(lua_State *L, int idx, uint32_t *addr) {
+    if (lua_type(L, idx) == LUA_TNUMBER) {
+        *addr = htonl((uint32_t) lua_tointeger(L, idx));
+        return true;
+    }
+
+    if (lua_type(L, idx) != LUA_TSTRING)
+        return false;
+
+    return inet_aton(lua_tostring(L, idx), (struct in_addr *) addr);
+}
+
+/*
+ * Return a registry reference to the global function called name, or
+ * LUA_NOREF if the script doesn't define it.
+ */
+static int script_ref(lua_State *L, const char *name) {
+    lua_getglobal(L, name);
+
+    if (!lua_isfunction(L, -1)) {
+        lua_pop(L, 1);
+        return LUA_NOREF;
+    }
+
+    return luaL_ref(L, LUA_REGISTRYINDEX);
+}
 
 void *script_load(struct pktizr_args *args) {
     int rc;
 
+    struct script_state *st = calloc(1, sizeof(*st));
+    if (st == NULL)
+        fail_printf("OOM");
+
+    st->args = args;
+
     lua_State *L = luaL_newstate();
     if (L == NULL)
         fail_printf("Error creating Lua state");
 
+    lua_atpanic(L, script_panic);
+
+    lua_pushlightuserdata(L, st);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, &script_state_key);
+
     luaL_openlibs(L);
 
     for (int i = 0; pktizr_libs[i].name; i++) {
@@ -97,9 +262,6 @@ void *script_load(struct pktizr_args *args) {
         lua_pop(L, 1);
     }
 
-    lua_pushlightuserdata(L, args);
-    lua_setfield(L, LUA_REGISTRYINDEX, "args");
-
     assert(lua_gettop(L) == 0);
 
     rc = luaL_loadfile(L, args->script);
@@ -120,33 +282,157 @@ void *script_load(struct pktizr_args *args) {
         fail_printf("Error running script: %s", err);
     }
 
+    st->int_addrs = script_int_addrs(L, st);
+    st->loaded    = true;
+
+    /* the callbacks are looked up only once, after the script has run */
+    st->loop_ref       = script_ref(L, "loop");
+    st->recv_ref       = script_ref(L, "recv");
+    st->loop_batch_ref = script_ref(L, "loop_batch");
+    st->recv_batch_ref = script_ref(L, "recv_batch");
+
+    if (st->loop_batch_ref != LUA_NOREF) {
+        lua_createtable(L, NETDEV_BATCH, 0);
+        st->addrs_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+        lua_createtable(L, NETDEV_BATCH, 0);
+        st->ports_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+
+    frame_init(L, (st->recv_batch_ref != LUA_NOREF) ? NETDEV_BATCH : 1);
+
     assert(lua_gettop(L) == 0);
 
     return L;
 }
 
+/*
+ * Return the probe template registered by the script with pkt.template(), or
+ * NULL if none.
+ */
+struct pkt_template *script_template(void *L) {
+    struct pkt_template *t;
+
+    lua_getfield(L, LUA_REGISTRYINDEX, "template");
+    t = lua_touserdata(L, -1);
+    lua_pop(L, 1);
+
+    return t;
+}
+
 void script_close(void *L) {
+    struct script_state *st = script_state(L);
+
+    pkt_template_free(script_template(L));
+
     lua_close(L);
+
+    free(st);
+}
+
+/*
+ * Return a copy of the capture filter expression declared by the script in the
+ * "filter" global variable, or NULL if none.
+ */
+char *script_filter(void *L) {
+    char *filter = NULL;
+
+    lua_getglobal(L, "filter");
+
+    if (lua_type(L, -1) == LUA_TSTRING)
+        filter = strdup(lua_tostring(L, -1));
+    else if (!lua_isnil(L, -1))
+        fail_printf("Invalid script filter: string expected");
+
+    lua_pop(L, 1);
+
+    return filter;
+}
+
+/*
+ * Fill in the reply validator declared by the script in the "validate" global
+ * variable, e.g. { proto = "icmp", port = 64434 }.
+ */
+void script_validator(void *L, struct pktizr_args *args,
+                      struct pkt_validator *v) {
+    const char *proto;
+
+    v->type = VALIDATE_NONE;
+    v->port = 0;
+    v->seed = args->seed;
+
+    lua_getglobal(L, "validate");
+
+    if (lua_isnil(L, -1))
+        goto done;
+
+    if (!lua_istable(L, -1))
+        fail_printf("Invalid script validator: table expected");
+
+    lua_getfield(L, -1, "proto");
+    proto = lua_tostring(L, -1);
+
+    if (proto && !strcmp(proto, "tcp"))
+        v->type = VALIDATE_TCP;
+    else if (proto && !strcmp(proto, "icmp"))
+        v->type = VALIDATE_ICMP;
+    else
+        fail_printf("Invalid script validator protocol");
+
+    lua_pop(L, 1);
+
+    lua_getfield(L, -1, "port");
+    v->port = (uint16_t) lua_tointeger(L, -1);
+    lua_pop(L, 1);
+
+done:
+    lua_pop(L, 1);
+}
+
+/*
+ * Return whether the script asked for lazily decoded frames, by setting the
+ * "lazy" global variable, see script_recv_frame().
+ */
+bool script_lazy(void *L) {
+    bool lazy;
+
+    lua_getglobal(L, "lazy");
+    lazy = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+
+    return lazy;
+}
+
+/*
+ * Return whether the script defines loop_batch(), see script_loop_batch().
+ */
+bool script_has_loop_batch(void *L) {
+    return script_state(L)->loop_batch_ref != LUA_NOREF;
+}
+
+/*
+ * Return whether the script defines recv_batch(), see script_recv_batch().
+ */
+bool script_has_recv_batch(void *L) {
+    return script_state(L)->recv_batch_ref != LUA_NOREF;
 }
 
 int script_loop(void *L, struct pktizr_args *args, struct pkt **pkt,
                 uint32_t daddr, uint16_t dport) {
     int rc;
 
-    char dst_addr[INET_ADDRSTRLEN];
-    daddr = htonl(daddr);
-    inet_ntop(AF_INET, &daddr, dst_addr, sizeof(dst_addr));
+    struct script_state *st = script_state(L);
 
     assert(lua_gettop(L) == 0);
 
     luaL_checkstack(L, 1, "OOM");
-    lua_getglobal(L, "loop");
+    lua_rawgeti(L, LUA_REGISTRYINDEX, st->loop_ref);
 
     if (caa_unlikely(lua_isnil(L, -1)))
         goto error;
 
     luaL_checkstack(L, 1, "OOM");
-    lua_pushstring(L, dst_addr);
+    push_addr(L, st, daddr);
 
     luaL_checkstack(L, 1, "OOM");
     lua_pushinteger(L, dport);
@@ -174,46 +460,134 @@ error:
     return -1;
 }
 
+/*
+ * Call loop_batch(addrs, ports, n) for n targets at once. The script sends the
+ * probes with pkt.send(), which packs them straight into the transmit batch of
+ * the calling loop thread while loop_batch() runs.
+ */
+int script_loop_batch(void *L, struct pktizr_loop *loop,
+                      const uint32_t *daddrs, const uint16_t *dports,
+                      size_t n) {
+    int rc;
+
+    struct script_state *st = script_state(L);
+
+    assert(lua_gettop(L) == 0);
+
+    luaL_checkstack(L, 4, "OOM");
+    lua_rawgeti(L, LUA_REGISTRYINDEX, st->loop_batch_ref);
+
+    if (caa_unlikely(lua_isnil(L, -1)))
+        goto error;
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, st->addrs_ref);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, st->ports_ref);
+
+    for (size_t i = 0; i < n; i++) {
+        push_addr(L, st, daddrs[i]);
+        lua_rawseti(L, -3, i + 1);
+
+        lua_pushinteger(L, dports[i]);
+        lua_rawseti(L, -2, i + 1);
+    }
+
+    lua_pushinteger(L, n);
+
+    st->loop = loop;
+
+    rc = lua_pcall(L, 3, 0, 0);
+
+    st->loop = NULL;
+
+    if (caa_unlikely(rc != 0)) {
+        const char *err = "unknown error";
+        if (lua_type(L, -1) == LUA_TSTRING)
+            err = lua_tostring(L, -1);
+
+        fail_printf("Error running script: %s", err);
+    }
+
+    assert(lua_gettop(L) == 0);
+
+    return 0;
+
+error:
+    lua_settop(L, 0);
+    return -1;
+}
+
 int script_recv(void *L, struct pktizr_args *args, struct pkt *pkt) {
-    int rc, n = 1;
+    int rc;
 
-    struct pkt *cur, *tmp;
+    struct pkt *raw = NULL;
 
     assert(lua_gettop(L) == 0);
 
     luaL_checkstack(L, 1, "OOM");
-    lua_getglobal(L, "recv");
+    lua_rawgeti(L, LUA_REGISTRYINDEX, script_state(L)->recv_ref);
 
     if (lua_isnil(L, -1))
         goto error;
 
-    luaL_checkstack(L, 1, "OOM");
-    lua_newtable(L);
+    push_pkts(L, pkt, &raw);
 
-    DL_FOREACH_SAFE(pkt, cur, tmp) {
-        luaL_checkstack(L, 1, "OOM");
+    assert(lua_gettop(L) == 2);
 
-        switch (cur->type) {
-        case TYPE_ETH:
-        case TYPE_ARP:
-            DL_DELETE(pkt, cur);
-            pkt_free(cur);
-            break;
+    rc = lua_pcall(L, 1, 1, 0);
+    if (rc != 0) {
+        const char *err = "unknown error";
+        if (lua_type(L, -1) == LUA_TSTRING)
+            err = lua_tostring(L, -1);
 
-        case TYPE_IP4:
-        case TYPE_ICMP:
-        case TYPE_UDP:
-        case TYPE_TCP:
-        case TYPE_RAW:
-            push_pkt(L, cur->type, cur);
-            lua_rawseti(L, -2, n++);
-            break;
-        }
+        fail_printf("Error running script: %s", err);
     }
 
-    assert(lua_gettop(L) == 2);
+    /* the frame is about to be released, see pop_pkt() for sent packets */
+    if (raw) {
+        pkt_raw_expire(raw);
+        pkt_free(raw);
+    }
+
+    int status = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+
+    assert(lua_gettop(L) == 0);
+
+    return (status ? 0 : -1);
+
+error:
+    lua_settop(L, 0);
+    return -1;
+}
+
+/*
+ * Same as script_recv(), but recv() gets a frame object whose fields are only
+ * decoded when read, instead of a table of unpacked layers.
+ */
+int script_recv_frame(void *L, struct pktizr_args *args,
+                      uint8_t *buf, size_t len) {
+    int rc;
+
+    struct script_state *st = script_state(L);
+    struct script_frame *f  = st->frames[0];
+
+    assert(lua_gettop(L) == 0);
+
+    luaL_checkstack(L, 2, "OOM");
+    lua_rawgeti(L, LUA_REGISTRYINDEX, st->recv_ref);
+
+    if (lua_isnil(L, -1))
+        goto error;
+
+    if (!frame_set(f, buf, len))
+        goto error;
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, st->frame_ref);
 
     rc = lua_pcall(L, 1, 1, 0);
+
+    f->valid = false;
+
     if (rc != 0) {
         const char *err = "unknown error";
         if (lua_type(L, -1) == LUA_TSTRING)
@@ -234,6 +608,64 @@ error:
     return -1;
 }
 
+/*
+ * Call recv_batch(frames, n) for up to NETDEV_BATCH received frames at once,
+ * with frames[1] to frames[n] set as in lazy mode (see script_recv_frame()).
+ * Returns the number of replies accepted by the script.
+ */
+int script_recv_batch(void *L, struct pktizr_args *args,
+                      uint8_t **bufs, const int *lens, size_t n) {
+    int rc;
+
+    unsigned cnt = 0;
+    lua_Integer accepted;
+
+    struct script_state *st = script_state(L);
+
+    assert(lua_gettop(L) == 0);
+
+    luaL_checkstack(L, 3, "OOM");
+    lua_rawgeti(L, LUA_REGISTRYINDEX, st->recv_batch_ref);
+
+    if (lua_isnil(L, -1))
+        goto error;
+
+    for (size_t i = 0; (i < n) && (cnt < st->frame_cnt); i++) {
+        if (frame_set(st->frames[cnt], bufs[i], lens[i]))
+            cnt++;
+    }
+
+    if (cnt == 0)
+        goto error;
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, st->frames_ref);
+    lua_pushinteger(L, cnt);
+
+    rc = lua_pcall(L, 2, 1, 0);
+
+    for (unsigned i = 0; i < cnt; i++)
+        st->frames[i]->valid = false;
+
+    if (rc != 0) {
+        const char *err = "unknown error";
+        if (lua_type(L, -1) == LUA_TSTRING)
+            err = lua_tostring(L, -1);
+
+        fail_printf("Error running script: %s", err);
+    }
+
+    accepted = lua_tointeger(L, -1);
+    lua_pop(L, 1);
+
+    assert(lua_gettop(L) == 0);
+
+    return (accepted > 0) ? accepted : 0;
+
+error:
+    lua_settop(L, 0);
+    return 0;
+}
+
 static int pktizr_IP(lua_State *L) {
     if (lua_gettop(L) != 0)
         luaL_error(L, "Invalid argument");
@@ -301,10 +733,10 @@ static int pktizr_get_time(lua_State *L) {
 }
 
 static uint64_t pktizr_cookie(lua_State *L) {
-    struct pktizr_args *args;
+    struct pktizr_args *args = script_state(L)->args;
 
     uint16_t dport, sport;
-    struct in_addr daddr, saddr;
+    uint32_t daddr, saddr;
 
     if (lua_gettop(L) != 4)
         luaL_error(L, "Invalid number of arguments");
@@ -318,7 +750,7 @@ static uint64_t pktizr_cookie(lua_State *L) {
     if (lua_isnil(L, -1))
         luaL_error(L, "Invalid argument 'daddr': nil value");
 
-    if (!inet_aton(lua_tostring(L, -1), &daddr))
+    if (!to_addr(L, -1, &daddr))
         luaL_error(L, "Invalid argument 'daddr': not an IP address");
 
     lua_pop(L, 1);
@@ -326,15 +758,12 @@ static uint64_t pktizr_cookie(lua_State *L) {
     if (lua_isnil(L, -1))
         luaL_error(L, "Invalid argument 'saddr': nil value");
 
-    if (!inet_aton(lua_tostring(L, -1), &saddr))
+    if (!to_addr(L, -1, &saddr))
         luaL_error(L, "Invalid argument 'saddr': not an IP address");
 
     lua_pop(L, 1);
 
-    lua_getfield(L, LUA_REGISTRYINDEX, "args");
-    args = lua_touserdata(L, -1);
-
-    return pkt_cookie(saddr.s_addr, daddr.s_addr, sport, dport, args->seed);
+    return pkt_cookie(saddr, daddr, sport, dport, args->seed);
 }
 
 static int pktizr_cookie16(lua_State *L) {
@@ -352,18 +781,9 @@ static int pktizr_cookie32(lua_State *L) {
 }
 
 static int pktizr_get_addr(lua_State *L) {
-    struct pktizr_args *args;
-
-    char local_addr_str[INET_ADDRSTRLEN];
-    uint32_t laddr;
-
-    lua_getfield(L, LUA_REGISTRYINDEX, "args");
-    args = lua_touserdata(L, -1);
+    struct script_state *st = script_state(L);
 
-    laddr = htonl(args->local_addr);
-    inet_ntop(AF_INET, &laddr, local_addr_str, sizeof(local_addr_str));
-
-    lua_pushstring(L, local_addr_str);
+    push_addr(L, st, st->args->local_addr);
 
     return 1;
 
@@ -381,29 +801,244 @@ static int pktizr_print(lua_State *L) {
     return 0;
 }
 
+/* maximum number of fields in a record passed to std.emit() */
+#define EMIT_FIELDS 64
+
+struct emit_field {
+    const char *key;
+    size_t klen;
+
+    int type;
+    bool integer;
+
+    union {
+        lua_Integer i;
+        lua_Number  n;
+        bool        b;
+        const char *s;
+    } v;
+
+    size_t slen;
+};
+
+static int emit_cmp(const struct emit_field *a, const struct emit_field *b) {
+    size_t len = (a->klen < b->klen) ? a->klen : b->klen;
+
+    int rc = memcmp(a->key, b->key, len);
+    if (rc != 0)
+        return rc;
+
+    return (a->klen > b->klen) - (a->klen < b->klen);
+}
+
+/*
+ * Queue a record for the output thread. Fields are sorted by name, so that
+ * records with the same fields always have them in the same order.
+ */
+static int pktizr_emit(lua_State *L) {
+    struct script_state *st = script_state(L);
+
+    struct emit_field fields[EMIT_FIELDS];
+    size_t cnt = 0;
+
+    struct output_rec rec;
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+
+    lua_settop(L, 1);
+    lua_pushnil(L);
+
+    while (lua_next(L, 1) != 0) {
+        struct emit_field *f = &fields[cnt];
+
+        if (lua_type(L, -2) != LUA_TSTRING)
+            luaL_error(L, "Invalid record field name");
+
+        if (cnt == EMIT_FIELDS)
+            luaL_error(L, "Too many record fields");
+
+        f->key  = lua_tolstring(L, -2, &f->klen);
+        f->type = lua_type(L, -1);
+
+        switch (f->type) {
+        case LUA_TNUMBER:
+            f->integer = lua_isinteger(L, -1);
+
+            if (f->integer)
+                f->v.i = lua_tointeger(L, -1);
+            else
+                f->v.n = lua_tonumber(L, -1);
+            break;
+
+        case LUA_TBOOLEAN:
+            f->v.b = lua_toboolean(L, -1);
+            break;
+
+        case LUA_TSTRING:
+            f->v.s = lua_tolstring(L, -1, &f->slen);
+            break;
+
+        default:
+            luaL_error(L, "Invalid value for record field '%s'", f->key);
+        }
+
+        cnt++;
+
+        lua_pop(L, 1);
+    }
+
+    for (size_t i = 1; i < cnt; i++) {
+        struct emit_field f = fields[i];
+        size_t j = i;
+
+        for (; (j > 0) && (emit_cmp(&fields[j - 1], &f) > 0); j--)
+            fields[j] = fields[j - 1];
+
+        fields[j] = f;
+    }
+
+    output_rec_init(&rec);
+
+    for (size_t i = 0; i < cnt; i++) {
+        struct emit_field *f = &fields[i];
+
+        switch (f->type) {
+        case LUA_TNUMBER:
+            if (f->integer)
+                output_rec_int(&rec, f->key, f->klen, f->v.i);
+            else
+                output_rec_num(&rec, f->key, f->klen, f->v.n);
+            break;
+
+        case LUA_TBOOLEAN:
+            output_rec_bool(&rec, f->key, f->klen, f->v.b);
+            break;
+
+        case LUA_TSTRING:
+            output_rec_str(&rec, f->key, f->klen, f->v.s, f->slen);
+            break;
+        }
+    }
+
+    if (st->ring == NULL)
+        st->ring = output_ring_new(&st->args->output);
+
+    lua_pushboolean(L, output_push(st->ring, &rec));
+
+    return 1;
+}
+
 static int pktizr_send(lua_State *L) {
-    struct pktizr_args *args = NULL;
+    struct script_state *st = script_state(L);
 
-    lua_getfield(L, LUA_REGISTRYINDEX, "args");
-    args = lua_touserdata(L, -1);
-    lua_pop(L, 1);
+    struct pktizr_args *args = st->args;
 
     struct pkt *pkt = pop_pkt(L, args);
     assert(lua_gettop(L) == 0);
 
-    queue_enqueue(&args->queue, &pkt->queue);
+    struct pktizr_loop *loop = st->loop;
+
+    /* probes sent by loop_batch() go out with the thread's own batch */
+    if (loop) {
+        pkt_send(loop, pkt);
+        pkt_free_all(pkt);
+    } else {
+        queue_enqueue(&args->queue, &pkt->queue);
+    }
 
     lua_pushboolean(L, 1);
 
     return 1;
 }
 
+static const struct {
+    const char *name;
+    enum pkt_template_cookie cookie;
+} template_cookies[] = {
+    { "ip.id",    COOKIE_IP_ID    },
+    { "icmp.id",  COOKIE_ICMP_ID  },
+    { "icmp.seq", COOKIE_ICMP_SEQ },
+    { "tcp.seq",  COOKIE_TCP_SEQ  },
+    { "sport",    COOKIE_SPORT    },
+};
+
+static int pktizr_template(lua_State *L) {
+    struct pktizr_args *args;
+
+    int flags = 0;
+    uint16_t port = 0;
+    enum pkt_template_cookie cookie = COOKIE_NONE;
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+    luaL_checktype(L, 2, LUA_TTABLE);
+
+    lua_getfield(L, 2, "dst");
+    if (lua_toboolean(L, -1))
+        flags |= TEMPLATE_DST;
+    lua_pop(L, 1);
+
+    lua_getfield(L, 2, "dport");
+    if (lua_toboolean(L, -1))
+        flags |= TEMPLATE_DPORT;
+    lua_pop(L, 1);
+
+    lua_getfield(L, 2, "port");
+    port = (uint16_t) lua_tointeger(L, -1);
+    lua_pop(L, 1);
+
+    lua_getfield(L, 2, "cookie");
+    if (!lua_isnil(L, -1)) {
+        const char *name = luaL_checkstring(L, -1);
+        size_t i, n = sizeof(template_cookies) / sizeof(*template_cookies);
+
+        for (i = 0; i < n; i++) {
+            if (!strcmp(template_cookies[i].name, name))
+                break;
+        }
+
+        if (i == n)
+            luaL_error(L, "Invalid template cookie '%s'", name);
+
+        cookie = template_cookies[i].cookie;
+    }
+    lua_pop(L, 1);
+
+    args = script_state(L)->args;
+
+    /* leave only the packet layers on the stack, as returned by loop() */
+    lua_settop(L, 1);
+
+    for (size_t i = 1; i <= lua_rawlen(L, 1); i++) {
+        luaL_checkstack(L, 1, "OOM");
+        lua_rawgeti(L, 1, i);
+    }
+
+    lua_remove(L, 1);
+
+    struct pkt *pkt = pop_pkt(L, args);
+
+    struct pkt_template *t = pkt_template_new(pkt, flags, cookie, port,
+                                              args->seed);
+    pkt_free_all(pkt);
+
+    if (t == NULL)
+        luaL_error(L, "Invalid template");
+
+    pkt_template_free(script_template(L));
+
+    lua_pushlightuserdata(L, t);
+    lua_setfield(L, LUA_REGISTRYINDEX, "template");
+
+    return 0;
+}
+
 static int pktizr_pkt_gc(lua_State* L) {
     void *u = lua_touserdata(L, -1);
 
     if (u == NULL)
         return 0;
 
+    /* back to the pool of the thread that allocated it, see pkt_free() */
     struct pkt *p = *(struct pkt **) u;
     pkt_free(p);
 
@@ -439,10 +1074,7 @@ static int pktizr_pkt_newindex(lua_State* L) {
     return 0;
 }
 
-static int pktizr_pkt_index(lua_State* L) {
-    struct pkt *p   = *(struct pkt **) lua_touserdata(L, -2);
-    const char *key = lua_tostring(L, -1);
-
+static int index_pkt(lua_State *L, struct pkt *p, const char *key) {
     if (!strncmp("_type", key, sizeof("_type"))) {
         switch (p->type) {
         case TYPE_IP4:
@@ -487,6 +1119,178 @@ static int pktizr_pkt_index(lua_State* L) {
     return 0;
 }
 
+static int pktizr_pkt_index(lua_State* L) {
+    struct pkt *p   = *(struct pkt **) lua_touserdata(L, -2);
+    const char *key = lua_tostring(L, -1);
+
+    return index_pkt(L, p, key);
+}
+
+static int pktizr_frame_unpack(lua_State *L) {
+    struct script_frame *f = luaL_checkudata(L, 1, "pktizr.frame");
+
+    struct pkt *pkt = NULL, *raw = NULL;
+
+    if (!f->valid)
+        return luaL_error(L, "Frame only available during recv()");
+
+    if (!pkt_unpack(f->frame.buf, f->frame.len, &pkt)) {
+        lua_newtable(L);
+        return 1;
+    }
+
+    push_pkts(L, pkt, &raw);
+
+    /* unlike the frame, the unpacked layers can be kept after recv() */
+    if (raw) {
+        pkt_raw_own(raw);
+        pkt_free(raw);
+    }
+
+    return 1;
+}
+
+static int pktizr_frame_index(lua_State *L) {
+    struct script_frame *f = lua_touserdata(L, 1);
+
+    if (lua_type(L, 2) == LUA_TNUMBER) {
+        lua_Integer i = lua_tointeger(L, 2);
+
+        if (!f->valid || (i < 1) || (i > f->count))
+            return 0;
+
+        /* layer objects are kept in the upvalue table, see frame_init() */
+        lua_rawgeti(L, lua_upvalueindex(1), f->id * PKT_FRAME_LAYERS + i);
+        return 1;
+    }
+
+    const char *key = luaL_checkstring(L, 2);
+
+    if (!strcmp(key, "unpack")) {
+        lua_pushcfunction(L, pktizr_frame_unpack);
+        return 1;
+    }
+
+    return luaL_error(L, "Invalid field '%s'", key);
+}
+
+static int pktizr_frame_len(lua_State *L) {
+    struct script_frame *f = lua_touserdata(L, 1);
+
+    lua_pushinteger(L, f->valid ? f->count : 0);
+    return 1;
+}
+
+static int pktizr_layer_index(lua_State *L) {
+    struct script_layer *l = lua_touserdata(L, 1);
+    struct script_frame *f = l->frame;
+
+    const char *key = luaL_checkstring(L, 2);
+
+    struct pkt p;
+
+    if (!f->valid || (l->i >= f->count))
+        return luaL_error(L, "Frame only available during recv()");
+
+    if (pkt_frame_layer(&f->frame, f->idx[l->i], &p) < 0)
+        return 0;
+
+    return index_pkt(L, &p, key);
+}
+
+static int pktizr_layer_newindex(lua_State *L) {
+    return luaL_error(L, "Frame layers are read-only, see frame:unpack()");
+}
+
+/*
+ * Create the n frame objects used in lazy mode and by recv_batch(), and their
+ * layer objects. All the layer objects are kept in a single table, which is an
+ * upvalue of the frames' __index metamethod.
+ */
+static void frame_init(lua_State *L, unsigned n) {
+    struct script_state *st = script_state(L);
+
+    luaL_Reg const layer_meta[] = {
+        { "__index",    pktizr_layer_index    },
+        { "__newindex", pktizr_layer_newindex },
+        { NULL,         NULL                  }
+    };
+
+    luaL_checkstack(L, 5, "OOM");
+
+    luaL_newmetatable(L, "pktizr.layer");
+    luaL_setfuncs(L, layer_meta, 0);
+    lua_pop(L, 1);
+
+    lua_createtable(L, n * PKT_FRAME_LAYERS, 0);
+
+    luaL_newmetatable(L, "pktizr.frame");
+
+    lua_pushvalue(L, -2);
+    lua_pushcclosure(L, pktizr_frame_index, 1);
+    lua_setfield(L, -2, "__index");
+
+    lua_pushcfunction(L, pktizr_frame_len);
+    lua_setfield(L, -2, "__len");
+
+    lua_pop(L, 1);
+
+    lua_createtable(L, n, 0);
+
+    for (unsigned i = 0; i < n; i++) {
+        struct script_frame *f = lua_newuserdata(L, sizeof(*f));
+
+        memset(f, 0, sizeof(*f));
+        f->id = i;
+
+        luaL_setmetatable(L, "pktizr.frame");
+        lua_rawseti(L, -2, i + 1);
+
+        for (unsigned j = 0; j < PKT_FRAME_LAYERS; j++) {
+            struct script_layer *l = lua_newuserdata(L, sizeof(*l));
+
+            l->frame = f;
+            l->i     = j;
+
+            luaL_setmetatable(L, "pktizr.layer");
+            lua_rawseti(L, -3, i * PKT_FRAME_LAYERS + j + 1);
+        }
+
+        st->frames[i] = f;
+    }
+
+    st->frame_cnt = n;
+
+    lua_rawgeti(L, -1, 1);
+    st->frame_ref  = luaL_ref(L, LUA_REGISTRYINDEX);
+    st->frames_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+    lua_pop(L, 1);
+}
+
+/*
+ * Point f at a received frame, and make it valid until the Lua callback
+ * returns. Returns false if the frame is malformed.
+ */
+static bool frame_set(struct script_frame *f, uint8_t *buf, size_t len) {
+    struct pkt_frame *frame = &f->frame;
+
+    if (!pkt_frame_parse(frame, buf, len))
+        return false;
+
+    f->count = 0;
+
+    for (unsigned i = 0; i < frame->count; i++) {
+        if ((frame->layers[i].type != TYPE_ETH) &&
+            (frame->layers[i].type != TYPE_ARP))
+            f->idx[f->count++] = i;
+    }
+
+    f->valid = true;
+
+    return true;
+}
+
 LUALIB_API int luaopen_pkt(lua_State *L) {
     luaL_Reg const funcs[] = {
         { "IP",       pktizr_IP       },
@@ -497,6 +1301,7 @@ LUALIB_API int luaopen_pkt(lua_State *L) {
         { "cookie16", pktizr_cookie16 },
         { "cookie32", pktizr_cookie32 },
         { "send",     pktizr_send     },
+        { "template", pktizr_template },
         { NULL,       NULL            }
     };
 
@@ -521,6 +1326,7 @@ LUALIB_API int luaopen_std(lua_State *L) {
         { "get_time", pktizr_get_time },
         { "get_addr", pktizr_get_addr },
         { "print",    pktizr_print    },
+        { "emit",     pktizr_emit     },
         { NULL,       NULL            }
     };
 
@@ -538,9 +1344,18 @@ static struct pkt *pop_pkt(lua_State *L, struct pktizr_args *args) {
             luaL_error(L, "Invalid packet type");
 
         p = *(struct pkt **) lua_touserdata(L, -1);
+
+        if ((p->type == TYPE_RAW) && p->p.raw.view &&
+            (p->p.raw.payload == NULL))
+            luaL_error(L, "Payload only available during recv()");
+
         DL_APPEND(pkt, p);
 
-        p->refcnt++;
+        uatomic_inc(&p->refcnt);
+
+        /* received payloads can outlive their frame once sent */
+        if (p->type == TYPE_RAW)
+            pkt_raw_own(p);
 
         lua_pop(L, 1);
     }
@@ -553,6 +1368,48 @@ static struct pkt *pop_pkt(lua_State *L, struct pktizr_args *args) {
     return pkt;
 }
 
+/*
+ * Push a table of the layers of a received packet, as passed to recv(). The
+ * Ethernet and ARP layers are freed, and a reference is taken on the raw layer
+ * (returned in raw, if any) to keep its payload view alive.
+ */
+static void push_pkts(lua_State *L, struct pkt *pkt, struct pkt **raw) {
+    int n = 1;
+
+    struct pkt *cur, *tmp;
+
+    luaL_checkstack(L, 1, "OOM");
+    lua_newtable(L);
+
+    DL_FOREACH_SAFE(pkt, cur, tmp) {
+        luaL_checkstack(L, 1, "OOM");
+
+        switch (cur->type) {
+        case TYPE_ETH:
+        case TYPE_ARP:
+            DL_DELETE(pkt, cur);
+            pkt_free(cur);
+            break;
+
+        case TYPE_IP4:
+        case TYPE_ICMP:
+        case TYPE_UDP:
+        case TYPE_TCP:
+            push_pkt(L, cur->type, cur);
+            lua_rawseti(L, -2, n++);
+            break;
+
+        case TYPE_RAW:
+            *raw = cur;
+            uatomic_inc(&cur->refcnt);
+
+            push_pkt(L, cur->type, cur);
+            lua_rawseti(L, -2, n++);
+            break;
+        }
+    }
+}
+
 static void push_pkt(lua_State *L, enum pkt_type type, struct pkt *p) {
     struct pkt **pkt = lua_newuserdata(L, sizeof(*pkt));
 
@@ -619,16 +1476,12 @@ static int get_ip4(lua_State *L, const char *key, struct ip4_hdr *ip4) {
     }
 
     if (MATCH_KEY("src", key)) {
-        struct in_addr saddr = { .s_addr = ip4->src };
-
-        lua_pushstring(L, inet_ntoa(saddr));
+        push_addr(L, script_state(L), ntohl(ip4->src));
         goto done;
     }
 
     if (MATCH_KEY("dst", key)) {
-        struct in_addr daddr = { .s_addr = ip4->dst };
-
-        lua_pushstring(L, inet_ntoa(daddr));
+        push_addr(L, script_state(L), ntohl(ip4->dst));
         goto done;
     }
 
@@ -685,12 +1538,12 @@ static int set_ip4(lua_State *L, const char *key, struct ip4_hdr *ip4) {
     }
 
     if (MATCH_KEY_TYPE("src", key, string)) {
-        inet_aton(lua_tostring(L, -1), (struct in_addr *) &ip4->src);
+        to_addr(L, -1, &ip4->src);
         goto done;
     }
 
     if (MATCH_KEY_TYPE("dst", key, string)) {
-        inet_aton(lua_tostring(L, -1), (struct in_addr *) &ip4->dst);
+        to_addr(L, -1, &ip4->dst);
         goto done;
     }
 
@@ -1012,6 +1865,9 @@ static int get_raw(lua_State *L, const char *key, struct raw_hdr *raw) {
     luaL_checkstack(L, 1, "OOM");
 
     if (MATCH_KEY("payload", key)) {
+        if (raw->view && raw->payload == NULL)
+            return luaL_error(L, "Payload only available during recv()");
+
         lua_pushlstring(L, (const char *) raw->payload, raw->len);
         goto done;
     }
@@ -1026,10 +1882,11 @@ static int set_raw(lua_State *L, const char *key, struct raw_hdr *raw) {
     if (MATCH_KEY_TYPE("payload", key, string)) {
         const char *payload = lua_tolstring(L, -1, &raw->len);
 
-        if (raw->payload)
+        if (raw->payload && !raw->view)
             free(raw->payload);
 
         raw->payload = malloc(raw->len);
+        raw->view    = false;
         memcpy(raw->payload, payload, raw->len);
 
         goto done;
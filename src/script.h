@@ -31,6 +31,24 @@
 void *script_load(struct pktizr_args *args);
 void script_close(void *L);
 
+struct pkt_template *script_template(void *L);
+
+char *script_filter(void *L);
+void script_validator(void *L, struct pktizr_args *args,
+                      struct pkt_validator *v);
+
 int script_loop(void *L, struct pktizr_args *args, struct pkt **pkt,
                 uint32_t addr, uint16_t port);
 int script_recv(void *L, struct pktizr_args *args, struct pkt *pkt);
+
+bool script_lazy(void *L);
+int script_recv_frame(void *L, struct pktizr_args *args,
+                      uint8_t *buf, size_t len);
+
+bool script_has_loop_batch(void *L);
+bool script_has_recv_batch(void *L);
+int script_loop_batch(void *L, struct pktizr_loop *loop,
+                      const uint32_t *daddrs, const uint16_t *dports,
+                      size_t n);
+int script_recv_batch(void *L, struct pktizr_args *args,
+                      uint8_t **bufs, const int *lens, size_t n);
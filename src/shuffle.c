@@ -32,31 +32,48 @@
  * Generalized-Feistel Cipher implementation as described in the paper
  * "Ciphers with Arbitrary Finite Domains" by John Black and Phillip Rogaway
  * http://www.cs.ucdavis.edu/~rogaway/papers/subset.pdf
+ *
+ * Alternatively, the indexes can be mapped through the multiplicative group of
+ * the integers modulo a prime p just above the range, as done by ZMap (see
+ * "ZMap: Fast Internet-Wide Scanning and its Security Applications"): index m
+ * is mapped to x0 * g^m mod p, where the generator g and the offset x0 are
+ * chosen from the seed. Consecutive indexes then only cost one multiplication
+ * modulo p each. Indexes mapped past the range are cycle-walked like with the
+ * Feistel cipher, which is rarely needed since p is close to the range.
  */
 
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <math.h>
 
 #include "hash.h"
+#include "fastdiv.h"
 #include "shuffle.h"
 
 #define ROUNDS 4
 
-static inline uint64_t do_shuffle(unsigned r, uint64_t a, uint64_t b,
-                                  uint64_t m, uint64_t seed);
+/* number of indexes permuted side by side by shuffle_batch() */
+#define LANES  4
+
+static inline uint64_t do_shuffle(const struct shuffle *r, uint64_t m);
+static inline uint64_t do_unshuffle(const struct shuffle *r, uint64_t m);
 
-static inline uint64_t do_unshuffle(unsigned r, uint64_t a, uint64_t b,
-                                    uint64_t m, uint64_t seed);
+static void cyclic_init(struct shuffle *r);
+static inline uint64_t cyclic_mul(const struct shuffle *r, uint64_t x,
+                                  uint64_t y);
+static inline uint64_t cyclic_pow(const struct shuffle *r, uint64_t x,
+                                  uint64_t e);
 
-void shuffle_init(struct shuffle *r, uint64_t range, uint64_t seed) {
+void shuffle_init(struct shuffle *r, uint64_t range, uint64_t seed,
+                  enum shuffle_type type) {
     double root = sqrt(range);
 
+    r->type = type;
+
     switch (range) {
     case 0:
-        r->a = 0;
-        r->b = 0;
-        break;
-
     case 1:
         r->a = 1;
         r->b = 1;
@@ -84,90 +101,180 @@ void shuffle_init(struct shuffle *r, uint64_t range, uint64_t seed) {
     r->range  = range;
     r->seed   = seed;
     r->rounds = ROUNDS;
+
+    /* everything that only depends on the seed and range is computed once */
+    r->key = wyhash16_key(seed);
+
+    fastdiv_init(&r->div_a, r->a);
+    fastdiv_init(&r->div_b, r->b);
+
+    if (type == SHUFFLE_CYCLIC)
+        cyclic_init(r);
+}
+
+static inline uint64_t do_cyclic(const struct shuffle *r, uint64_t m) {
+    return cyclic_mul(r, r->x0, cyclic_pow(r, r->g, m)) - 1;
 }
 
 uint64_t shuffle(struct shuffle *r, uint64_t m) {
     uint64_t c = m;
 
+    if (r->type == SHUFFLE_CYCLIC) {
+        do {
+            c = do_cyclic(r, c);
+        } while (c >= r->range);
+
+        return c;
+    }
+
     do {
-        c = do_shuffle(r->rounds, r->a, r->b,  c, r->seed);
+        c = do_shuffle(r, c);
     } while (c >= r->range);
 
     return c;
 }
 
+static void cyclic_batch(struct shuffle *r, uint64_t start, size_t n,
+                         uint64_t *out) {
+    uint64_t x = (start == r->next_m) ? r->next_x :
+                 cyclic_mul(r, r->x0, cyclic_pow(r, r->g, start));
+
+    for (size_t i = 0; i < n; i++) {
+        uint64_t c = x - 1;
+
+        while (c >= r->range)
+            c = do_cyclic(r, c);
+
+        out[i] = c;
+
+        x = cyclic_mul(r, x, r->g);
+    }
+
+    r->next_m = start + n;
+    r->next_x = x;
+}
+
+/*
+ * Same as calling shuffle() for each of the n indexes starting at start, and
+ * storing the results in out. The Feistel rounds of LANES consecutive indexes
+ * are interleaved, so that their multiplications can run in parallel instead of
+ * waiting on each other.
+ */
+void shuffle_batch(struct shuffle *r, uint64_t start, size_t n, uint64_t *out) {
+    size_t i = 0;
+
+    if (r->type == SHUFFLE_CYCLIC) {
+        cyclic_batch(r, start, n, out);
+        return;
+    }
+
+    for (; i + LANES <= n; i += LANES) {
+        uint64_t L[LANES], R[LANES];
+
+        for (unsigned k = 0; k < LANES; k++) {
+            uint64_t m = start + i + k;
+
+            R[k] = fastdiv_div(&r->div_a, m);
+            L[k] = m - R[k] * r->a;
+        }
+
+        for (unsigned j = 1; j <= r->rounds; j++) {
+            const struct fastdiv *div = (j & 1) ? &r->div_a : &r->div_b;
+
+            for (unsigned k = 0; k < LANES; k++) {
+                uint64_t tmp = L[k] + wyhash16_keyed(r->key, j, R[k]);
+
+                L[k] = R[k];
+                R[k] = fastdiv_mod(div, tmp);
+            }
+        }
+
+        for (unsigned k = 0; k < LANES; k++) {
+            uint64_t c = (r->rounds & 1) ? r->a * L[k] + R[k] :
+                                           r->a * R[k] + L[k];
+
+            /* cycle-walk the (rare) lanes that landed outside of the range */
+            while (c >= r->range)
+                c = do_shuffle(r, c);
+
+            out[i + k] = c;
+        }
+    }
+
+    for (; i < n; i++)
+        out[i] = shuffle(r, start + i);
+}
+
+/*
+ * Only supported by the Feistel cipher, inverting the cyclic group mapping
+ * would require computing discrete logarithms.
+ */
 uint64_t unshuffle(struct shuffle *r, uint64_t m) {
     uint64_t c = m;
 
+    assert(r->type == SHUFFLE_FEISTEL);
+
     do {
-        c = do_unshuffle(r->rounds, r->a, r->b,  c, r->seed);
+        c = do_unshuffle(r, c);
     } while (c >= r->range);
 
     return c;
 }
 
-static inline uint64_t F(uint64_t r, uint64_t R, uint64_t seed) {
-    uint64_t buf[2];
-    uint64_t key[2];
-
-    key[0] = seed;
-    key[1] = seed;
-
-    buf[0] = r;
-    buf[1] = R;
-
-    return pyrhash((const uint8_t *)key, (const uint8_t *)buf, sizeof(buf));
+static inline uint64_t F(const struct shuffle *r, unsigned j, uint64_t R) {
+    return wyhash16_keyed(r->key, j, R);
 }
 
-static inline uint64_t do_shuffle(unsigned r, uint64_t a, uint64_t b,
-                                  uint64_t m, uint64_t seed) {
+static inline uint64_t do_shuffle(const struct shuffle *r, uint64_t m) {
     uint64_t tmp;
 
-    uint64_t L = m % a;
-    uint64_t R = m / a;
+    uint64_t R = fastdiv_div(&r->div_a, m);
+    uint64_t L = m - R * r->a;
 
-    for (unsigned j = 1; j <= r; j++) {
-        tmp = (j & 1) ? (L + F(j, R, seed)) % a :
-                        (L + F(j, R, seed)) % b;
+    for (unsigned j = 1; j <= r->rounds; j++) {
+        tmp = (j & 1) ? fastdiv_mod(&r->div_a, L + F(r, j, R)) :
+                        fastdiv_mod(&r->div_b, L + F(r, j, R));
 
         L = R;
         R = tmp;
     }
 
-    return (r & 1) ? a * L + R :
-                     a * R + L;
+    return (r->rounds & 1) ? r->a * L + R :
+                             r->a * R + L;
 }
 
-static inline uint64_t do_unshuffle(unsigned r, uint64_t a, uint64_t b,
-                                    uint64_t m, uint64_t seed) {
+static inline uint64_t do_unshuffle(const struct shuffle *r, uint64_t m) {
     uint64_t L, R, tmp;
 
-    if (r & 1) {
-        R = m % a;
-        L = m / a;
+    uint64_t a = r->a;
+    uint64_t b = r->b;
+
+    if (r->rounds & 1) {
+        L = fastdiv_div(&r->div_a, m);
+        R = m - L * a;
     } else {
-        L = m % a;
-        R = m / a;
+        R = fastdiv_div(&r->div_a, m);
+        L = m - R * a;
     }
 
-    for (unsigned j = r; j >= 1; j--) {
-        tmp = F(j, L, seed) - R;
+    for (unsigned j = r->rounds; j >= 1; j--) {
+        tmp = F(r, j, L) - R;
 
         if (j & 1) {
             if (tmp > R) {
-                tmp = a - (tmp % a);
+                tmp = a - fastdiv_mod(&r->div_a, tmp);
                 if (tmp == a)
                     tmp = 0;
             } else {
-                tmp %= a;
+                tmp = fastdiv_mod(&r->div_a, tmp);
             }
         } else {
             if (tmp > R) {
-                tmp = b - (tmp % b);
+                tmp = b - fastdiv_mod(&r->div_b, tmp);
                 if (tmp == b)
                     tmp = 0;
             } else {
-                tmp %= b;
+                tmp = fastdiv_mod(&r->div_b, tmp);
             }
         }
 
@@ -177,3 +284,120 @@ static inline uint64_t do_unshuffle(unsigned r, uint64_t a, uint64_t b,
 
     return a * R + L;
 }
+
+static uint64_t mul_mod(uint64_t x, uint64_t y, uint64_t p) {
+    return (uint64_t) (((fastdiv_u128) x * y) % p);
+}
+
+static uint64_t pow_mod(uint64_t x, uint64_t e, uint64_t p) {
+    uint64_t res = 1 % p;
+
+    for (x %= p; e; e >>= 1) {
+        if (e & 1)
+            res = mul_mod(res, x, p);
+
+        x = mul_mod(x, x, p);
+    }
+
+    return res;
+}
+
+/*
+ * Deterministic Miller-Rabin primality test, the given bases are enough for
+ * all the 64-bit integers.
+ */
+static bool is_prime(uint64_t n) {
+    static const uint64_t bases[] = {
+        2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37
+    };
+
+    uint64_t d = n - 1;
+    unsigned s = 0;
+
+    if (n < 2)
+        return false;
+
+    for (size_t i = 0; i < sizeof(bases) / sizeof(bases[0]); i++) {
+        if (n == bases[i])
+            return true;
+
+        if (n % bases[i] == 0)
+            return false;
+    }
+
+    while ((d & 1) == 0) {
+        d >>= 1;
+        s++;
+    }
+
+    for (size_t i = 0; i < sizeof(bases) / sizeof(bases[0]); i++) {
+        uint64_t x = pow_mod(bases[i], d, n);
+
+        if ((x == 1) || (x == n - 1))
+            continue;
+
+        for (unsigned j = 1; j < s; j++) {
+            x = mul_mod(x, x, n);
+
+            if (x == n - 1)
+                break;
+        }
+
+        if (x != n - 1)
+            return false;
+    }
+
+    return true;
+}
+
+/*
+ * Pick the smallest safe prime p = 2q + 1 (with q prime) above the range. The
+ * group modulo p then has order 2q, so that g is a generator unless g^2 or g^q
+ * is 1, without having to factor the order.
+ */
+static void cyclic_init(struct shuffle *r) {
+    uint64_t q = (r->range / 2) + (r->range & 1);
+
+    if (q < 2)
+        q = 2;
+
+    while (!is_prime(q) || !is_prime(2 * q + 1))
+        q++;
+
+    r->p = 2 * q + 1;
+
+    fastdiv_init(&r->div_p, r->p);
+
+    r->g = 2 + wyhash16_keyed(r->key, 1, 0) % (r->p - 3);
+
+    while ((pow_mod(r->g, 2, r->p) == 1) || (pow_mod(r->g, q, r->p) == 1))
+        r->g = (r->g == r->p - 2) ? 2 : r->g + 1;
+
+    r->x0 = 1 + wyhash16_keyed(r->key, 2, 0) % (r->p - 1);
+
+    r->next_m = 0;
+    r->next_x = r->x0;
+}
+
+static inline uint64_t cyclic_mul(const struct shuffle *r, uint64_t x,
+                                  uint64_t y) {
+    /* with 32-bit operands the product fits in 64 bits */
+    if (r->p <= UINT32_MAX)
+        return fastdiv_mod(&r->div_p, x * y);
+
+    return mul_mod(x, y, r->p);
+}
+
+static inline uint64_t cyclic_pow(const struct shuffle *r, uint64_t x,
+                                  uint64_t e) {
+    uint64_t res = 1;
+
+    for (; e; e >>= 1) {
+        if (e & 1)
+            res = cyclic_mul(r, res, x);
+
+        x = cyclic_mul(r, x, x);
+    }
+
+    return res;
+}
@@ -28,13 +28,35 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+enum shuffle_type {
+    SHUFFLE_FEISTEL,
+    SHUFFLE_CYCLIC,
+};
+
 struct shuffle {
+    enum shuffle_type type;
+
     uint64_t range;
     uint64_t a, b;
     uint64_t seed;
     unsigned rounds;
+
+    /* round function key and divisions, precomputed by shuffle_init() */
+    uint64_t key;
+    struct fastdiv div_a;
+    struct fastdiv div_b;
+
+    /* cyclic group modulo the prime p, with generator g and offset x0 */
+    uint64_t p, g, x0;
+    struct fastdiv div_p;
+
+    /* index following the last shuffle_batch() and its group element, so
+     * that consecutive batches don't need to compute g^start again */
+    uint64_t next_m, next_x;
 };
 
-void shuffle_init(struct shuffle *r, uint64_t range, uint64_t seed);
+void shuffle_init(struct shuffle *r, uint64_t range, uint64_t seed,
+                  enum shuffle_type type);
 uint64_t shuffle(struct shuffle *r, uint64_t m);
+void shuffle_batch(struct shuffle *r, uint64_t start, size_t n, uint64_t *out);
 uint64_t unshuffle(struct shuffle *r, uint64_t m);
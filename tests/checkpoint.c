@@ -0,0 +1,68 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "clar/clar.h"
+
+#include "checkpoint.h"
+
+void test_checkpoint__save_load(void) {
+    struct checkpoint_slice slices[] = {
+        {    0,  500 },
+        {  777, 1000 },
+        { 1500, 1500 },
+    };
+
+    struct checkpoint ck = {
+        .seed           = 0xdeadbeefcafebabeULL,
+        .count          = 2,
+        .total          = 1500,
+        .targets        = UINT64_MAX,
+        .ports          = 42,
+        .shuffle        = true,
+        .shuffle_cyclic = true,
+        .shard          = 2,
+        .shards         = 5,
+        .pkt_sent       = 1234,
+        .pkt_probe      = 777,
+        .pkt_recv       = 56,
+        .slice_cnt      = 3,
+        .slices         = slices,
+    }, out;
+
+    cl_assert_equal_i(checkpoint_save("test.ckpt", &ck), 0);
+
+    /* saving again replaces the old checkpoint */
+    ck.pkt_recv = 78;
+    cl_assert_equal_i(checkpoint_save("test.ckpt", &ck), 0);
+
+    checkpoint_load("test.ckpt", &out);
+
+    cl_assert(out.seed == ck.seed);
+    cl_assert(out.count == ck.count);
+    cl_assert(out.total == ck.total);
+    cl_assert(out.targets == ck.targets);
+    cl_assert(out.ports == ck.ports);
+    cl_assert(out.shuffle && out.shuffle_cyclic);
+    cl_assert_equal_i(out.shard, 2);
+    cl_assert_equal_i(out.shards, 5);
+    cl_assert(out.pkt_sent == ck.pkt_sent);
+    cl_assert(out.pkt_probe == ck.pkt_probe);
+    cl_assert(out.pkt_recv == 78);
+
+    cl_assert_equal_i(out.slice_cnt, 3);
+    cl_assert(!memcmp(out.slices, slices, sizeof(slices)));
+
+    checkpoint_free(&out);
+
+    ck.shuffle        = false;
+    ck.shuffle_cyclic = false;
+    cl_assert_equal_i(checkpoint_save("test.ckpt", &ck), 0);
+
+    checkpoint_load("test.ckpt", &out);
+
+    cl_assert(!out.shuffle && !out.shuffle_cyclic);
+
+    checkpoint_free(&out);
+}
@@ -0,0 +1,299 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include <arpa/inet.h>
+
+#include "clar/clar.h"
+
+#include "queue.h"
+#include "pkt.h"
+
+/* 0x0000 and 0xffff are both valid representations of the same checksum */
+#define cl_assert_equal_chksum(A, B) \
+    cl_assert_equal_i((A) % 0xffff, (B) % 0xffff)
+
+struct frame {
+    uint8_t buf[2048];
+    size_t  len;
+
+    uint8_t *ip4;
+    uint8_t *l4;
+    size_t   l4_len;
+};
+
+static void load_frame(const char *name, struct frame *f) {
+    FILE *fp = fopen(cl_fixture(name), "rb");
+    cl_assert(fp != NULL);
+
+    f->len = fread(f->buf, 1, sizeof(f->buf), fp);
+    fclose(fp);
+
+    cl_assert(f->len > 14 + 20);
+
+    f->ip4    = f->buf + 14;
+    f->l4     = f->ip4 + ((f->ip4[0] & 0x0f) * 4);
+    f->l4_len = f->len - (f->l4 - f->buf);
+}
+
+static uint16_t *ip4_chksum(struct frame *f) {
+    return (uint16_t *) (f->ip4 + 10);
+}
+
+static uint16_t *l4_chksum(struct frame *f) {
+    switch (f->ip4[9]) {
+    case PROTO_ICMP:
+        return (uint16_t *) (f->l4 + 2);
+
+    case PROTO_UDP:
+        return (uint16_t *) (f->l4 + 6);
+
+    case PROTO_TCP:
+        return (uint16_t *) (f->l4 + 16);
+    }
+
+    return NULL;
+}
+
+static uint16_t full_ip4(struct frame *f) {
+    uint16_t old = *ip4_chksum(f);
+    uint16_t csum;
+
+    *ip4_chksum(f) = 0;
+    csum = pkt_chksum(f->ip4, (f->ip4[0] & 0x0f) * 4, 0);
+    *ip4_chksum(f) = old;
+
+    return csum;
+}
+
+static uint16_t full_l4(struct frame *f) {
+    uint16_t old = *l4_chksum(f);
+    uint32_t pseudo = 0;
+    uint16_t csum;
+
+    if (f->ip4[9] != PROTO_ICMP) {
+        struct ip4_hdr h;
+
+        memcpy(&h, f->ip4, sizeof(h));
+        h.len = ntohs(h.len);
+
+        pseudo = pkt_pseudo_chksum(&h);
+    }
+
+    *l4_chksum(f) = 0;
+    csum = pkt_chksum(f->l4, f->l4_len, pseudo);
+    *l4_chksum(f) = old;
+
+    return csum;
+}
+
+static void update16(struct frame *f, uint8_t *ptr, bool ip4, bool l4) {
+    uint16_t old, new = rand();
+
+    memcpy(&old, ptr, sizeof(old));
+    memcpy(ptr, &new, sizeof(new));
+
+    if (ip4)
+        *ip4_chksum(f) = pkt_chksum_update16(*ip4_chksum(f), old, new);
+
+    if (l4)
+        *l4_chksum(f) = pkt_chksum_update16(*l4_chksum(f), old, new);
+}
+
+static void update32(struct frame *f, uint8_t *ptr, bool ip4, bool l4) {
+    uint32_t old, new = ((uint32_t) rand() << 16) ^ rand();
+
+    memcpy(&old, ptr, sizeof(old));
+    memcpy(ptr, &new, sizeof(new));
+
+    if (ip4)
+        *ip4_chksum(f) = pkt_chksum_update32(*ip4_chksum(f), old, new);
+
+    if (l4)
+        *l4_chksum(f) = pkt_chksum_update32(*l4_chksum(f), old, new);
+}
+
+/* the TTL shares a 16 bit word with the protocol, which must not change */
+static void update_ttl(struct frame *f) {
+    uint16_t old, new;
+
+    memcpy(&old, f->ip4 + 8, sizeof(old));
+    f->ip4[8] = rand();
+    memcpy(&new, f->ip4 + 8, sizeof(new));
+
+    *ip4_chksum(f) = pkt_chksum_update16(*ip4_chksum(f), old, new);
+}
+
+/*
+ * Patch the same fields the template engine and the scripts usually change,
+ * and check that the incrementally updated checksums match the ones computed
+ * from scratch.
+ */
+static void check_updates(const char *name) {
+    struct frame f;
+
+    load_frame(name, &f);
+
+    bool pseudo = (f.ip4[9] != PROTO_ICMP);
+
+    *ip4_chksum(&f) = full_ip4(&f);
+    *l4_chksum(&f)  = full_l4(&f);
+
+    srand(42);
+
+    for (unsigned i = 0; i < 10000; i++) {
+        switch (i % 6) {
+        case 0: /* source address */
+            update32(&f, f.ip4 + 12, true, pseudo);
+            break;
+
+        case 1: /* destination address */
+            update32(&f, f.ip4 + 16, true, pseudo);
+            break;
+
+        case 2: /* IP id */
+            update16(&f, f.ip4 + 4, true, false);
+            break;
+
+        case 3: /* TTL */
+            update_ttl(&f);
+            break;
+
+        case 4: /* ports, or ICMP type/code */
+            update16(&f, f.l4, false, true);
+            break;
+
+        case 5: /* TCP seq, or ICMP id and seq */
+            if (f.ip4[9] == PROTO_UDP)
+                update16(&f, f.l4 + 2, false, true);
+            else
+                update32(&f, f.l4 + 4, false, true);
+            break;
+        }
+
+        cl_assert_equal_chksum(*ip4_chksum(&f), full_ip4(&f));
+        cl_assert_equal_chksum(*l4_chksum(&f), full_l4(&f));
+    }
+}
+
+void test_chksum__corpus(void) {
+    const char *names[] = { "ip4_icmp", "ip4_tcp", "ip4_udp" };
+
+    for (size_t i = 0; i < sizeof(names) / sizeof(*names); i++) {
+        struct frame f;
+
+        load_frame(names[i], &f);
+
+        cl_assert_equal_chksum(*ip4_chksum(&f), full_ip4(&f));
+    }
+}
+
+void test_chksum__icmp(void) {
+    check_updates("ip4_icmp");
+}
+
+void test_chksum__tcp(void) {
+    check_updates("ip4_tcp");
+}
+
+void test_chksum__udp(void) {
+    check_updates("ip4_udp");
+}
+
+/* straightforward RFC 1071 implementation, used as reference */
+static uint16_t ref_chksum(const uint8_t *buf, size_t len, uint32_t csum) {
+    uint64_t sum = csum;
+    uint16_t w;
+
+    for (size_t i = 0; i + 1 < len; i += 2) {
+        memcpy(&w, buf + i, sizeof(w));
+        sum += w;
+    }
+
+    if (len & 1) {
+        w = 0;
+        memcpy(&w, buf + len - 1, 1);
+        sum += w;
+    }
+
+    while (sum >> 16)
+        sum = (sum >> 16) + (sum & 0xFFFF);
+
+    return ~sum;
+}
+
+void test_chksum__empty(void) {
+    uint8_t buf[1] = { 0xff };
+
+    cl_assert_equal_i(pkt_chksum(buf, 0, 0), 0xffff);
+    cl_assert_equal_i(pkt_chksum(buf, 0, 0x1234), 0xffff & ~0x1234);
+}
+
+void test_chksum__kernels(void) {
+    const char *names[] = { "scalar", "sse2", "avx2" };
+
+    static uint8_t buf[4096 + 8];
+
+    srand(42);
+
+    for (size_t i = 0; i < sizeof(buf); i++)
+        buf[i] = rand();
+
+    for (size_t i = 0; i < sizeof(names) / sizeof(*names); i++) {
+        if (pkt_chksum_select(names[i]) < 0)
+            continue;
+
+        cl_assert_equal_s(pkt_chksum_impl(), names[i]);
+
+        for (size_t off = 0; off < 8; off++) {
+            for (size_t len = 0; len <= 4096; len += 1 + (len > 256) * 31) {
+                uint32_t csum = rand() & 0xFFFFF;
+
+                cl_assert_equal_i(pkt_chksum(buf + off, len, csum),
+                                  ref_chksum(buf + off, len, csum));
+            }
+        }
+
+        /* all ones, to exercise the carries */
+        memset(buf, 0xff, sizeof(buf));
+
+        cl_assert_equal_i(pkt_chksum(buf, sizeof(buf), 0xFFFFFFFF),
+                          ref_chksum(buf, sizeof(buf), 0xFFFFFFFF));
+
+        for (size_t j = 0; j < sizeof(buf); j++)
+            buf[j] = rand();
+    }
+
+    cl_assert_equal_i(pkt_chksum_select(NULL), 0);
+    cl_assert_equal_i(pkt_chksum_select("nonexistent"), -1);
+}
+
+void test_chksum__batch(void) {
+    static uint8_t data[64][1500];
+
+    uint8_t *bufs[64];
+    uint32_t csums[64];
+    uint16_t out[64];
+
+    srand(42);
+
+    for (size_t i = 0; i < 64; i++) {
+        for (size_t j = 0; j < sizeof(data[i]); j++)
+            data[i][j] = rand();
+
+        bufs[i]  = data[i];
+        csums[i] = rand() & 0xFFFF;
+    }
+
+    pkt_chksum_batch(bufs, 64, sizeof(data[0]), NULL, out);
+
+    for (size_t i = 0; i < 64; i++)
+        cl_assert_equal_i(out[i], pkt_chksum(bufs[i], sizeof(data[0]), 0));
+
+    pkt_chksum_batch(bufs, 64, 41, csums, out);
+
+    for (size_t i = 0; i < 64; i++)
+        cl_assert_equal_i(out[i], ref_chksum(bufs[i], 41, csums[i]));
+}
@@ -0,0 +1,81 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "clar/clar.h"
+
+#include "queue.h"
+#include "pkt.h"
+
+#define COOKIE_TUPLES 100
+
+static uint32_t saddrs[COOKIE_TUPLES];
+static uint32_t daddrs[COOKIE_TUPLES];
+static uint16_t sports[COOKIE_TUPLES];
+static uint16_t dports[COOKIE_TUPLES];
+
+static void fill_tuples(void) {
+    srand(42);
+
+    for (size_t i = 0; i < COOKIE_TUPLES; i++) {
+        saddrs[i] = rand();
+        daddrs[i] = rand();
+        sports[i] = rand();
+        dports[i] = rand();
+    }
+}
+
+static void check_batch(uint64_t seed) {
+    uint64_t out[COOKIE_TUPLES];
+
+    pkt_cookie_batch(saddrs, daddrs, sports, dports, COOKIE_TUPLES, seed, out);
+
+    for (size_t i = 0; i < COOKIE_TUPLES; i++) {
+        uint64_t cookie = pkt_cookie(saddrs[i], daddrs[i],
+                                     sports[i], dports[i], seed);
+
+        cl_assert(out[i] == cookie);
+    }
+}
+
+void test_cookie__legacy(void) {
+    pkt_cookie_legacy(true);
+
+    /* values computed by older versions */
+    cl_assert(pkt_cookie(0x0100000a, 0x04030201, 64434, 80,
+                         0x0123456789abcdefULL) == 0x04685be74d214246ULL);
+    cl_assert(pkt_cookie(0x0100a8c0, 0x08080808, 53, 53,
+                         42) == 0x04f6b9cdc0bcff4dULL);
+
+    fill_tuples();
+    check_batch(42);
+
+    pkt_cookie_legacy(false);
+
+    cl_assert(pkt_cookie(0x0100a8c0, 0x08080808, 53, 53,
+                         42) != 0x04f6b9cdc0bcff4dULL);
+}
+
+void test_cookie__batch(void) {
+    fill_tuples();
+
+    check_batch(0);
+    check_batch(42);
+    check_batch(0x0123456789abcdefULL);
+}
+
+void test_cookie__tuple(void) {
+    uint64_t seed = 0x0123456789abcdefULL;
+    uint64_t cookie = pkt_cookie(0x0100000a, 0x04030201, 64434, 80, seed);
+
+    /* every field of the tuple and the seed change the cookie */
+    cl_assert(pkt_cookie(0x0200000a, 0x04030201, 64434, 80, seed) != cookie);
+    cl_assert(pkt_cookie(0x0100000a, 0x04030202, 64434, 80, seed) != cookie);
+    cl_assert(pkt_cookie(0x0100000a, 0x04030201, 64435, 80, seed) != cookie);
+    cl_assert(pkt_cookie(0x0100000a, 0x04030201, 64434, 81, seed) != cookie);
+    cl_assert(pkt_cookie(0x0100000a, 0x04030201, 64434, 80, 0) != cookie);
+
+    /* swapping source and destination doesn't give the same cookie */
+    cl_assert(pkt_cookie(0x04030201, 0x0100000a, 80, 64434, seed) != cookie);
+}
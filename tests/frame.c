@@ -0,0 +1,81 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "clar/clar.h"
+
+#include "ut/utlist.h"
+
+#include "queue.h"
+#include "pkt.h"
+
+static size_t load(const char *name, uint8_t *buf, size_t len) {
+    FILE *fp = fopen(cl_fixture(name), "rb");
+    cl_assert(fp != NULL);
+
+    len = fread(buf, 1, len, fp);
+    fclose(fp);
+
+    return len;
+}
+
+/* the frame layers must match the ones found by pkt_unpack() */
+static void check_frame(uint8_t *buf, size_t len) {
+    struct pkt_frame f;
+    struct pkt *pkt = NULL, *cur;
+
+    int n = pkt_unpack(buf, len, &pkt);
+
+    cl_assert_equal_i(pkt_frame_parse(&f, buf, len), n);
+
+    unsigned i = 0;
+
+    DL_FOREACH(pkt, cur) {
+        struct pkt p;
+
+        cl_assert_equal_i(f.layers[i].type, cur->type);
+
+        if (cur->type != TYPE_ARP) {
+            cl_assert(pkt_frame_layer(&f, i, &p) >= 0);
+
+            cl_assert_equal_i(p.type, cur->type);
+            cl_assert_equal_i(p.length, cur->length);
+
+            if (cur->type == TYPE_RAW) {
+                cl_assert_equal_i(p.p.raw.len, cur->p.raw.len);
+                cl_assert(p.p.raw.payload == cur->p.raw.payload);
+            } else {
+                cl_assert(!memcmp(&p.p, &cur->p, sizeof(p.p)));
+            }
+        }
+
+        i++;
+    }
+
+    pkt_free_all(pkt);
+}
+
+void test_frame__corpus(void) {
+    const char *names[] = { "arp", "ip4_icmp", "ip4_tcp", "ip4_udp" };
+
+    for (size_t i = 0; i < sizeof(names) / sizeof(*names); i++) {
+        uint8_t buf[2048];
+        size_t len = load(names[i], buf, sizeof(buf));
+
+        check_frame(buf, len);
+    }
+}
+
+void test_frame__truncated(void) {
+    const char *names[] = { "ip4_icmp", "ip4_tcp", "ip4_udp" };
+
+    for (size_t i = 0; i < sizeof(names) / sizeof(*names); i++) {
+        uint8_t buf[2048];
+        size_t len = load(names[i], buf, sizeof(buf));
+
+        for (size_t j = 0; j <= len; j++)
+            check_frame(buf, j);
+    }
+}
@@ -0,0 +1,182 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include <pthread.h>
+
+#include "clar/clar.h"
+
+#include "output.h"
+
+static char *read_file(const char *path, size_t *len) {
+    static char buf[4096];
+
+    FILE *f = fopen(path, "r");
+    cl_assert(f != NULL);
+
+    *len = fread(buf, 1, sizeof(buf) - 1, f);
+    buf[*len] = '\0';
+
+    fclose(f);
+
+    return buf;
+}
+
+static void push_result(struct output_ring *ring, const char *addr,
+                        int64_t port, bool open, double rtt) {
+    struct output_rec rec;
+
+    output_rec_init(&rec);
+    output_rec_str(&rec, "addr", 4, addr, strlen(addr));
+    output_rec_bool(&rec, "open", 4, open);
+    output_rec_int(&rec, "port", 4, port);
+    output_rec_num(&rec, "rtt", 3, rtt);
+
+    cl_assert(output_push(ring, &rec));
+}
+
+void test_output__json(void) {
+    struct output out;
+    size_t len;
+
+    output_open(&out, "out.json", OUTPUT_JSON);
+
+    struct output_ring *ring = output_ring_new(&out);
+
+    push_result(ring, "10.0.0.1", 80, true, 0.5);
+    push_result(ring, "a\"b\\c\n", -1, false, 1e100);
+
+    output_close(&out);
+
+    cl_assert_equal_s(read_file("out.json", &len),
+        "{\"addr\":\"10.0.0.1\",\"open\":true,\"port\":80,\"rtt\":0.5}\n"
+        "{\"addr\":\"a\\\"b\\\\c\\u000a\",\"open\":false,\"port\":-1,"
+        "\"rtt\":1e+100}\n");
+
+    cl_assert_equal_i(out.records, 2);
+    cl_assert_equal_i(out.drops, 0);
+}
+
+void test_output__csv(void) {
+    struct output out;
+    size_t len;
+
+    output_open(&out, "out.csv", OUTPUT_CSV);
+
+    struct output_ring *ring = output_ring_new(&out);
+
+    push_result(ring, "10.0.0.1", 80, true, 0.25);
+    push_result(ring, "x,\"y\"", 443, false, 2);
+
+    output_close(&out);
+
+    cl_assert_equal_s(read_file("out.csv", &len),
+        "addr,open,port,rtt\n"
+        "10.0.0.1,true,80,0.25\n"
+        "\"x,\"\"y\"\"\",false,443,2\n");
+}
+
+void test_output__binary(void) {
+    struct output out;
+    struct output_rec rec;
+    size_t len;
+
+    output_open(&out, "out.bin", OUTPUT_BINARY);
+
+    struct output_ring *ring = output_ring_new(&out);
+
+    output_rec_init(&rec);
+    output_rec_int(&rec, "port", 4, 80);
+
+    cl_assert(output_push(ring, &rec));
+
+    output_close(&out);
+
+    char *buf = read_file("out.bin", &len);
+
+    cl_assert_equal_i(len, rec.len);
+    cl_assert(!memcmp(buf, rec.buf, len));
+}
+
+void test_output__drops(void) {
+    struct output out;
+    struct output_rec rec;
+
+    static char big[OUTPUT_REC_MAX];
+
+    output_open(&out, "out.json", OUTPUT_JSON);
+
+    struct output_ring *ring = output_ring_new(&out);
+
+    /* records that don't fit are dropped, not truncated */
+    output_rec_init(&rec);
+    output_rec_str(&rec, "data", 4, big, sizeof(big));
+
+    cl_assert(rec.overflow);
+    cl_assert(!output_push(ring, &rec));
+
+    cl_assert_equal_i(output_drops(&out), 1);
+
+    output_close(&out);
+
+    cl_assert_equal_i(out.records, 0);
+    cl_assert_equal_i(out.drops, 1);
+}
+
+static void *producer_cb(void *p) {
+    struct output_ring *ring = p;
+    struct output_rec rec;
+
+    for (int64_t i = 0; i < 100000; i++) {
+        output_rec_init(&rec);
+        output_rec_int(&rec, "i", 1, i);
+
+        while (!output_push(ring, &rec))
+            ;
+    }
+
+    return NULL;
+}
+
+void test_output__threads(void) {
+    struct output out;
+    pthread_t threads[4];
+
+    output_open(&out, "out.json", OUTPUT_JSON);
+
+    for (int i = 0; i < 4; i++) {
+        struct output_ring *ring = output_ring_new(&out);
+
+        pthread_create(&threads[i], NULL, producer_cb, ring);
+    }
+
+    for (int i = 0; i < 4; i++)
+        pthread_join(threads[i], NULL);
+
+    output_close(&out);
+
+    cl_assert_equal_i(out.records, 400000);
+
+    /* the producers retry, so drops are only the failed attempts */
+    FILE *f = fopen("out.json", "r");
+    cl_assert(f != NULL);
+
+    char line[64];
+    int64_t sum = 0, lines = 0;
+
+    while (fgets(line, sizeof(line), f)) {
+        long long v;
+
+        cl_assert(sscanf(line, "{\"i\":%lld}", &v) == 1);
+
+        sum += v;
+        lines++;
+    }
+
+    fclose(f);
+
+    cl_assert_equal_i(lines, 400000);
+    cl_assert(sum == 4 * (99999LL * 100000 / 2));
+}
@@ -0,0 +1,113 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include <pthread.h>
+
+#include "clar/clar.h"
+
+#include "queue.h"
+#include "pkt.h"
+
+static struct pkt_pool pool;
+
+void test_pool__initialize(void) {
+    pkt_pool_init(&pool);
+    pkt_pool_attach(&pool);
+}
+
+void test_pool__cleanup(void) {
+    pkt_pool_attach(NULL);
+    pkt_pool_destroy(&pool);
+}
+
+void test_pool__reuse(void) {
+    struct pkt *pkts[10];
+
+    for (int i = 0; i < 10; i++) {
+        pkts[i] = pkt_new(TYPE_TCP);
+
+        cl_assert(pkts[i]->pool == &pool);
+        cl_assert_equal_i(pkts[i]->length, 20);
+    }
+
+    cl_assert_equal_i(pool.used, 10);
+    cl_assert_equal_i(pool.peak, 10);
+
+    for (int i = 0; i < 10; i++)
+        pkt_free(pkts[i]);
+
+    cl_assert_equal_i(pool.used, 0);
+
+    /* the free list is LIFO */
+    for (int i = 9; i >= 0; i--) {
+        struct pkt *p = pkt_new(TYPE_UDP);
+
+        cl_assert(p == pkts[i]);
+        cl_assert_equal_i(p->refcnt, 1);
+        cl_assert_equal_i(p->length, 8);
+    }
+
+    cl_assert_equal_i(pool.peak, 10);
+    cl_assert_equal_i(pool.size, 256);
+}
+
+void test_pool__refcnt(void) {
+    struct pkt *p = pkt_new(TYPE_IP4);
+
+    p->refcnt++;
+
+    pkt_free(p);
+    cl_assert_equal_i(pool.used, 1);
+
+    pkt_free(p);
+    cl_assert_equal_i(pool.used, 0);
+}
+
+void test_pool__heap(void) {
+    pkt_pool_attach(NULL);
+
+    struct pkt *p = pkt_new(TYPE_ICMP);
+    cl_assert(p->pool == NULL);
+
+    pkt_free(p);
+
+    cl_assert_equal_i(pool.used, 0);
+    cl_assert_equal_i(pool.size, 0);
+}
+
+static void *free_cb(void *arg) {
+    struct pkt **pkts = arg;
+
+    for (int i = 0; i < 1000; i++)
+        pkt_free(pkts[i]);
+
+    return NULL;
+}
+
+void test_pool__remote(void) {
+    pthread_t thread;
+
+    static struct pkt *pkts[1000];
+
+    for (int i = 0; i < 1000; i++)
+        pkts[i] = pkt_new(TYPE_RAW);
+
+    cl_assert_equal_i(pool.size, 1024);
+
+    cl_assert_equal_i(pthread_create(&thread, NULL, free_cb, pkts), 0);
+    cl_assert_equal_i(pthread_join(thread, NULL), 0);
+
+    /* the remote frees are only accounted once reclaimed */
+    cl_assert_equal_i(pool.used, 1000);
+    cl_assert(pool.remote != NULL);
+
+    for (int i = 0; i < 1024; i++)
+        pkt_new(TYPE_RAW);
+
+    cl_assert(pool.remote == NULL);
+    cl_assert_equal_i(pool.used, 1024);
+    cl_assert_equal_i(pool.peak, 1024);
+    cl_assert_equal_i(pool.size, 1024);
+}
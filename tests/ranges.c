@@ -0,0 +1,432 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <sys/wait.h>
+
+#include "clar/clar.h"
+
+#include "ranges.h"
+#include "netdev.h"
+#include "resolv.h"
+
+#define make_list(RANGES, N) (&(struct range_list) { N, N, RANGES })
+
+/* host names are never resolved by the tests, see parse_target() */
+int resolv_name_to_addr(const char *name, uint32_t *addr) {
+    return -1;
+}
+
+static void write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t rc = write(fd, buf, len);
+        cl_assert(rc > 0);
+
+        buf += rc;
+        len -= rc;
+    }
+}
+
+static void parse_file(struct range_list *list, const char *data) {
+    int fd = open("targets.txt", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    cl_assert(fd >= 0);
+
+    write_all(fd, data, strlen(data));
+    close(fd);
+
+    range_parse_file(list, "targets.txt");
+}
+
+/* feed the data to range_parse_file() through a pipe replacing stdin */
+static void parse_pipe(struct range_list *list, const char *data, size_t len) {
+    int fds[2], status;
+
+    cl_assert(pipe(fds) == 0);
+
+    pid_t pid = fork();
+    cl_assert(pid >= 0);
+
+    if (pid == 0) {
+        close(fds[0]);
+        write_all(fds[1], data, len);
+        _exit(0);
+    }
+
+    close(fds[1]);
+
+    int in = dup(STDIN_FILENO);
+    cl_assert(dup2(fds[0], STDIN_FILENO) == STDIN_FILENO);
+    close(fds[0]);
+
+    range_parse_file(list, "-");
+
+    cl_assert(dup2(in, STDIN_FILENO) == STDIN_FILENO);
+    close(in);
+
+    cl_assert(waitpid(pid, &status, 0) == pid);
+    cl_assert(WIFEXITED(status) && (WEXITSTATUS(status) == 0));
+}
+
+void test_ranges__merge(void) {
+    struct range ranges[] = {
+        { 100, 199 },
+        {  10,  19 },
+        { 150, 250 },
+        {  20,  29 },
+        { 120, 130 },
+        {   5,   5 },
+    };
+
+    struct range_set set;
+
+    range_set_init(&set, make_list(ranges, 6), NULL);
+
+    /* [5], [10-19], [20-29] and [100-250] */
+    cl_assert_equal_i(set.cnt, 4);
+    cl_assert_equal_i(range_set_count(&set), 1 + 20 + 151);
+
+    cl_assert_equal_i(range_set_pick(&set, 0), 5);
+    cl_assert_equal_i(range_set_pick(&set, 1), 10);
+    cl_assert_equal_i(range_set_pick(&set, 20), 29);
+    cl_assert_equal_i(range_set_pick(&set, 21), 100);
+    cl_assert_equal_i(range_set_pick(&set, 171), 250);
+
+    range_set_free(&set);
+}
+
+void test_ranges__edges(void) {
+    struct range all[] = { { 0, UINT32_MAX } };
+    struct range top[] = {
+        { UINT32_MAX, UINT32_MAX },
+        { UINT32_MAX - 1, UINT32_MAX },
+    };
+
+    struct range_set set;
+
+    range_set_init(&set, make_list(all, 1), NULL);
+
+    cl_assert(range_set_count(&set) == 1ULL << 32);
+    cl_assert(range_set_pick(&set, 0) == 0);
+    cl_assert(range_set_pick(&set, UINT32_MAX) == UINT32_MAX);
+
+    range_set_free(&set);
+
+    range_set_init(&set, make_list(top, 2), NULL);
+
+    cl_assert_equal_i(set.cnt, 1);
+    cl_assert(range_set_pick(&set, 1) == UINT32_MAX);
+
+    range_set_free(&set);
+
+    range_set_init(&set, make_list(NULL, 0), NULL);
+
+    cl_assert_equal_i(range_set_count(&set), 0);
+
+    range_set_free(&set);
+}
+
+void test_ranges__pick(void) {
+    size_t n = 10000;
+
+    struct range *ranges = calloc(n, sizeof(*ranges));
+    struct range_set set;
+
+    /* disjoint ranges of growing size, added in reverse order */
+    for (size_t i = 0; i < n; i++) {
+        uint32_t start = (n - i - 1) * 100;
+
+        ranges[i].start = start;
+        ranges[i].end   = start + ((n - i - 1) % 50);
+    }
+
+    range_set_init(&set, make_list(ranges, n), NULL);
+
+    cl_assert_equal_i(set.cnt, n);
+
+    uint64_t index = 0;
+
+    for (size_t i = 0; i < n; i++) {
+        for (uint32_t j = 0; j <= i % 50; j++)
+            cl_assert(range_set_pick(&set, index++) == i * 100 + j);
+    }
+
+    cl_assert(range_set_count(&set) == index);
+
+    range_set_free(&set);
+    free(ranges);
+}
+
+void test_ranges__exclude(void) {
+    struct range ranges[] = {
+        {   0,  99 },
+        { 200, 299 },
+        { 400, 499 },
+    };
+
+    struct range exclude[] = {
+        {  50, 249 },
+        {  10,  19 },
+        { 280, 410 },
+        { 499, 600 },
+        { 700, 800 },
+    };
+
+    struct range_set set;
+
+    range_set_init(&set, make_list(ranges, 3), make_list(exclude, 5));
+
+    /* [0-9], [20-49], [250-279] and [411-498] */
+    cl_assert_equal_i(set.cnt, 4);
+    cl_assert_equal_i(range_set_count(&set), 10 + 30 + 30 + 88);
+
+    cl_assert_equal_i(range_set_pick(&set, 9), 9);
+    cl_assert_equal_i(range_set_pick(&set, 10), 20);
+    cl_assert_equal_i(range_set_pick(&set, 40), 250);
+    cl_assert_equal_i(range_set_pick(&set, 70), 411);
+    cl_assert_equal_i(range_set_pick(&set, 157), 498);
+
+    range_set_free(&set);
+}
+
+void test_ranges__exclude_all(void) {
+    struct range all[] = { { 0, UINT32_MAX } };
+    struct range half[] = { { 0x80000000, UINT32_MAX } };
+
+    struct range_set set;
+
+    range_set_init(&set, make_list(all, 1), make_list(half, 1));
+
+    cl_assert_equal_i(set.cnt, 1);
+    cl_assert(range_set_count(&set) == 1ULL << 31);
+
+    range_set_free(&set);
+
+    range_set_init(&set, make_list(half, 1), make_list(all, 1));
+
+    cl_assert_equal_i(set.cnt, 0);
+    cl_assert_equal_i(range_set_count(&set), 0);
+
+    range_set_free(&set);
+}
+
+void test_ranges__exclude_targets(void) {
+    struct range targets[] = { { 10, 20 }, { 30, 40 }, { 45, 45 } };
+    struct range exclude[] = { { 0, 25 }, { 28, 50 } };
+
+    struct range_set set;
+
+    range_set_init(&set, make_list(targets, 3), make_list(exclude, 2));
+
+    cl_assert_equal_i(set.cnt, 0);
+    cl_assert_equal_i(range_set_count(&set), 0);
+
+    range_set_free(&set);
+}
+
+void test_ranges__exclude_many(void) {
+    size_t n = 100000;
+
+    struct range all[] = { { 0, UINT32_MAX } };
+    struct range *exclude = calloc(n, sizeof(*exclude));
+    struct range_set set;
+
+    /* one /24 out of every /16, in reverse order */
+    for (size_t i = 0; i < n; i++) {
+        exclude[i].start = (n - i - 1) << 16;
+        exclude[i].end   = exclude[i].start + 255;
+    }
+
+    range_set_init(&set, make_list(all, 1), make_list(exclude, n));
+
+    cl_assert_equal_i(set.cnt, 65536);
+    cl_assert(range_set_count(&set) == (1ULL << 32) - 65536 * 256);
+
+    cl_assert(range_set_pick(&set, 0) == 256);
+    cl_assert(range_set_pick(&set, 65535 - 256) == 65535);
+    cl_assert(range_set_pick(&set, 65536 - 256) == 65536 + 256);
+
+    range_set_free(&set);
+    free(exclude);
+}
+
+void test_ranges__sparse(void) {
+    size_t n = 100000;
+
+    struct range *ranges = calloc(n, sizeof(*ranges));
+    struct range_set set;
+
+    /* single addresses in scrambled order, with one duplicate */
+    for (size_t i = 0; i < n; i++) {
+        uint32_t addr = ((i * 7919) % n) * 40503 + 7;
+
+        ranges[i].start = addr;
+        ranges[i].end   = addr;
+    }
+
+    ranges[n - 1] = ranges[0];
+
+    range_set_init(&set, make_list(ranges, n), NULL);
+
+    cl_assert_equal_i(set.cnt, n - 1);
+    cl_assert(set.offs == NULL);
+    cl_assert(range_set_count(&set) == n - 1);
+
+    for (size_t i = 0; i < n - 1; i++) {
+        uint32_t addr = range_set_pick(&set, i);
+
+        cl_assert((addr - 7) % 40503 == 0);
+
+        if (i > 0)
+            cl_assert(addr > range_set_pick(&set, i - 1));
+    }
+
+    range_set_free(&set);
+    free(ranges);
+}
+
+void test_ranges__file(void) {
+    struct range_list list = { 0 };
+    struct range_set set;
+
+    parse_file(&list,
+        "# comment\n"
+        "\n"
+        "  10.0.0.1  \r\n"
+        "10.0.1.7/24 # another comment\n"
+        "\t192.168.0.0/32\n"
+        "10.1/16\n"
+        "   \t\r\n"
+        "172.16.0.1");
+
+    /* 10.1/16 isn't a full dotted-quad, so it's left to parse_target() */
+    cl_assert_equal_i(list.cnt, 5);
+
+    range_set_init(&set, &list, NULL);
+    range_list_free(&list);
+
+    /* [10.0.0.1], [10.0.1.0/24], [10.1.0.0/16], [172.16.0.1], [192.168.0.0] */
+    cl_assert_equal_i(set.cnt, 5);
+    cl_assert_equal_i(range_set_count(&set), 1 + 256 + 65536 + 1 + 1);
+
+    cl_assert(range_set_pick(&set, 0) == 0x0a000001);
+    cl_assert(range_set_pick(&set, 1) == 0x0a000100);
+    cl_assert(range_set_pick(&set, 256) == 0x0a0001ff);
+    cl_assert(range_set_pick(&set, 257) == 0x0a010000);
+    cl_assert(range_set_pick(&set, 65793) == 0xac100001);
+    cl_assert(range_set_pick(&set, 65794) == 0xc0a80000);
+
+    range_set_free(&set);
+}
+
+void test_ranges__file_prefix(void) {
+    struct range_list list = { 0 };
+    struct range_set set;
+
+    parse_file(&list, "1.2.3.4/0\n255.255.255.255/32\n");
+
+    cl_assert_equal_i(list.cnt, 2);
+
+    cl_assert(list.ranges[0].start == 0);
+    cl_assert(list.ranges[0].end == UINT32_MAX);
+    cl_assert(list.ranges[1].start == UINT32_MAX);
+    cl_assert(list.ranges[1].end == UINT32_MAX);
+
+    range_set_init(&set, &list, NULL);
+    range_list_free(&list);
+
+    cl_assert_equal_i(set.cnt, 1);
+    cl_assert(range_set_count(&set) == 1ULL << 32);
+
+    range_set_free(&set);
+
+    /* not dotted-quads parse_cidr() can read, so they are left to
+     * parse_target(), which still accepts them */
+    parse_file(&list, "0010.0.0.1\n0x0b000000/8\n12/8\n");
+
+    cl_assert_equal_i(list.cnt, 3);
+
+    cl_assert(list.ranges[0].start == 0x0a000001);
+    cl_assert(list.ranges[0].end == 0x0a000001);
+    cl_assert(list.ranges[1].start == 0x0b000000);
+    cl_assert(list.ranges[1].end == 0x0bffffff);
+    cl_assert(list.ranges[2].start == 0x0c000000);
+    cl_assert(list.ranges[2].end == 0x0cffffff);
+
+    range_list_free(&list);
+}
+
+void test_ranges__stdin(void) {
+    struct range_list list = { 0 };
+    struct range_set set;
+
+    size_t pad = READ_CHUNK - 4;
+
+    char *data = malloc(pad + 64);
+    cl_assert(data != NULL);
+
+    /* a comment line that ends right before the end of the read buffer, so
+     * that the next line is split between two buffer fills */
+    memset(data, 'x', pad);
+    data[0]       = '#';
+    data[pad - 1] = '\n';
+
+    strcpy(data + pad, "10.0.0.1\r\n 10.0.0.0/30 \n10.0.0.9");
+
+    parse_pipe(&list, data, strlen(data));
+    free(data);
+
+    cl_assert_equal_i(list.cnt, 3);
+
+    range_set_init(&set, &list, NULL);
+    range_list_free(&list);
+
+    /* [10.0.0.0-3] and [10.0.0.9] */
+    cl_assert_equal_i(set.cnt, 2);
+    cl_assert_equal_i(range_set_count(&set), 5);
+
+    cl_assert(range_set_pick(&set, 0) == 0x0a000000);
+    cl_assert(range_set_pick(&set, 4) == 0x0a000009);
+
+    range_set_free(&set);
+
+    /* nothing but comments and blank lines */
+    const char *empty = "# nothing\n\n\r\n";
+    parse_pipe(&list, empty, strlen(empty));
+
+    cl_assert_equal_i(list.cnt, 0);
+}
+
+void test_ranges__ports(void) {
+    struct range_list list = { 0 };
+    int status;
+
+    range_parse_ports(&list, "80,1-3,443-443");
+
+    cl_assert_equal_i(list.cnt, 3);
+
+    cl_assert_equal_i(list.ranges[0].start, 80);
+    cl_assert_equal_i(list.ranges[0].end, 80);
+    cl_assert_equal_i(list.ranges[1].start, 1);
+    cl_assert_equal_i(list.ranges[1].end, 3);
+    cl_assert_equal_i(list.ranges[2].start, 443);
+    cl_assert_equal_i(list.ranges[2].end, 443);
+
+    range_list_free(&list);
+
+    /* a reversed range is fatal */
+    pid_t pid = fork();
+    cl_assert(pid >= 0);
+
+    if (pid == 0) {
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDERR_FILENO);
+
+        range_parse_ports(&list, "90-80");
+        _exit(0);
+    }
+
+    cl_assert(waitpid(pid, &status, 0) == pid);
+    cl_assert(WIFEXITED(status) && (WEXITSTATUS(status) == EXIT_FAILURE));
+}
@@ -1,15 +1,17 @@
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 
 #include "clar/clar.h"
 
+#include "fastdiv.h"
 #include "shuffle.h"
 
 void test_shuffle__simple(void) {
     struct shuffle r;
 
-    shuffle_init(&r, 100, 500);
+    shuffle_init(&r, 100, 500, SHUFFLE_FEISTEL);
 
     for (uint64_t i = 0; i < 100; i++) {
         uint64_t res  = shuffle(&r, i);
@@ -19,13 +21,21 @@ void test_shuffle__simple(void) {
     }
 }
 
+void test_shuffle__empty(void) {
+    struct shuffle r;
+
+    /* an empty range must not hang */
+    shuffle_init(&r, 0, 500, SHUFFLE_FEISTEL);
+    shuffle_init(&r, 0, 500, SHUFFLE_CYCLIC);
+}
+
 void test_shuffle__verify(void) {
     struct shuffle r;
 
     for (unsigned i = 1; i <= 1000; i++) {
         uint64_t *results = calloc(i, sizeof(uint64_t));
 
-        shuffle_init(&r, i, time(NULL));
+        shuffle_init(&r, i, time(NULL), SHUFFLE_FEISTEL);
 
         for (unsigned j = 0; j < i; j++) {
             uint64_t res = shuffle(&r, j);
@@ -43,3 +53,149 @@ void test_shuffle__verify(void) {
         free(results);
     }
 }
+
+void test_shuffle__batch(void) {
+    struct shuffle r;
+
+    uint64_t out[67];
+
+    for (unsigned i = 1; i <= 1000; i++) {
+        shuffle_init(&r, i, i * 7919, SHUFFLE_FEISTEL);
+
+        /* unaligned starts and lengths, to cover the non batched tail too */
+        for (uint64_t start = 0; start < i; start += 67) {
+            size_t n = (i - start < 67) ? (i - start) : 67;
+
+            shuffle_batch(&r, start, n, out);
+
+            for (size_t j = 0; j < n; j++)
+                cl_assert(out[j] == shuffle(&r, start + j));
+        }
+    }
+}
+
+void test_shuffle__bijective(void) {
+    static const uint64_t ranges[] = { 1, 2, 3, 4, 5, 64, 255, 65536, 196613 };
+
+    struct shuffle r;
+
+    for (size_t i = 0; i < sizeof(ranges) / sizeof(ranges[0]); i++) {
+        uint64_t range = ranges[i];
+
+        uint8_t  *seen = calloc(range, 1);
+        uint64_t *out  = calloc(range, sizeof(uint64_t));
+
+        shuffle_init(&r, range, time(NULL), SHUFFLE_FEISTEL);
+        shuffle_batch(&r, 0, range, out);
+
+        /* every index is generated exactly once */
+        for (uint64_t j = 0; j < range; j++) {
+            cl_assert(out[j] < range);
+            cl_assert_equal_i(seen[out[j]], 0);
+
+            seen[out[j]] = 1;
+
+            cl_assert(unshuffle(&r, out[j]) == j);
+        }
+
+        free(seen);
+        free(out);
+    }
+}
+
+void test_shuffle__cyclic(void) {
+    static const uint64_t ranges[] = { 65536, 196613 };
+
+    struct shuffle r;
+
+    uint64_t out[1000];
+    uint8_t  seen[1000];
+
+    for (unsigned i = 1; i <= 1000; i++) {
+        shuffle_init(&r, i, i * 7919, SHUFFLE_CYCLIC);
+
+        cl_assert(r.p > i);
+
+        memset(seen, 0, sizeof(seen));
+
+        shuffle_batch(&r, 0, i, out);
+
+        for (unsigned j = 0; j < i; j++) {
+            cl_assert(out[j] < i);
+            cl_assert_equal_i(seen[out[j]], 0);
+            cl_assert(out[j] == shuffle(&r, j));
+
+            seen[out[j]] = 1;
+        }
+    }
+
+    for (size_t i = 0; i < sizeof(ranges) / sizeof(ranges[0]); i++) {
+        uint64_t range = ranges[i];
+
+        uint8_t  *seen = calloc(range, 1);
+        uint64_t *all  = calloc(range, sizeof(uint64_t));
+
+        shuffle_init(&r, range, time(NULL), SHUFFLE_CYCLIC);
+        shuffle_batch(&r, 0, range, all);
+
+        for (uint64_t j = 0; j < range; j++) {
+            cl_assert(all[j] < range);
+            cl_assert_equal_i(seen[all[j]], 0);
+
+            seen[all[j]] = 1;
+        }
+
+        free(seen);
+        free(all);
+    }
+
+    /* products modulo primes above 2^32 don't fit in 64 bits */
+    shuffle_init(&r, 0x1000000000ULL, 42, SHUFFLE_CYCLIC);
+    shuffle_batch(&r, 0xfffffff00ULL, 1000, out);
+
+    for (unsigned j = 0; j < 1000; j++) {
+        cl_assert(out[j] < 0x1000000000ULL);
+        cl_assert(out[j] == shuffle(&r, 0xfffffff00ULL + j));
+    }
+}
+
+void test_shuffle__cyclic_batch(void) {
+    struct shuffle r;
+
+    uint64_t out[67];
+
+    shuffle_init(&r, 100000, 7919, SHUFFLE_CYCLIC);
+
+    /* consecutive batches continue from the previous one, others don't */
+    for (uint64_t start = 0; start < 5000; start += 67) {
+        uint64_t from = ((start / 67) % 5 == 0) ? start + 50000 : start;
+
+        shuffle_batch(&r, from, 67, out);
+
+        for (size_t j = 0; j < 67; j++)
+            cl_assert(out[j] == shuffle(&r, from + j));
+    }
+}
+
+void test_shuffle__fastdiv(void) {
+    static const uint64_t divs[] = {
+        1, 2, 3, 7, 10, 641, 65535, 65536, 65537, 4294967295ULL,
+        4294967296ULL, 4294967297ULL, 0x8000000000000001ULL, UINT64_MAX
+    };
+
+    static const uint64_t nums[] = {
+        0, 1, 2, 641, 65536, 4294967295ULL, 4294967296ULL,
+        0x123456789abcdefULL, 0x8000000000000000ULL, UINT64_MAX - 1, UINT64_MAX
+    };
+
+    for (size_t i = 0; i < sizeof(divs) / sizeof(divs[0]); i++) {
+        struct fastdiv f;
+
+        fastdiv_init(&f, divs[i]);
+
+        for (size_t j = 0; j < sizeof(nums) / sizeof(nums[0]); j++) {
+            cl_assert(fastdiv_div(&f, nums[j]) == nums[j] / divs[i]);
+            cl_assert(fastdiv_mod(&f, nums[j]) == nums[j] % divs[i]);
+        }
+    }
+}